@@ -0,0 +1,54 @@
+#!/bin/sh
+# Runs scripts both ways, interpreted and compiled through --emit-cpp, and checks
+# that they print the same and exit with the same status.
+#
+#   emit/compare.sh [script.hy ...]     (default: program.hy and bench/*.hy)
+#
+# HY names the interpreter to use; without it one is built from hyperLanguage.cpp.
+# CXX and CXXFLAGS pick the compiler for the generated programs.
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:--std=c++17 -O2 -pthread}
+
+if [ -z "$HY" ]; then
+    HY="$work/hyperLanguage"
+    $CXX $CXXFLAGS -o "$HY" "$root/hyperLanguage.cpp" || exit 1
+fi
+if [ $# -eq 0 ]; then
+    set -- "$root/program.hy" "$root"/bench/*.hy
+fi
+
+failed=0
+for script in "$@"; do
+    name=$(basename "$script" .hy)
+    "$HY" "$script" > "$work/$name.expected" 2>/dev/null
+    expected=$?
+    # A script that does not parse fails the same way in both modes
+    if ! "$HY" --emit-cpp "$script" > "$work/$name.cpp"; then
+        if [ $expected -eq 0 ] || ! cmp -s "$work/$name.expected" "$work/$name.cpp"; then
+            echo "FALHOU $script: --emit-cpp"
+            failed=1
+        else
+            echo "ok     $script"
+        fi
+        continue
+    fi
+    if ! $CXX $CXXFLAGS -I "$root" -o "$work/$name" "$work/$name.cpp"; then
+        echo "FALHOU $script: programa gerado nao compila"
+        failed=1
+        continue
+    fi
+    "$work/$name" > "$work/$name.actual" 2>/dev/null
+    actual=$?
+    if [ $expected -ne $actual ] || ! cmp -s "$work/$name.expected" "$work/$name.actual"; then
+        echo "FALHOU $script: stdout ou status diferente ($expected, $actual)"
+        diff "$work/$name.expected" "$work/$name.actual" | head -20
+        failed=1
+    else
+        echo "ok     $script"
+    fi
+done
+exit $failed
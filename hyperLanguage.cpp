@@ -1,841 +1,9106 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <map>
+#include <unordered_map>
+#include <memory>
+#include <functional>
 #include <stdexcept>
 #include <fstream>
 #include <algorithm>
+#include <cctype>
 #include <locale.h>
 #include <cmath>
-#include <regex>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <cstring>
+#include <chrono>
+#include <charconv>
+#include <cerrno>
+#include <deque>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <filesystem>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#endif
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define HY_SIMD_X86 1
+#endif
 
-std::map<std::string, std::string> variables;
-std::map<std::string, bool> booleanVariables;
-std::map<std::string, std::vector<std::string>> functions;
+// Heap allocations made through operator new, counted for --alloc-stats once
+// countAllocations is set, and for each thread into the counter of the context
+// running on it, if any. Embedders with their own global allocator define
+// HY_NO_ALLOCATION_COUNTER.
+bool countAllocations = false;
+std::atomic<size_t> heapAllocations{ 0 };
+thread_local std::atomic<uint64_t>* threadAllocations = nullptr;
 
+// Points the allocations of the current thread at `counter` while alive
+class AllocationCounting {
+public:
+    explicit AllocationCounting(std::atomic<uint64_t>* counter) : enclosing(threadAllocations) {
+        threadAllocations = counter;
+    }
+
+    ~AllocationCounting() {
+        threadAllocations = enclosing;
+    }
+
+    AllocationCounting(const AllocationCounting&) = delete;
+    AllocationCounting& operator=(const AllocationCounting&) = delete;
+
+private:
+    std::atomic<uint64_t>* enclosing;
+};
+
+#ifndef HY_NO_ALLOCATION_COUNTER
+// Kept out of line: GCC would otherwise see free() on memory from operator new
+#if defined(__GNUC__)
+#define HY_NOINLINE __attribute__((noinline))
+#else
+#define HY_NOINLINE
+#endif
+
+void* operator new(size_t size) {
+    if (countAllocations) {
+        heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (threadAllocations) {
+        // Only the owning thread writes it, as with the other metrics
+        threadAllocations->store(threadAllocations->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    void* block = std::malloc(size ? size : 1);
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+HY_NOINLINE void operator delete(void* block) noexcept {
+    std::free(block);
+}
+
+HY_NOINLINE void operator delete(void* block, size_t) noexcept {
+    std::free(block);
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+HY_NOINLINE void operator delete[](void* block) noexcept {
+    std::free(block);
+}
+
+HY_NOINLINE void operator delete[](void* block, size_t) noexcept {
+    std::free(block);
+}
+#endif
+
+// Bump allocator: hands out memory from large blocks and gives it all back at once
+// when it is destroyed. Objects placed in it are destroyed by their owners; only
+// their memory stays until then.
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t alignment) {
+        size_t padding = (alignment - reinterpret_cast<uintptr_t>(cursor) % alignment) % alignment;
+        if (size + padding > static_cast<size_t>(limit - cursor)) {
+            grow(size + alignment);
+            padding = (alignment - reinterpret_cast<uintptr_t>(cursor) % alignment) % alignment;
+        }
+        char* at = cursor + padding;
+        cursor = at + size;
+        return at;
+    }
+
+    template <typename T>
+    T* make() {
+        return new (allocate(sizeof(T), alignof(T))) T();
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* cursor = nullptr;
+    char* limit = nullptr;
+    size_t nextSize = 4096;
+
+    // Blocks double in size, so a large script takes few of them
+    void grow(size_t atLeast) {
+        size_t size = std::max(nextSize, atLeast);
+        blocks.push_back(std::unique_ptr<char[]>(new char[size]));
+        cursor = blocks.back().get();
+        limit = cursor + size;
+        nextSize = std::min<size_t>(size * 2, 1 << 20);
+    }
+};
+
+// Recycles blocks of one size through a free list per thread, for small objects
+// made and dropped at a high rate. A block freed on another thread than the one
+// that took it joins the freeing thread's list.
+template <size_t Size>
+class BlockPool {
+public:
+    static void* take() {
+        FreeList& list = freeList();
+        if (list.head) {
+            Node* node = list.head;
+            list.head = node->next;
+            --list.count;
+            return node;
+        }
+        return ::operator new(Size);
+    }
+
+    static void give(void* block) {
+        FreeList& list = freeList();
+        if (list.retired || list.count == keep) {
+            ::operator delete(block);
+            return;
+        }
+        Node* node = static_cast<Node*>(block);
+        node->next = list.head;
+        list.head = node;
+        ++list.count;
+    }
+
+private:
+    static constexpr size_t keep = 1024;    // spare blocks kept per thread
+
+    struct Node {
+        Node* next;
+    };
+
+    struct FreeList {
+        Node* head = nullptr;
+        size_t count = 0;
+        bool retired = false;               // the thread is exiting
+
+        ~FreeList() {
+            while (head) {
+                Node* next = head->next;
+                ::operator delete(head);
+                head = next;
+            }
+            retired = true;
+        }
+    };
+
+    static FreeList& freeList() {
+        thread_local FreeList list;
+        return list;
+    }
+};
+
+// Standard allocator over BlockPool; only single objects come from the pool
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {
+    }
+
+    T* allocate(size_t count) {
+        if (count != 1) {
+            return static_cast<T*>(::operator new(count * sizeof(T)));
+        }
+        return static_cast<T*>(BlockPool<blockSize>::take());
+    }
+
+    void deallocate(T* block, size_t count) {
+        if (count != 1) {
+            ::operator delete(block);
+            return;
+        }
+        BlockPool<blockSize>::give(block);
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>&) const {
+        return false;
+    }
+
+private:
+    static constexpr size_t blockSize = (std::max(sizeof(T), sizeof(void*)) + 15) / 16 * 16;
+};
+
+enum class TokenType {
+    Number,
+    String,
+    FString,
+    Identifier,
+    Symbol,
+    EndOfLine
+};
+
+struct Token {
+    TokenType type;
+    std::string_view text;
+    double number = 0.0;
+    uint32_t offset = 0;   // byte offset into the source buffer
+    uint32_t line = 0;
+};
+
+// A syntax error knows where it happened; main turns the offset into line and column
+class SyntaxError : public std::runtime_error {
+public:
+    SyntaxError(const std::string& message, size_t offset) : std::runtime_error(message), offset(offset) {
+    }
+
+    size_t offset;
+};
+
+// Text of a 1-based line, without its line break
+std::string_view sourceLine(std::string_view source, size_t line) {
+    size_t start = 0;
+    for (size_t current = 1; current < line; ++current) {
+        start = source.find('\n', start);
+        if (start == std::string_view::npos) {
+            return std::string_view();
+        }
+        ++start;
+    }
+    std::string_view text = source.substr(start, source.find('\n', start) - start);
+    if (!text.empty() && text.back() == '\r') {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+void locateOffset(std::string_view source, size_t offset, size_t& line, size_t& column) {
+    offset = std::min(offset, source.size());
+    line = 1 + static_cast<size_t>(std::count(source.begin(), source.begin() + offset, '\n'));
+    size_t lineStart = source.rfind('\n', offset == 0 ? 0 : offset - 1);
+    column = (lineStart == std::string_view::npos || lineStart >= offset) ? offset + 1 : offset - lineStart;
+}
+
+std::string describeSyntaxError(const SyntaxError& error, std::string_view source) {
+    size_t line = 0;
+    size_t column = 0;
+    locateOffset(source, error.offset, line, column);
+    return "Erro na linha " + std::to_string(line) + ", coluna " + std::to_string(column) + ": " + error.what();
+}
+
+// Read-only view of a whole script; mapped straight from the page cache where possible
+class SourceFile {
+public:
+    SourceFile() = default;
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    ~SourceFile() {
+#ifndef _WIN32
+        if (mapping != nullptr) {
+            munmap(mapping, length);
+        }
+#endif
+    }
+
+    bool open(const std::string& path) {
+#ifdef _WIN32
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) {
+            return false;
+        }
+        fallback.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(&fallback[0], static_cast<std::streamsize>(fallback.size()));
+        contents = fallback;
+        return true;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+            ::close(fd);
+            return false;
+        }
+
+        length = static_cast<size_t>(info.st_size);
+        if (length > 0) {
+            void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+            mapping = address;
+            contents = std::string_view(static_cast<const char*>(address), length);
+        }
+        ::close(fd);
+        return true;
+#endif
+    }
+
+    std::string_view text() const {
+        return contents;
+    }
+
+private:
+    std::string_view contents;
+#ifdef _WIN32
+    std::string fallback;
+#else
+    void* mapping = nullptr;
+    size_t length = 0;
+#endif
+};
+
+enum class ValueType : uint8_t {
+    Number,
+    Boolean,
+    String,
+    List,
+    Range,
+    NumberList
+};
+
+// Heap payloads are immutable once built, so copying a Value only shares them
+struct HeapData {
+    virtual ~HeapData() = default;
+};
+
+struct StringData : HeapData {
+    std::string text;
+
+    explicit StringData(std::string text) : text(std::move(text)) {
+    }
+};
+
+struct ListData;
+struct RangeData;
+struct NumberListData;
+
+// How scripts write numbers. Fixed is the text of std::to_string, six decimals, as
+// scripts have always printed them; Shortest (--numbers=short) writes whole numbers
+// without decimals and any other with the fewest digits that read back the same.
+// Scripts are compiled for one, since folded constants are written out, and contexts
+// print in one.
+enum class NumberFormat {
+    Fixed,
+    Shortest
+};
+
+// Whole numbers under 2^53 in magnitude as the digits of an integer, much cheaper than
+// a floating-point conversion, keeping the sign of -0. Null for any other value.
+char* writeWholeNumber(char* first, char* last, double value) {
+    if (!(std::fabs(value) < 9007199254740992.0) || value != std::trunc(value)) {
+        return nullptr;
+    }
+    if (value == 0.0 && std::signbit(value)) {
+        *first++ = '-';
+    }
+    return std::to_chars(first, last, static_cast<int64_t>(value)).ptr;
+}
+
+// In the given format, written without allocating
+void appendNumber(std::string& out, double value, NumberFormat format) {
+    char buffer[400];
+    char* end = writeWholeNumber(buffer, buffer + sizeof(buffer), value);
+    if (format == NumberFormat::Shortest) {
+        out.append(buffer, end ? end : std::to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+        return;
+    }
+    if (end) {
+        std::memcpy(end, ".000000", 7);
+        out.append(buffer, end + 7);
+        return;
+    }
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed, 6);
+    if (result.ec != std::errc()) {
+        out += std::to_string(value);
+        return;
+    }
+    out.append(buffer, result.ptr);
+}
+
+// Same text as "std::cout << value" (six significant digits)
+void appendGeneralNumber(std::string& out, double value) {
+    char buffer[64];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::general, 6);
+    out.append(buffer, result.ptr);
+}
+
+// The result of a builtin command: six significant digits, or as any other number
+// under --numbers=short
+void appendResultNumber(std::string& out, double value, NumberFormat format) {
+    if (format == NumberFormat::Shortest) {
+        appendNumber(out, value, format);
+    }
+    else {
+        appendGeneralNumber(out, value);
+    }
+}
+
+// Quoted and escaped as a JSON string, for the machine-readable reports
+void appendJsonString(std::string& out, std::string_view text) {
+    out += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", static_cast<unsigned>(c));
+            out += escape;
+        }
+        else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// The whole of `text` as a number, accepting what std::stod accepts (leading
+// whitespace, a sign, hexadecimal, inf and nan) but without throwing, allocating or
+// looking at the locale. False for anything else, and for values out of range.
+bool parseNumber(std::string_view text, double& value) {
+    size_t i = 0;
+    while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i]))) {
+        ++i;
+    }
+    bool negative = false;
+    if (i < text.size() && (text[i] == '+' || text[i] == '-')) {
+        negative = (text[i] == '-');
+        ++i;
+    }
+    std::chars_format format = std::chars_format::general;
+    if (text.size() - i > 2 && text[i] == '0' && (text[i + 1] == 'x' || text[i + 1] == 'X')) {
+        format = std::chars_format::hex;
+        i += 2;
+    }
+
+    const char* first = text.data() + i;
+    const char* last = text.data() + text.size();
+    if (first == last || *first == '+' || *first == '-') {
+        return false;
+    }
+    double parsed = 0.0;
+    auto result = std::from_chars(first, last, parsed, format);
+    if (result.ec != std::errc() || result.ptr != last) {
+        return false;
+    }
+    value = negative ? -parsed : parsed;
+    return true;
+}
+
+struct Value {
+    ValueType type = ValueType::Number;
+    double number = 0.0;                    // Number, or 0/1 for Boolean
+    std::shared_ptr<const HeapData> data;   // String, list or range payload
+
+    static Value fromNumber(double number) {
+        Value value;
+        value.number = number;
+        return value;
+    }
+
+    static Value fromBoolean(bool boolean) {
+        Value value;
+        value.type = ValueType::Boolean;
+        value.number = boolean ? 1.0 : 0.0;
+        return value;
+    }
+
+    static Value fromString(std::string text) {
+        Value value;
+        value.type = ValueType::String;
+        // Strings are made and dropped constantly, so their blocks are recycled
+        value.data = std::allocate_shared<StringData>(PoolAllocator<StringData>(), std::move(text));
+        return value;
+    }
+
+    static Value fromList(std::vector<Value> items);
+    static Value fromRange(double start, double stop, double step);
+    static Value fromNumbers(std::vector<double> numbers);
+
+    const std::string& text() const {
+        return static_cast<const StringData&>(*data).text;
+    }
+
+    const std::vector<Value>& items() const;
+    const RangeData& range() const;
+    const std::vector<double>& numbers() const;
+
+    bool isSequence() const {
+        return type == ValueType::List || type == ValueType::Range || type == ValueType::NumberList;
+    }
+
+    double toNumber() const {
+        switch (type) {
+        case ValueType::Number:
+        case ValueType::Boolean:
+            return number;
+        case ValueType::String: {
+            double value = 0.0;
+            if (parseNumber(text(), value)) {
+                return value;
+            }
+            throw std::runtime_error("Valor no numrico: " + text());
+        }
+        case ValueType::List:
+        case ValueType::Range:
+        case ValueType::NumberList:
+            break;
+        }
+        failWith("Valor no numrico: ");
+    }
+
+    bool isTruthy() const {
+        switch (type) {
+        case ValueType::Number:
+        case ValueType::Boolean:
+            return number != 0.0;
+        case ValueType::String:
+            return !text().empty();
+        case ValueType::List:
+            return !items().empty();
+        case ValueType::Range:
+        case ValueType::NumberList:
+            break;
+        }
+        return length() > 0;
+    }
+
+    size_t length() const;
+    std::string toString(NumberFormat format = NumberFormat::Fixed) const;
+    void appendTo(std::string& out, NumberFormat format) const;
+
+    [[noreturn]] void failWith(const std::string& message) const;     // a ValueError showing this value
+};
+
+// An error that shows a value, as in "ndice fora da lista: 5". Builtins do not know
+// the number format of the context calling them, so the message is worded with fixed
+// numbers and contexts reword it in theirs.
+class ValueError : public std::runtime_error {
+public:
+    ValueError(const std::string& message, const Value& value) : std::runtime_error(message + value.toString()), message(message), value(value) {
+    }
+
+    std::string describe(NumberFormat format) const {
+        return message + value.toString(format);
+    }
+
+private:
+    std::string message;
+    Value value;
+};
+
+inline void Value::failWith(const std::string& message) const {
+    throw ValueError(message, *this);
+}
+
+struct ListData : HeapData {
+    std::vector<Value> items;
+};
+
+// range(a, b, step): the numbers a, a + step, ... up to b (excluded), produced on
+// demand. Elements are computed from their index, so long ranges do not drift.
+struct RangeData : HeapData {
+    double start;
+    double step;
+    size_t count;
+
+    RangeData(double start, double stop, double step) : start(start), step(step), count(0) {
+        double steps = std::ceil((stop - start) / step);
+        if (!(steps > 0)) return;
+        // Same bound jitRangeCount uses; past it the cast to size_t is undefined.
+        if (!(steps < 9.2e18)) {
+            throw std::runtime_error("Intervalo grande demais em range.");
+        }
+        count = static_cast<size_t>(steps);
+    }
+
+    double at(size_t index) const {
+        return start + static_cast<double>(index) * step;
+    }
+};
+
+inline Value Value::fromList(std::vector<Value> items) {
+    auto list = std::make_shared<ListData>();
+    list->items = std::move(items);
+
+    Value value;
+    value.type = ValueType::List;
+    value.data = std::move(list);
+    return value;
+}
+
+// A list whose elements are all numbers, packed as contiguous doubles for the bulk
+// math below. Scripts see it as an ordinary list.
+struct NumberListData : HeapData {
+    std::vector<double> numbers;
+};
+
+inline Value Value::fromNumbers(std::vector<double> numbers) {
+    auto list = std::make_shared<NumberListData>();
+    list->numbers = std::move(numbers);
+
+    Value value;
+    value.type = ValueType::NumberList;
+    value.data = std::move(list);
+    return value;
+}
+
+inline Value Value::fromRange(double start, double stop, double step) {
+    if (step == 0.0 || std::isnan(step)) {
+        throw std::runtime_error("Passo invlido em range.");
+    }
+
+    Value value;
+    value.type = ValueType::Range;
+    value.data = std::make_shared<const RangeData>(start, stop, step);
+    return value;
+}
+
+inline const std::vector<Value>& Value::items() const {
+    return static_cast<const ListData&>(*data).items;
+}
+
+inline const RangeData& Value::range() const {
+    return static_cast<const RangeData&>(*data);
+}
+
+inline const std::vector<double>& Value::numbers() const {
+    return static_cast<const NumberListData&>(*data).numbers;
+}
+
+// Element i of a list or range
+inline Value elementAt(const Value& sequence, size_t index) {
+    switch (sequence.type) {
+    case ValueType::Range:
+        return Value::fromNumber(sequence.range().at(index));
+    case ValueType::NumberList:
+        return Value::fromNumber(sequence.numbers()[index]);
+    default:
+        return sequence.items()[index];
+    }
+}
+
+// Element count of a list or range, character count of a string
+inline size_t Value::length() const {
+    switch (type) {
+    case ValueType::String:
+        return text().size();
+    case ValueType::List:
+        return items().size();
+    case ValueType::Range:
+        return range().count;
+    case ValueType::NumberList:
+        return numbers().size();
+    default:
+        failWith("Valor sem tamanho: ");
+    }
+}
+
+inline std::string Value::toString(NumberFormat format) const {
+    if (type == ValueType::String) {
+        return text();
+    }
+
+    std::string result;
+    appendTo(result, format);
+    return result;
+}
+
+inline void Value::appendTo(std::string& out, NumberFormat format) const {
+    switch (type) {
+    case ValueType::Number:
+        appendNumber(out, number, format);
+        break;
+    case ValueType::Boolean:
+        out += (number != 0.0) ? "true" : "false";
+        break;
+    case ValueType::String:
+        out += text();
+        break;
+    case ValueType::List: {
+        bool first = true;
+        for (const Value& item : items()) {
+            if (!first) {
+                out += ',';
+            }
+            item.appendTo(out, format);
+            first = false;
+        }
+        break;
+    }
+    case ValueType::Range: {
+        const RangeData& values = range();
+        for (size_t i = 0; i < values.count; ++i) {
+            if (i != 0) {
+                out += ',';
+            }
+            appendNumber(out, values.at(i), format);
+        }
+        break;
+    }
+    case ValueType::NumberList: {
+        bool first = true;
+        for (double number : numbers()) {
+            if (!first) {
+                out += ',';
+            }
+            appendNumber(out, number, format);
+            first = false;
+        }
+        break;
+    }
+    }
+}
+
+enum class FlushPolicy {
+    Full,   // write only when the buffer fills up or flush() is called
+    Line    // write after every line, for interactive use
+};
+
+// Script output goes through one large buffer instead of a flushing std::endl per line.
+// Embedders can point it at another file descriptor or at an in-memory string.
+class Output {
+public:
+    static constexpr size_t bufferSize = 64 * 1024;
+
+    Output() {
+        buffer.reserve(bufferSize);
+    }
+
+    ~Output() {
+        flush();
+    }
+
+    void setPolicy(FlushPolicy policy) {
+        flushPolicy = policy;
+    }
+
+    FlushPolicy policy() const {
+        return flushPolicy;
+    }
+
+    void redirectToDescriptor(int fd) {
+        flush();
+        descriptor = fd;
+        memorySink = nullptr;
+    }
+
+    void redirectToMemory(std::string& sink) {
+        flush();
+        memorySink = &sink;
+    }
+
+    void write(const char* data, size_t size) {
+        if (buffer.size() + size > bufferSize) {
+            flush();
+            if (size >= bufferSize) {
+                writeOut(data, size);
+                return;
+            }
+        }
+        buffer.append(data, size);
+    }
+
+    void write(const std::string& text) {
+        write(text.data(), text.size());
+    }
+
+    void writeNumber(double value, NumberFormat format) {
+        if (buffer.size() + 64 > bufferSize) {
+            flush();
+        }
+        appendResultNumber(buffer, value, format);
+    }
+
+    void endLine() {
+        buffer += '\n';
+        if (flushPolicy == FlushPolicy::Line || buffer.size() >= bufferSize) {
+            flush();
+        }
+    }
+
+    // Text made of whole lines, already terminated, such as the output of a parallel loop
+    void writeLines(const std::string& text) {
+        write(text);
+        if (flushPolicy == FlushPolicy::Line || buffer.size() >= bufferSize) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (!buffer.empty()) {
+            writeOut(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    // Bytes handed on so far; other threads may read it while a script runs
+    uint64_t bytesWritten() const {
+        return written.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::string buffer;
+    int descriptor = 1;
+    std::string* memorySink = nullptr;
+    FlushPolicy flushPolicy = FlushPolicy::Full;
+    std::atomic<uint64_t> written{ 0 };
+
+    void writeOut(const char* data, size_t size) {
+        written.store(written.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+        if (memorySink) {
+            memorySink->append(data, size);
+            return;
+        }
+
+        while (size > 0) {
+#ifdef _WIN32
+            int written = _write(descriptor, data, static_cast<unsigned int>(size));
+#else
+            ssize_t written = ::write(descriptor, data, size);
+#endif
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+};
+
+// Runs numbered tasks on a fixed set of threads. Tasks are dealt out in contiguous
+// blocks; each worker drains its own deque from the front and, once it runs dry,
+// steals from the back of the others. Several contexts may run jobs at once: every
+// queued task carries the job it belongs to.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t threadCount) {
+        for (size_t i = 0; i < threadCount; ++i) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (size_t i = 0; i < threadCount; ++i) {
+            threads.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    size_t size() const {
+        return threads.size();
+    }
+
+    // Blocks until task(index, worker) has run for every index. Tasks must not throw.
+    void run(size_t taskCount, const std::function<void(size_t, size_t)>& task) {
+        if (taskCount == 0) {
+            return;
+        }
+
+        Job job;
+        job.task = &task;
+        job.remaining = taskCount;
+        for (size_t worker = 0; worker < queues.size(); ++worker) {
+            std::lock_guard<std::mutex> queueLock(queues[worker]->mutex);
+            for (size_t index = taskCount * worker / queues.size(); index < taskCount * (worker + 1) / queues.size(); ++index) {
+                queues[worker]->tasks.push_back({ &job, index });
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued += taskCount;
+        }
+        wake.notify_all();
+
+        std::unique_lock<std::mutex> lock(job.mutex);
+        job.done.wait(lock, [&job] { return job.remaining == 0; });
+    }
+
+    static bool onWorkerThread() {
+        return isWorker;
+    }
+
+private:
+    // Lives on the stack of the thread that called run(); the last task to finish wakes it
+    struct Job {
+        const std::function<void(size_t, size_t)>* task = nullptr;
+        size_t remaining = 0;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+
+    struct Task {
+        Job* job;
+        size_t index;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<size_t> queued{ 0 };   // tasks not yet taken by a worker
+    bool stopping = false;
+
+    static thread_local bool isWorker;
+
+    void workerLoop(size_t worker) {
+        isWorker = true;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || queued > 0; });
+                if (stopping) {
+                    return;
+                }
+            }
+
+            Task task{ nullptr, 0 };
+            while (takeTask(worker, task)) {
+                (*task.job->task)(task.index, worker);
+                std::lock_guard<std::mutex> lock(task.job->mutex);
+                if (--task.job->remaining == 0) {
+                    task.job->done.notify_all();
+                }
+            }
+        }
+    }
+
+    bool takeTask(size_t worker, Task& task) {
+        for (size_t offset = 0; offset < queues.size(); ++offset) {
+            Queue& queue = *queues[(worker + offset) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                if (offset == 0) {
+                    task = queue.tasks.front();
+                    queue.tasks.pop_front();
+                }
+                else {
+                    task = queue.tasks.back();
+                    queue.tasks.pop_back();
+                }
+                --queued;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+thread_local bool WorkStealingPool::isWorker = false;
+
+size_t parallelThreads = 0;     // 0: one per hardware thread
+
+WorkStealingPool& parallelPool() {
+    static WorkStealingPool pool(parallelThreads > 0 ? parallelThreads : std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+// A contiguous run of iterations of a parallel foreach, executed by one worker. Its
+// output and yielded values are kept apart and replayed in iteration order.
+struct LoopChunk {
+    size_t begin = 0;
+    size_t end = 0;
+    std::string output;
+    std::vector<Value> yields;
+    std::exception_ptr error;   // first failure; the rest of the chunk does not run
+};
+
+constexpr size_t inlineWorker = SIZE_MAX;
+
+// Splits `count` iterations into a few chunks per worker, which leaves something to
+// steal when iterations are uneven, and runs run(chunk, worker) for each on the pool.
+// A loop nested in another already runs on a pool thread, so it takes the whole range
+// as one chunk right there, with worker set to inlineWorker.
+std::vector<LoopChunk> runChunks(size_t count, const std::function<void(LoopChunk&, size_t)>& run) {
+    if (WorkStealingPool::onWorkerThread() || count < 2) {
+        std::vector<LoopChunk> chunks(1);
+        chunks[0].end = count;
+        run(chunks[0], inlineWorker);
+        return chunks;
+    }
+
+    WorkStealingPool& pool = parallelPool();
+    size_t chunkCount = std::min(count, pool.size() * 4);
+    std::vector<LoopChunk> chunks(chunkCount);
+    for (size_t i = 0; i < chunkCount; ++i) {
+        chunks[i].begin = count * i / chunkCount;
+        chunks[i].end = count * (i + 1) / chunkCount;
+    }
+    pool.run(chunkCount, [&](size_t index, size_t worker) {
+        run(chunks[index], worker);
+    });
+    return chunks;
+}
+
+enum class ExprKind {
+    Number,
+    String,
+    FString,
+    Boolean,
+    Variable,
+    List,
+    Unary,
+    Binary,
+    Call
+};
+
+enum class Operator {
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Power,
+    Equal,
+    NotEqual,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    Negate
+};
+
+struct Expr;
+// Nodes live in the arena of their script: deleting one only runs its destructor
+struct NodeDeleter {
+    template <typename T>
+    void operator()(T* node) const {
+        node->~T();
+    }
+};
+
+using ExprPtr = std::unique_ptr<Expr, NodeDeleter>;
+
+struct Expr {
+    ExprKind kind;
+    Operator op = Operator::Add;
+    Value literal;                  // value of number, string and boolean literals
+    std::string text;               // literal text, variable name or function name
+    int32_t slot = -1;              // resolved symbol of a global variable or user function
+    int32_t local = -1;             // frame slot when the variable is local to a function
+    int32_t builtin = -1;           // registry id when the call targets a builtin
+    bool userFunction = false;      // call to a def seen earlier, even one named like a builtin
+    std::vector<ExprPtr> operands;  // unary/binary operands, list items, call arguments or f-string holes
+    std::vector<std::string> segments;  // f-string text around the holes (one more than the holes)
+};
+
+enum class StmtKind {
+    Let,
+    Print,
+    If,
+    ForEach,
+    Def,
+    Return,
+    Call,
+    BuiltinCommand,
+    ToLower,
+    ToUpper,
+    Yield
+};
+
+struct Stmt;
+using StmtPtr = std::unique_ptr<Stmt, NodeDeleter>;
+
+struct Stmt {
+    StmtKind kind;
+    uint32_t line = 0;                // source line where the statement starts
+    std::string name;                 // target variable, loop variable, function or command name
+    std::string source;               // source variable of tolower/toupper
+    int32_t slot = -1;                // resolved symbol of name
+    int32_t sourceSlot = -1;          // resolved symbol of source
+    int32_t local = -1;               // frame slot of name when it is local; for return, the result slot
+    int32_t sourceLocal = -1;         // frame slot of source when it is local
+    int32_t builtin = -1;             // registry id of a builtin command
+    ExprPtr value;                    // let value, if condition, foreach iterable, returned or yielded value
+    std::vector<ExprPtr> args;        // print items, call or builtin arguments
+    std::vector<std::string> params;  // def parameters
+    std::vector<bool> booleanParams;  // parameters declared as "nome:"
+    std::vector<std::string> locals;  // def: names of the frame slots, parameters first, then the result;
+                                      // parallel foreach: the iteration frame, loop variable first
+    bool parallel = false;            // parallel foreach
+    bool pure = false;                // def pure: results may be reused for the same arguments
+    std::string collect;              // foreach ... into: variable receiving the yielded values as a list
+    int32_t collectSlot = -1;         // resolved symbol of collect
+    int32_t collectLocal = -1;        // frame slot of collect when it is local
+    std::vector<std::pair<int32_t, int32_t>> captures;  // parallel foreach: enclosing local copied into each iteration's slot
+    std::vector<StmtPtr> body;
+    std::vector<StmtPtr> elseBody;
+};
+
+// Every identifier is interned once; its id doubles as the slot of the global it names.
+class SymbolTable {
+public:
+    size_t resolved = 0;        // identifiers bound to a slot ahead of execution
+    size_t dynamicLookups = 0;  // names looked up while running; the resolver binds all of them
+
+    int32_t intern(const std::string& name) {
+        auto it = ids.find(name);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        names.push_back(name);
+        return ids[name] = static_cast<int32_t>(names.size() - 1);
+    }
+
+    int32_t find(const std::string& name) const {
+        auto it = ids.find(name);
+        return (it != ids.end()) ? it->second : -1;
+    }
+
+    const std::string& name(int32_t id) const {
+        return names[id];
+    }
+
+    size_t size() const {
+        return names.size();
+    }
+
+private:
+    std::unordered_map<std::string, int32_t> ids;
+    std::vector<std::string> names;
+};
+
+struct Variable {
+    Value value;
+    bool defined = false;
+};
+
+// Global variables and functions of one context, laid out by the symbol ids of the
+// script it is running
+struct Globals {
+    const SymbolTable* symbols = nullptr;
+    std::vector<Variable> variables;        // indexed by symbol id
+    std::vector<const Stmt*> functions;     // indexed by symbol id
+};
+
+// Bulk math over numeric lists. Kernels read and write contiguous doubles and come in
+// AVX2, SSE2 and scalar versions; the widest the processor supports is picked once,
+// at startup. Sums keep four partial totals in every version, so a result does not
+// depend on which version ran.
+enum class SimdLevel {
+    Scalar,
+    Sse2,
+    Avx2
+};
+
+SimdLevel detectSimdLevel() {
+#if defined(HY_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? SimdLevel::Avx2 : SimdLevel::Sse2;
+#elif defined(HY_SIMD_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osSavesAvx = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    return (osSavesAvx && (info[1] & (1 << 5)) != 0) ? SimdLevel::Avx2 : SimdLevel::Sse2;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+const SimdLevel simdSupported = detectSimdLevel();
+SimdLevel simdLevel = simdSupported;   // may be lowered from the command line
+
+#if defined(HY_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define HY_AVX2 __attribute__((target("avx2")))
+#else
+#define HY_AVX2
+#endif
+
+struct AddKernel {
+    static double apply(double a, double b) { return a + b; }
+#ifdef HY_SIMD_X86
+    static __m128d apply(__m128d a, __m128d b) { return _mm_add_pd(a, b); }
+    HY_AVX2 static __m256d apply(__m256d a, __m256d b) { return _mm256_add_pd(a, b); }
+#endif
+};
+
+struct SubtractKernel {
+    static double apply(double a, double b) { return a - b; }
+#ifdef HY_SIMD_X86
+    static __m128d apply(__m128d a, __m128d b) { return _mm_sub_pd(a, b); }
+    HY_AVX2 static __m256d apply(__m256d a, __m256d b) { return _mm256_sub_pd(a, b); }
+#endif
+};
+
+struct MultiplyKernel {
+    static double apply(double a, double b) { return a * b; }
+#ifdef HY_SIMD_X86
+    static __m128d apply(__m128d a, __m128d b) { return _mm_mul_pd(a, b); }
+    HY_AVX2 static __m256d apply(__m256d a, __m256d b) { return _mm256_mul_pd(a, b); }
+#endif
+};
+
+struct DivideKernel {
+    static double apply(double a, double b) { return a / b; }
+#ifdef HY_SIMD_X86
+    static __m128d apply(__m128d a, __m128d b) { return _mm_div_pd(a, b); }
+    HY_AVX2 static __m256d apply(__m256d a, __m256d b) { return _mm256_div_pd(a, b); }
+#endif
+};
+
+// Same choice as the vector instructions: the second operand unless the first is smaller
+struct MinKernel {
+    static double apply(double a, double b) { return (a < b) ? a : b; }
+#ifdef HY_SIMD_X86
+    static __m128d apply(__m128d a, __m128d b) { return _mm_min_pd(a, b); }
+    HY_AVX2 static __m256d apply(__m256d a, __m256d b) { return _mm256_min_pd(a, b); }
+#endif
+};
+
+struct MaxKernel {
+    static double apply(double a, double b) { return (a > b) ? a : b; }
+#ifdef HY_SIMD_X86
+    static __m128d apply(__m128d a, __m128d b) { return _mm_max_pd(a, b); }
+    HY_AVX2 static __m256d apply(__m256d a, __m256d b) { return _mm256_max_pd(a, b); }
+#endif
+};
+
+struct SqrtKernel {
+    static constexpr bool sse2 = true;
+    static double apply(double x) { return std::sqrt(x); }
+#ifdef HY_SIMD_X86
+    static __m128d apply(__m128d x) { return _mm_sqrt_pd(x); }
+    HY_AVX2 static __m256d apply(__m256d x) { return _mm256_sqrt_pd(x); }
+#endif
+};
+
+struct AbsKernel {
+    static constexpr bool sse2 = true;
+    static double apply(double x) { return std::fabs(x); }
+#ifdef HY_SIMD_X86
+    static __m128d apply(__m128d x) { return _mm_andnot_pd(_mm_set1_pd(-0.0), x); }
+    HY_AVX2 static __m256d apply(__m256d x) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), x); }
+#endif
+};
+
+// Rounding instructions arrived after SSE2, so those two run the scalar loop there
+struct FloorKernel {
+    static constexpr bool sse2 = false;
+    static double apply(double x) { return std::floor(x); }
+#ifdef HY_SIMD_X86
+    HY_AVX2 static __m256d apply(__m256d x) { return _mm256_round_pd(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+#endif
+};
+
+struct CeilKernel {
+    static constexpr bool sse2 = false;
+    static double apply(double x) { return std::ceil(x); }
+#ifdef HY_SIMD_X86
+    HY_AVX2 static __m256d apply(__m256d x) { return _mm256_round_pd(x, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC); }
+#endif
+};
+
+// An operand with step 0 is a single number applied to every element
+template <typename Kernel>
+void binaryScalar(const double* a, size_t aStep, const double* b, size_t bStep, double* out, size_t count, size_t i = 0) {
+    for (; i < count; ++i) {
+        out[i] = Kernel::apply(a[i * aStep], b[i * bStep]);
+    }
+}
+
+template <typename Kernel>
+void unaryScalar(const double* in, double* out, size_t count, size_t i = 0) {
+    for (; i < count; ++i) {
+        out[i] = Kernel::apply(in[i]);
+    }
+}
+
+#ifdef HY_SIMD_X86
+template <typename Kernel>
+void binarySse2(const double* a, size_t aStep, const double* b, size_t bStep, double* out, size_t count) {
+    __m128d aSplat = _mm_set1_pd(a[0]);
+    __m128d bSplat = _mm_set1_pd(b[0]);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d x = aStep ? _mm_loadu_pd(a + i) : aSplat;
+        __m128d y = bStep ? _mm_loadu_pd(b + i) : bSplat;
+        _mm_storeu_pd(out + i, Kernel::apply(x, y));
+    }
+    binaryScalar<Kernel>(a, aStep, b, bStep, out, count, i);
+}
+
+template <typename Kernel>
+HY_AVX2 void binaryAvx2(const double* a, size_t aStep, const double* b, size_t bStep, double* out, size_t count) {
+    __m256d aSplat = _mm256_set1_pd(a[0]);
+    __m256d bSplat = _mm256_set1_pd(b[0]);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d x = aStep ? _mm256_loadu_pd(a + i) : aSplat;
+        __m256d y = bStep ? _mm256_loadu_pd(b + i) : bSplat;
+        _mm256_storeu_pd(out + i, Kernel::apply(x, y));
+    }
+    binaryScalar<Kernel>(a, aStep, b, bStep, out, count, i);
+}
+
+template <typename Kernel>
+void unarySse2(const double* in, double* out, size_t count) {
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i, Kernel::apply(_mm_loadu_pd(in + i)));
+    }
+    unaryScalar<Kernel>(in, out, count, i);
+}
+
+template <typename Kernel>
+HY_AVX2 void unaryAvx2(const double* in, double* out, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(out + i, Kernel::apply(_mm256_loadu_pd(in + i)));
+    }
+    unaryScalar<Kernel>(in, out, count, i);
+}
+
+template <typename Kernel>
+void reduceSse2(const double* in, size_t blocks, double* lanes) {
+    __m128d low = _mm_loadu_pd(lanes);
+    __m128d high = _mm_loadu_pd(lanes + 2);
+    for (size_t i = 0; i < blocks; i += 4) {
+        low = Kernel::apply(low, _mm_loadu_pd(in + i));
+        high = Kernel::apply(high, _mm_loadu_pd(in + i + 2));
+    }
+    _mm_storeu_pd(lanes, low);
+    _mm_storeu_pd(lanes + 2, high);
+}
+
+template <typename Kernel>
+HY_AVX2 void reduceAvx2(const double* in, size_t blocks, double* lanes) {
+    __m256d partial = _mm256_loadu_pd(lanes);
+    for (size_t i = 0; i < blocks; i += 4) {
+        partial = Kernel::apply(partial, _mm256_loadu_pd(in + i));
+    }
+    _mm256_storeu_pd(lanes, partial);
+}
+#endif
+
+template <typename Kernel>
+void bulkBinary(const double* a, size_t aStep, const double* b, size_t bStep, double* out, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    switch (simdLevel) {
+#ifdef HY_SIMD_X86
+    case SimdLevel::Avx2:
+        binaryAvx2<Kernel>(a, aStep, b, bStep, out, count);
+        return;
+    case SimdLevel::Sse2:
+        binarySse2<Kernel>(a, aStep, b, bStep, out, count);
+        return;
+#endif
+    default:
+        binaryScalar<Kernel>(a, aStep, b, bStep, out, count);
+        return;
+    }
+}
+
+template <typename Kernel>
+void bulkUnary(const double* in, double* out, size_t count) {
+    switch (simdLevel) {
+#ifdef HY_SIMD_X86
+    case SimdLevel::Avx2:
+        unaryAvx2<Kernel>(in, out, count);
+        return;
+    case SimdLevel::Sse2:
+        if constexpr (Kernel::sse2) {
+            unarySse2<Kernel>(in, out, count);
+            return;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+    unaryScalar<Kernel>(in, out, count);
+}
+
+// Folds count numbers with four running partials, lane j taking the elements at
+// j, j + 4, ...; the partials are then combined as ((p0, p1), (p2, p3)) and the last
+// count % 4 elements folded in order. Every version follows exactly this order.
+template <typename Kernel>
+double bulkReduce(const double* in, size_t count, double initial) {
+    double lanes[4] = { initial, initial, initial, initial };
+    size_t blocks = count / 4 * 4;
+    switch (simdLevel) {
+#ifdef HY_SIMD_X86
+    case SimdLevel::Avx2:
+        reduceAvx2<Kernel>(in, blocks, lanes);
+        break;
+    case SimdLevel::Sse2:
+        reduceSse2<Kernel>(in, blocks, lanes);
+        break;
+#endif
+    default:
+        for (size_t i = 0; i < blocks; i += 4) {
+            for (size_t lane = 0; lane < 4; ++lane) {
+                lanes[lane] = Kernel::apply(lanes[lane], in[i + lane]);
+            }
+        }
+        break;
+    }
+
+    double result = Kernel::apply(Kernel::apply(lanes[0], lanes[1]), Kernel::apply(lanes[2], lanes[3]));
+    for (size_t i = blocks; i < count; ++i) {
+        result = Kernel::apply(result, in[i]);
+    }
+    return result;
+}
+
+// The elements of a list, range or packed list as contiguous doubles. Packed lists are
+// read in place; anything else is converted into `scratch`.
+const double* numericElements(const Value& sequence, std::vector<double>& scratch) {
+    switch (sequence.type) {
+    case ValueType::NumberList:
+        return sequence.numbers().data();
+    case ValueType::Range: {
+        const RangeData& range = sequence.range();
+        scratch.resize(range.count);
+        for (size_t i = 0; i < range.count; ++i) {
+            scratch[i] = range.at(i);
+        }
+        return scratch.data();
+    }
+    default: {
+        const std::vector<Value>& items = sequence.items();
+        scratch.resize(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            scratch[i] = (items[i].type == ValueType::Number) ? items[i].number : items[i].toNumber();
+        }
+        return scratch.data();
+    }
+    }
+}
+
+// Arithmetic where either side is a list: element by element, a single number
+// pairing with every element of the other side
+Value elementwise(Operator op, const Value& lhs, const Value& rhs) {
+    std::vector<double> lhsScratch;
+    std::vector<double> rhsScratch;
+    double lhsNumber = 0.0;
+    double rhsNumber = 0.0;
+    const double* a = &lhsNumber;
+    const double* b = &rhsNumber;
+    size_t aStep = 0;
+    size_t bStep = 0;
+    size_t count = 0;
+
+    if (lhs.isSequence()) {
+        a = numericElements(lhs, lhsScratch);
+        aStep = 1;
+        count = lhs.length();
+    }
+    else {
+        lhsNumber = lhs.toNumber();
+    }
+    if (rhs.isSequence()) {
+        if (aStep && rhs.length() != count) {
+            throw std::runtime_error("Listas de tamanhos diferentes: " + std::to_string(count) + " e " + std::to_string(rhs.length()) + ".");
+        }
+        b = numericElements(rhs, rhsScratch);
+        bStep = 1;
+        count = rhs.length();
+    }
+    else {
+        rhsNumber = rhs.toNumber();
+    }
+
+    std::vector<double> result(count);
+    switch (op) {
+    case Operator::Add:
+        bulkBinary<AddKernel>(a, aStep, b, bStep, result.data(), count);
+        break;
+    case Operator::Subtract:
+        bulkBinary<SubtractKernel>(a, aStep, b, bStep, result.data(), count);
+        break;
+    case Operator::Multiply:
+        bulkBinary<MultiplyKernel>(a, aStep, b, bStep, result.data(), count);
+        break;
+    case Operator::Divide: {
+        const double* divisorsEnd = b + (bStep ? count : 1);
+        if (count > 0 && std::find(b, divisorsEnd, 0.0) != divisorsEnd) {
+            throw std::runtime_error("Diviso por zero.");
+        }
+        bulkBinary<DivideKernel>(a, aStep, b, bStep, result.data(), count);
+        break;
+    }
+    case Operator::Power:
+        for (size_t i = 0; i < count; ++i) {
+            result[i] = std::pow(a[i * aStep], b[i * bStep]);
+        }
+        break;
+    default:
+        throw std::runtime_error("Operador desconhecido.");
+    }
+    return Value::fromNumbers(std::move(result));
+}
+
+using BulkKernel = void (*)(const double* in, double* out, size_t count);
+
+// One-argument math over every element: the vector kernel when there is one,
+// otherwise the scalar function element by element
+Value mapNumbers(const Value& sequence, double (*numeric)(double), BulkKernel kernel) {
+    std::vector<double> scratch;
+    const double* in = numericElements(sequence, scratch);
+    std::vector<double> result(sequence.length());
+    if (kernel) {
+        kernel(in, result.data(), result.size());
+    }
+    else {
+        std::transform(in, in + result.size(), result.begin(), numeric);
+    }
+    return Value::fromNumbers(std::move(result));
+}
+
+// Native functions callable from scripts. Arguments arrive as a contiguous array of
+// `count` values, already checked against the builtin's arity.
+using NativeFunction = std::function<Value(const Value* args, size_t count)>;
+
+struct Builtin {
+    std::string name;
+    uint32_t minArity = 0;
+    uint32_t arity = 0;                 // most arguments accepted
+    bool pure = false;                  // result depends only on the arguments and there are no side effects
+    NativeFunction function;
+    double (*numeric)(double) = nullptr; // direct path for one-argument math on numbers
+
+    bool accepts(size_t count) const {
+        return count >= minArity && count <= arity;
+    }
+};
+
+// Names are looked up once, while parsing and resolving; calls then index the
+// registry by id. Embedders may define their own functions before parsing a script.
+class BuiltinRegistry {
+public:
+    BuiltinRegistry() {
+        defineNumeric("sqrt", [](double x) { return std::sqrt(x); }, bulkUnary<SqrtKernel>);
+        defineNumeric("abs", [](double x) { return std::fabs(x); }, bulkUnary<AbsKernel>);
+        defineNumeric("round", [](double x) { return std::round(x); });
+        defineNumeric("floor", [](double x) { return std::floor(x); }, bulkUnary<FloorKernel>);
+        defineNumeric("ceil", [](double x) { return std::ceil(x); }, bulkUnary<CeilKernel>);
+        defineNumeric("sin", [](double x) { return std::sin(x); });
+        defineNumeric("cos", [](double x) { return std::cos(x); });
+        defineNumeric("tan", [](double x) { return std::tan(x); });
+        defineNumeric("log", [](double x) { return std::log(x); });
+        defineNumeric("exp", [](double x) { return std::exp(x); });
+
+        define("range", 2, 3, true, [](const Value* args, size_t count) {
+            return Value::fromRange(args[0].toNumber(), args[1].toNumber(), (count == 3) ? args[2].toNumber() : 1.0);
+        });
+        define("len", 1, true, [](const Value* args, size_t) {
+            return Value::fromNumber(static_cast<double>(args[0].length()));
+        });
+        define("at", 2, true, [](const Value* args, size_t) {
+            double index = args[1].toNumber();
+            if (index < 0 || index >= static_cast<double>(args[0].length()) || index != std::floor(index)) {
+                throw ValueError("ndice fora da lista: ", args[1]);
+            }
+            size_t position = static_cast<size_t>(index);
+            if (args[0].isSequence()) {
+                return elementAt(args[0], position);
+            }
+            return Value::fromString(args[0].text().substr(position, 1));
+        });
+
+        define("sum", 1, true, [](const Value* args, size_t) {
+            std::vector<double> scratch;
+            const double* in = reductionInput(args[0], "sum", true, scratch);
+            return Value::fromNumber(bulkReduce<AddKernel>(in, args[0].length(), 0.0));
+        });
+        define("min", 1, true, [](const Value* args, size_t) {
+            std::vector<double> scratch;
+            const double* in = reductionInput(args[0], "min", false, scratch);
+            return Value::fromNumber(bulkReduce<MinKernel>(in, args[0].length(), in[0]));
+        });
+        define("max", 1, true, [](const Value* args, size_t) {
+            std::vector<double> scratch;
+            const double* in = reductionInput(args[0], "max", false, scratch);
+            return Value::fromNumber(bulkReduce<MaxKernel>(in, args[0].length(), in[0]));
+        });
+        define("mean", 1, true, [](const Value* args, size_t) {
+            std::vector<double> scratch;
+            const double* in = reductionInput(args[0], "mean", false, scratch);
+            size_t count = args[0].length();
+            return Value::fromNumber(bulkReduce<AddKernel>(in, count, 0.0) / static_cast<double>(count));
+        });
+    }
+
+    int32_t define(const std::string& name, uint32_t arity, bool pure, NativeFunction function) {
+        return define(name, arity, arity, pure, std::move(function));
+    }
+
+    // Redefining a name replaces its entry in place, so ids already handed out stay valid
+    int32_t define(const std::string& name, uint32_t minArity, uint32_t arity, bool pure, NativeFunction function) {
+        auto it = ids.find(name);
+        int32_t id = (it != ids.end()) ? it->second : static_cast<int32_t>(entries.size());
+        if (id == static_cast<int32_t>(entries.size())) {
+            entries.emplace_back();
+            ids[name] = id;
+        }
+
+        Builtin& entry = entries[id];
+        entry.name = name;
+        entry.minArity = minArity;
+        entry.arity = arity;
+        entry.pure = pure;
+        entry.function = std::move(function);
+        entry.numeric = nullptr;
+        return id;
+    }
+
+    // Lists are mapped element by element, through `kernel` when one is given
+    int32_t defineNumeric(const std::string& name, double (*numeric)(double), BulkKernel kernel = nullptr) {
+        int32_t id = define(name, 1, true, [numeric, kernel](const Value* args, size_t) {
+            if (args[0].isSequence()) {
+                return mapNumbers(args[0], numeric, kernel);
+            }
+            return Value::fromNumber(numeric(args[0].toNumber()));
+        });
+        entries[id].numeric = numeric;
+        return id;
+    }
+
+    int32_t find(std::string_view name) const {
+        auto it = ids.find(std::string(name));
+        return (it != ids.end()) ? it->second : -1;
+    }
+
+    const Builtin& operator[](int32_t id) const {
+        return entries[id];
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    // Numbers take the direct path; anything else goes through the generic entry
+    Value call(int32_t id, const Value* args, size_t count) const {
+        const Builtin& entry = entries[id];
+        if (entry.numeric && args[0].type == ValueType::Number) {
+            return Value::fromNumber(entry.numeric(args[0].number));
+        }
+        return entry.function(args, count);
+    }
+
+private:
+    std::vector<Builtin> entries;
+    std::unordered_map<std::string, int32_t> ids;
+
+    static const double* reductionInput(const Value& value, const char* name, bool allowEmpty, std::vector<double>& scratch) {
+        if (!value.isSequence()) {
+            throw ValueError(std::string("A funo ") + name + " espera uma lista: ", value);
+        }
+        if (!allowEmpty && value.length() == 0) {
+            throw std::runtime_error(std::string("Lista vazia na funo ") + name + ".");
+        }
+        return numericElements(value, scratch);
+    }
+};
+
+BuiltinRegistry builtins;
+
+bool isKeyword(std::string_view word) {
+    static const char* const keywords[] = { "let", "print", "if", "then", "else", "endif", "foreach", "in", "do", "end", "def", "return", "true", "false", "tolower", "toupper", "parallel", "into", "yield" };
+    return std::find(std::begin(keywords), std::end(keywords), word) != std::end(keywords);
+}
+
+class Lexer {
+public:
+    // Tokens are slices of the source buffer; it must outlive them. They are valid
+    // until the next call, which reuses their storage.
+    const std::vector<Token>& tokenize(std::string_view source) {
+        tokens.clear();
+        tokens.reserve(source.size() / 4 + 1);
+        size_t i = 0;
+        uint32_t line = 1;
+
+        while (i < source.size()) {
+            unsigned char ch = source[i];
+            uint32_t offset = static_cast<uint32_t>(i);
+
+            if (ch == '\n') {
+                tokens.push_back({ TokenType::EndOfLine, source.substr(i, 1), 0.0, offset, line });
+                ++line;
+                ++i;
+            }
+            else if (std::isspace(ch)) {
+                ++i;
+            }
+            else if (ch == '"' || (ch == 'f' && i + 1 < source.size() && source[i + 1] == '"')) {
+                bool isFString = (ch == 'f');
+                size_t start = i + (isFString ? 2 : 1);
+                size_t end = source.find_first_of("\"\n", start);
+                if (end == std::string_view::npos || source[end] != '"') {
+                    throw SyntaxError("Texto sem aspas de fechamento.", offset);
+                }
+
+                tokens.push_back({ isFString ? TokenType::FString : TokenType::String, source.substr(start, end - start), 0.0, offset, line });
+                i = end + 1;
+            }
+            else if (std::isdigit(ch) || (ch == '.' && i + 1 < source.size() && std::isdigit(static_cast<unsigned char>(source[i + 1])))) {
+                size_t start = i;
+                while (i < source.size() && (std::isdigit(static_cast<unsigned char>(source[i])) || source[i] == '.')) {
+                    ++i;
+                }
+                if (i < source.size() && (source[i] == 'e' || source[i] == 'E')) {
+                    size_t exponent = i + 1;
+                    if (exponent < source.size() && (source[exponent] == '+' || source[exponent] == '-')) {
+                        ++exponent;
+                    }
+                    if (exponent < source.size() && std::isdigit(static_cast<unsigned char>(source[exponent]))) {
+                        i = exponent;
+                        while (i < source.size() && std::isdigit(static_cast<unsigned char>(source[i]))) {
+                            ++i;
+                        }
+                    }
+                }
+
+                // Like strtod, reads as far as the number goes ("1.2.3" is 1.2)
+                Token token{ TokenType::Number, source.substr(start, i - start), 0.0, offset, line };
+                auto result = std::from_chars(token.text.data(), token.text.data() + token.text.size(), token.number);
+                if (result.ec != std::errc()) {
+                    throw SyntaxError("Nmero fora do intervalo: " + std::string(token.text), offset);
+                }
+                tokens.push_back(token);
+            }
+            else if (std::isalpha(ch) || ch == '_' || ch >= 0x80) {
+                size_t start = i;
+                while (i < source.size()) {
+                    unsigned char c = source[i];
+                    if (!std::isalnum(c) && c != '_' && c < 0x80) {
+                        break;
+                    }
+                    ++i;
+                }
+                tokens.push_back({ TokenType::Identifier, source.substr(start, i - start), 0.0, offset, line });
+            }
+            else {
+                static const char* const twoCharSymbols[] = { "==", "!=", "<=", ">=", "=>" };
+                std::string_view symbol = source.substr(i, 1);
+                if (i + 1 < source.size()) {
+                    std::string_view pair = source.substr(i, 2);
+                    if (std::find(std::begin(twoCharSymbols), std::end(twoCharSymbols), pair) != std::end(twoCharSymbols)) {
+                        symbol = pair;
+                    }
+                }
+
+                if (symbol.size() == 1 && std::string_view("+-*/^()[],=<>:").find(static_cast<char>(ch)) == std::string_view::npos) {
+                    throw SyntaxError("Caractere inesperado: " + std::string(symbol), offset);
+                }
+
+                tokens.push_back({ TokenType::Symbol, symbol, 0.0, offset, line });
+                i += symbol.size();
+            }
+        }
+
+        return tokens;
+    }
+
+private:
+    std::vector<Token> tokens;
+};
+
+class Parser {
+public:
+    explicit Parser(Arena& nodes) : nodes(nodes) {
+    }
+
+    // Parses a tokenized source. Block boundaries are indexed up front, so blocks may
+    // span lines. Function names seen earlier are remembered so calls without
+    // parentheses can be recognized.
+    std::vector<StmtPtr> parseProgram(const std::vector<Token>& sourceTokens) {
+        tokens = &sourceTokens;
+        pos = 0;
+        functionDepth = 0;
+        loops.clear();
+        parallelOuter = noBlock;
+        indexBlocks();
+
+        std::vector<StmtPtr> statements;
+        try {
+            statements = parseBlock(tokens->size());
+        }
+        catch (const SyntaxError&) {
+            throw;
+        }
+        catch (const std::runtime_error& e) {
+            size_t at = std::min(pos, tokens->size() - 1);
+            throw SyntaxError(e.what(), (*tokens)[at].offset);
+        }
+        return statements;
+    }
+
+private:
+    static constexpr size_t noBlock = SIZE_MAX;
+    static constexpr uint8_t collectingLoop = 1;   // foreach ... into
+    static constexpr uint8_t parallelLoop = 2;
+
+    Arena& nodes;       // where the tree is built; owned by the script
+
+    const std::vector<Token>* tokens = nullptr;
+    size_t pos = 0;
+    std::vector<std::string> knownFunctions;
+    std::vector<std::string> pureFunctions;
+    std::vector<std::string> variables;     // names bound so far where the parser is; they shadow builtins
+    size_t functionDepth = 0;
+    std::vector<uint8_t> loops;     // flags of the foreach loops around the statement, in the current function
+    size_t parallelOuter = noBlock; // variables before this index were bound outside the innermost parallel body
+    std::vector<size_t> blockElse;  // token index of the 'else' of each 'if'
+    std::vector<size_t> blockEnd;   // token index of the 'endif'/'end' closing each block opener
+
+    // Statements and blocks end with their line
+    bool atEnd() const {
+        return pos >= tokens->size() || (*tokens)[pos].type == TokenType::EndOfLine;
+    }
+
+    const Token& peek() const {
+        return (*tokens)[pos];
+    }
+
+    bool check(TokenType type, std::string_view text) const {
+        return !atEnd() && peek().type == type && peek().text == text;
+    }
+
+    bool checkWord(std::string_view word) const {
+        return check(TokenType::Identifier, word);
+    }
+
+    bool checkSymbol(std::string_view symbol) const {
+        return check(TokenType::Symbol, symbol);
+    }
+
+    Token advance() {
+        if (atEnd()) {
+            throw std::runtime_error("Fim de linha inesperado.");
+        }
+        return (*tokens)[pos++];
+    }
+
+    void expectWord(const std::string& word, const std::string& command) {
+        if (!checkWord(word)) {
+            throw std::runtime_error("Sintaxe incorreta para o comando '" + command + "'.");
+        }
+        ++pos;
+    }
+
+    void expectSymbol(const std::string& symbol, const std::string& command) {
+        if (!checkSymbol(symbol)) {
+            throw std::runtime_error("Sintaxe incorreta para o comando '" + command + "'.");
+        }
+        ++pos;
+    }
+
+    std::string expectName(const std::string& command) {
+        if (atEnd() || peek().type != TokenType::Identifier || isKeyword(peek().text)) {
+            throw std::runtime_error("Sintaxe incorreta para o comando '" + command + "'.");
+        }
+        return std::string(advance().text);
+    }
+
+    // Single linear pass matching if/else/endif, foreach/end and def/end with a stack
+    void indexBlocks() {
+        blockElse.assign(tokens->size(), noBlock);
+        blockEnd.assign(tokens->size(), noBlock);
+
+        std::vector<size_t> open;
+        for (size_t i = 0; i < tokens->size(); ++i) {
+            const Token& token = (*tokens)[i];
+            if (token.type != TokenType::Identifier) {
+                continue;
+            }
+
+            if (token.text == "if" || token.text == "foreach" || token.text == "def") {
+                open.push_back(i);
+            }
+            else if (token.text == "else" || token.text == "endif" || token.text == "end") {
+                if (open.empty()) {
+                    throw SyntaxError("Comando inesperado: " + std::string(token.text), token.offset);
+                }
+
+                size_t opener = open.back();
+                bool isIf = (*tokens)[opener].text == "if";
+                if (token.text == "else") {
+                    if (!isIf || blockElse[opener] != noBlock) {
+                        throw SyntaxError("Comando inesperado: else", token.offset);
+                    }
+                    blockElse[opener] = i;
+                    continue;
+                }
+
+                if (isIf != (token.text == "endif")) {
+                    throw SyntaxError(std::string("Estrutura de bloco invlida: faltando comando '") + (isIf ? "endif" : "end") + "'.", token.offset);
+                }
+                blockEnd[opener] = i;
+                open.pop_back();
+            }
+        }
+
+        if (!open.empty()) {
+            const Token& opener = (*tokens)[open.back()];
+            throw SyntaxError(std::string("Estrutura de bloco invlida: faltando comando '") + (opener.text == "if" ? "endif" : "end") + "'.", opener.offset);
+        }
+    }
+
+    // A builtin whose name was bound by let, foreach, tolower/toupper or a parameter is
+    // read as that variable ("let max = 5" then "max - 1"); it is still called with "max(...)"
+    bool isFunctionName(std::string_view name) const {
+        if (isUserFunction(name)) {
+            return true;
+        }
+        return builtins.find(name) >= 0 && std::find(variables.begin(), variables.end(), name) == variables.end();
+    }
+
+    // A def seen earlier is called in place of a builtin of the same name
+    bool isUserFunction(std::string_view name) const {
+        return std::find(knownFunctions.begin(), knownFunctions.end(), name) != knownFunctions.end();
+    }
+
+    bool startsExpression() const {
+        if (atEnd()) {
+            return false;
+        }
+
+        const Token& token = peek();
+        switch (token.type) {
+        case TokenType::Number:
+        case TokenType::String:
+        case TokenType::FString:
+            return true;
+        case TokenType::Identifier:
+            return token.text == "true" || token.text == "false" || !isKeyword(token.text);
+        case TokenType::Symbol:
+            return token.text == "(" || token.text == "[" || token.text == "-";
+        case TokenType::EndOfLine:
+            break;
+        }
+        return false;
+    }
+
+    // Parses statements up to the token index taken from the block index
+    std::vector<StmtPtr> parseBlock(size_t boundary) {
+        std::vector<StmtPtr> block;
+        while (true) {
+            while (pos < boundary && peek().type == TokenType::EndOfLine) {
+                ++pos;
+            }
+            if (pos >= boundary) {
+                break;
+            }
+            uint32_t line = peek().line;
+            block.push_back(parseStatement());
+            block.back()->line = line;
+        }
+
+        if (pos != boundary) {
+            throw std::runtime_error("Estrutura de bloco invlida.");
+        }
+        return block;
+    }
+
+    StmtPtr parseStatement() {
+        const Token& token = peek();
+        if (token.type != TokenType::Identifier) {
+            throw std::runtime_error("Comando desconhecido: " + std::string(token.text));
+        }
+
+        std::string command(token.text);
+        if (command == "let") {
+            return parseLet();
+        }
+        else if (command == "print") {
+            return parsePrint();
+        }
+        else if (command == "if") {
+            return parseIf();
+        }
+        else if (command == "foreach" || command == "parallel") {
+            return parseForEach();
+        }
+        else if (command == "yield") {
+            return parseYield();
+        }
+        else if (command == "def") {
+            return parseDef();
+        }
+        else if (command == "return") {
+            return parseReturn();
+        }
+        else if (command == "tolower" || command == "toupper") {
+            return parseCaseConversion();
+        }
+        else if (builtins.find(command) >= 0 && !isUserFunction(command)) {
+            auto stmt = StmtPtr(nodes.make<Stmt>());
+            stmt->kind = StmtKind::BuiltinCommand;
+            stmt->name = advance().text;
+            parseArguments(stmt->args);
+            return stmt;
+        }
+        else if (!isKeyword(command)) {
+            return parseCall();
+        }
+
+        throw std::runtime_error("Comando desconhecido: " + command);
+    }
+
+    StmtPtr parseLet() {
+        auto stmt = StmtPtr(nodes.make<Stmt>());
+        stmt->kind = StmtKind::Let;
+        advance();
+        checkAssignable(pos);
+        stmt->name = expectName("let");
+        expectSymbol("=", "let");
+        if (!startsExpression()) {
+            throw std::runtime_error("Sintaxe incorreta para o comando 'let'.");
+        }
+        stmt->value = parseExpression();
+        variables.push_back(stmt->name);
+        return stmt;
+    }
+
+    StmtPtr parsePrint() {
+        auto stmt = StmtPtr(nodes.make<Stmt>());
+        stmt->kind = StmtKind::Print;
+        advance();
+        while (startsExpression()) {
+            stmt->args.push_back(parseExpression());
+        }
+        if (stmt->args.empty()) {
+            throw std::runtime_error("Sintaxe incorreta para o comando 'print'.");
+        }
+        return stmt;
+    }
+
+    StmtPtr parseIf() {
+        auto stmt = StmtPtr(nodes.make<Stmt>());
+        stmt->kind = StmtKind::If;
+        size_t opener = pos;
+        advance();
+        if (!startsExpression()) {
+            throw std::runtime_error("Sintaxe incorreta para o comando 'if'.");
+        }
+        stmt->value = parseExpression();
+        expectWord("then", "if");
+
+        if (blockElse[opener] != noBlock) {
+            stmt->body = parseBlock(blockElse[opener]);
+            ++pos;
+            stmt->elseBody = parseBlock(blockEnd[opener]);
+        }
+        else {
+            stmt->body = parseBlock(blockEnd[opener]);
+        }
+        ++pos;
+        return stmt;
+    }
+
+    // foreach x in xs [into ys] do ... end, optionally prefixed by "parallel"
+    StmtPtr parseForEach() {
+        auto stmt = StmtPtr(nodes.make<Stmt>());
+        stmt->kind = StmtKind::ForEach;
+        if (checkWord("parallel")) {
+            advance();
+            if (!checkWord("foreach")) {
+                throw std::runtime_error("Sintaxe incorreta para o comando 'parallel'.");
+            }
+            stmt->parallel = true;
+        }
+
+        size_t opener = pos;
+        advance();
+        if (!stmt->parallel) {
+            checkAssignable(pos);
+        }
+        stmt->name = expectName("foreach");
+        expectWord("in", "foreach");
+        if (!startsExpression()) {
+            throw std::runtime_error("Sintaxe incorreta para o comando 'foreach'.");
+        }
+        stmt->value = parseExpression();
+        if (checkWord("into")) {
+            advance();
+            checkAssignable(pos);
+            stmt->collect = expectName("foreach");
+            variables.push_back(stmt->collect);
+        }
+        expectWord("do", "foreach");
+
+        // Names bound in a parallel body belong to its iterations and end with it
+        size_t enclosingOuter = parallelOuter;
+        size_t enclosingVariables = variables.size();
+        if (stmt->parallel) {
+            parallelOuter = enclosingVariables;
+        }
+        variables.push_back(stmt->name);
+
+        loops.push_back((stmt->collect.empty() ? 0 : collectingLoop) | (stmt->parallel ? parallelLoop : 0));
+        stmt->body = parseBlock(blockEnd[opener]);
+        loops.pop_back();
+        if (stmt->parallel) {
+            variables.resize(enclosingVariables);
+            parallelOuter = enclosingOuter;
+        }
+        ++pos;
+        return stmt;
+    }
+
+    // Each iteration of a parallel loop works on its own copies of the names around
+    // it, so assigning one of them there would be silently lost
+    void checkAssignable(size_t at) {
+        if (parallelOuter == noBlock || at >= tokens->size() || (*tokens)[at].type != TokenType::Identifier) {
+            return;
+        }
+        std::string name((*tokens)[at].text);
+        auto outer = variables.begin() + static_cast<std::ptrdiff_t>(parallelOuter);
+        if (std::find(variables.begin(), outer, name) != outer) {
+            pos = at;
+            throw std::runtime_error("Atribuio a varivel externa no permitida dentro de um foreach paralelo: " + name);
+        }
+    }
+
+    bool insideParallelLoop() const {
+        return std::any_of(loops.begin(), loops.end(), [](uint8_t flags) { return (flags & parallelLoop) != 0; });
+    }
+
+    // A value is yielded to the nearest loop with 'into'; the iterations of a parallel
+    // loop in between cannot reach it
+    StmtPtr parseYield() {
+        bool collecting = false;
+        for (auto it = loops.rbegin(); it != loops.rend() && !collecting; ++it) {
+            if ((*it & collectingLoop) == 0 && (*it & parallelLoop) != 0) {
+                break;
+            }
+            collecting = (*it & collectingLoop) != 0;
+        }
+        if (!collecting) {
+            throw std::runtime_error("Comando 'yield' fora de um foreach com 'into'.");
+        }
+
+        auto stmt = StmtPtr(nodes.make<Stmt>());
+        stmt->kind = StmtKind::Yield;
+        advance();
+        if (!startsExpression()) {
+            throw std::runtime_error("Sintaxe incorreta para o comando 'yield'.");
+        }
+        stmt->value = parseExpression();
+        return stmt;
+    }
+
+    StmtPtr parseDef() {
+        if (insideParallelLoop()) {
+            throw std::runtime_error("Comando 'def' no permitido dentro de um foreach paralelo.");
+        }
+
+        auto stmt = StmtPtr(nodes.make<Stmt>());
+        stmt->kind = StmtKind::Def;
+        size_t opener = pos;
+        advance();
+        // "def pure f =>"; a function may itself be called pure
+        if (checkWord("pure") && pos + 1 < tokens->size() && (*tokens)[pos + 1].type == TokenType::Identifier) {
+            advance();
+            stmt->pure = true;
+        }
+        stmt->name = expectName("def");
+        expectSymbol("=>", "def");
+
+        if (!atEnd() && peek().type == TokenType::Identifier && !isKeyword(peek().text)) {
+            while (true) {
+                stmt->params.push_back(expectName("def"));
+                stmt->booleanParams.push_back(checkSymbol(":"));
+                if (checkSymbol(":")) {
+                    advance();
+                }
+
+                if (!checkSymbol(",")) {
+                    break;
+                }
+                advance();
+            }
+        }
+
+        // Every definition of a name agrees, so a pure caller never reaches an impure one
+        bool declaredPure = std::find(pureFunctions.begin(), pureFunctions.end(), stmt->name) != pureFunctions.end();
+        if (declaredPure != stmt->pure && std::find(knownFunctions.begin(), knownFunctions.end(), stmt->name) != knownFunctions.end()) {
+            pos = opener;
+            throw std::runtime_error((declaredPure ? "Funo pura redefinida sem 'pure': " : "Funo redefinida como pura: ") + stmt->name);
+        }
+        if (stmt->pure && !declaredPure) {
+            pureFunctions.push_back(stmt->name);
+        }
+
+        knownFunctions.push_back(stmt->name);
+        std::vector<uint8_t> enclosingLoops;
+        enclosingLoops.swap(loops);
+        size_t enclosingVariables = variables.size();
+        variables.insert(variables.end(), stmt->params.begin(), stmt->params.end());
+        ++functionDepth;
+        stmt->body = parseBlock(blockEnd[opener]);
+        --functionDepth;
+        variables.resize(enclosingVariables);
+        loops.swap(enclosingLoops);
+        if (stmt->pure) {
+            size_t end = pos;
+            pos = opener;
+            std::vector<std::vector<std::string>> scopes(1, stmt->params);
+            scopes[0].push_back(stmt->name);
+            assignedNames(stmt->body, scopes[0]);
+            checkPure(stmt->body, scopes);
+            pos = end;
+        }
+        ++pos;
+        return stmt;
+    }
+
+    // Names a block assigns, which are locals of its frame, as the resolver sees them
+    static void assignedNames(const std::vector<StmtPtr>& block, std::vector<std::string>& names) {
+        for (const StmtPtr& stmt : block) {
+            switch (stmt->kind) {
+            case StmtKind::ForEach:
+                if (!stmt->collect.empty()) {
+                    names.push_back(stmt->collect);
+                }
+                if (stmt->parallel) {
+                    continue;
+                }
+                names.push_back(stmt->name);
+                break;
+            case StmtKind::Let:
+            case StmtKind::ToLower:
+            case StmtKind::ToUpper:
+                names.push_back(stmt->name);
+                break;
+            default:
+                break;
+            }
+            assignedNames(stmt->body, names);
+            assignedNames(stmt->elseBody, names);
+        }
+    }
+
+    // The body of a pure function prints nothing, defines nothing, reads no global and
+    // calls only pure functions, so its result depends on the arguments alone. Errors
+    // are reported at the 'def'.
+    void checkPure(const std::vector<StmtPtr>& block, std::vector<std::vector<std::string>>& scopes) {
+        for (const StmtPtr& stmt : block) {
+            switch (stmt->kind) {
+            case StmtKind::Print:
+            case StmtKind::Def:
+                throw std::runtime_error(std::string("Comando '") + (stmt->kind == StmtKind::Print ? "print" : "def") + "' no permitido em uma funo pura.");
+            case StmtKind::BuiltinCommand:
+                throw std::runtime_error("Comando '" + stmt->name + "' no permitido em uma funo pura.");
+            case StmtKind::Call:
+                checkPureCall(stmt->name, true);
+                break;
+            case StmtKind::ToLower:
+            case StmtKind::ToUpper:
+                checkPureRead(stmt->source, scopes);
+                break;
+            default:
+                break;
+            }
+
+            if (stmt->value) {
+                checkPure(*stmt->value, scopes);
+            }
+            for (const ExprPtr& argument : stmt->args) {
+                checkPure(*argument, scopes);
+            }
+            if (stmt->kind == StmtKind::ForEach && stmt->parallel) {
+                scopes.emplace_back(1, stmt->name);
+                assignedNames(stmt->body, scopes.back());
+                checkPure(stmt->body, scopes);
+                scopes.pop_back();
+                continue;
+            }
+            checkPure(stmt->body, scopes);
+            checkPure(stmt->elseBody, scopes);
+        }
+    }
+
+    void checkPure(const Expr& expr, const std::vector<std::vector<std::string>>& scopes) {
+        if (expr.kind == ExprKind::Variable) {
+            checkPureRead(expr.text, scopes);
+        }
+        else if (expr.kind == ExprKind::Call) {
+            checkPureCall(expr.text, expr.userFunction);
+        }
+        for (const ExprPtr& operand : expr.operands) {
+            checkPure(*operand, scopes);
+        }
+    }
+
+    // A parallel loop body also reads the locals around it
+    static void checkPureRead(const std::string& name, const std::vector<std::vector<std::string>>& scopes) {
+        for (const std::vector<std::string>& names : scopes) {
+            if (std::find(names.begin(), names.end(), name) != names.end()) {
+                return;
+            }
+        }
+        throw std::runtime_error("Funo pura no pode ler a varivel global: " + name);
+    }
+
+    void checkPureCall(const std::string& name, bool userFunction) const {
+        int32_t id = userFunction ? -1 : builtins.find(name);
+        bool pure = (id >= 0) ? builtins[id].pure : std::find(pureFunctions.begin(), pureFunctions.end(), name) != pureFunctions.end();
+        if (!pure) {
+            throw std::runtime_error("Funo pura no pode chamar a funo impura: " + name);
+        }
+    }
+
+    StmtPtr parseReturn() {
+        if (functionDepth == 0) {
+            throw std::runtime_error("Comando 'return' fora de uma funo.");
+        }
+        if (insideParallelLoop()) {
+            throw std::runtime_error("Comando 'return' no permitido dentro de um foreach paralelo.");
+        }
+
+        auto stmt = StmtPtr(nodes.make<Stmt>());
+        stmt->kind = StmtKind::Return;
+        advance();
+        if (startsExpression()) {
+            stmt->value = parseExpression();
+        }
+        return stmt;
+    }
+
+    StmtPtr parseCaseConversion() {
+        auto stmt = StmtPtr(nodes.make<Stmt>());
+        std::string command(advance().text);
+        stmt->kind = (command == "tolower") ? StmtKind::ToLower : StmtKind::ToUpper;
+        if (atEnd() || peek().type != TokenType::Identifier) {
+            throw std::runtime_error("Uso incorreto da funo " + command);
+        }
+        checkAssignable(pos);
+        stmt->name = advance().text;
+        if (atEnd() || peek().type != TokenType::Identifier) {
+            throw std::runtime_error("Uso incorreto da funo " + command);
+        }
+        stmt->source = advance().text;
+        variables.push_back(stmt->name);
+        return stmt;
+    }
+
+    StmtPtr parseCall() {
+        auto stmt = StmtPtr(nodes.make<Stmt>());
+        stmt->kind = StmtKind::Call;
+        stmt->name = advance().text;
+        parseArguments(stmt->args);
+        return stmt;
+    }
+
+    // Arguments are separated by commas, or simply by whitespace as in "soma 1 2".
+    void parseArguments(std::vector<ExprPtr>& args) {
+        if (checkSymbol("(")) {
+            advance();
+            while (!checkSymbol(")")) {
+                args.push_back(parseExpression());
+                if (!checkSymbol(",")) {
+                    break;
+                }
+                advance();
+            }
+            expectSymbol(")", "chamada de funo");
+            return;
+        }
+
+        while (startsExpression()) {
+            args.push_back(parseExpression());
+            if (checkSymbol(",")) {
+                advance();
+            }
+        }
+    }
+
+    // Splits f"a {expr} b" into literal segments and parsed hole expressions
+    void parseTemplate(Expr& expr) {
+        const std::string& text = expr.text;
+        std::string segment;
+        size_t i = 0;
+
+        while (i < text.size()) {
+            size_t open = text.find('{', i);
+            size_t close = (open == std::string::npos) ? std::string::npos : text.find('}', open + 1);
+            if (close == std::string::npos) {
+                segment.append(text, i, std::string::npos);
+                break;
+            }
+
+            segment.append(text, i, open - i);
+            expr.segments.push_back(std::move(segment));
+            segment.clear();
+            expr.operands.push_back(parseHole(text.substr(open + 1, close - open - 1)));
+            i = close + 1;
+        }
+        expr.segments.push_back(std::move(segment));
+    }
+
+    // Errors inside a hole are reported at the f-string token that holds it
+    ExprPtr parseHole(const std::string& source) {
+        const std::vector<Token>* savedTokens = tokens;
+        size_t savedPos = pos;
+
+        std::vector<Token> holeTokens;
+        ExprPtr hole;
+        bool consumed = false;
+        try {
+            Lexer lexer;
+            holeTokens = lexer.tokenize(source);
+            if (holeTokens.empty()) {
+                throw std::runtime_error("Expresso vazia em f-string.");
+            }
+
+            tokens = &holeTokens;
+            pos = 0;
+            hole = parseExpression();
+            consumed = atEnd();
+        }
+        catch (const std::runtime_error& e) {
+            tokens = savedTokens;
+            pos = savedPos - 1;
+            throw std::runtime_error(e.what());
+        }
+
+        tokens = savedTokens;
+        pos = savedPos;
+        if (!consumed) {
+            --pos;
+            throw std::runtime_error("Expresso invlida em f-string: " + source);
+        }
+        return hole;
+    }
+
+    ExprPtr makeBinary(Operator op, ExprPtr lhs, ExprPtr rhs) {
+        auto expr = ExprPtr(nodes.make<Expr>());
+        expr->kind = ExprKind::Binary;
+        expr->op = op;
+        expr->operands.push_back(std::move(lhs));
+        expr->operands.push_back(std::move(rhs));
+        return expr;
+    }
+
+    ExprPtr parseExpression() {
+        ExprPtr lhs = parseAdditive();
+
+        static const std::pair<const char*, Operator> comparisons[] = {
+            { "==", Operator::Equal }, { "!=", Operator::NotEqual },
+            { "<", Operator::Less }, { "<=", Operator::LessEqual },
+            { ">", Operator::Greater }, { ">=", Operator::GreaterEqual }
+        };
+        for (const auto& comparison : comparisons) {
+            if (checkSymbol(comparison.first)) {
+                advance();
+                return makeBinary(comparison.second, std::move(lhs), parseAdditive());
+            }
+        }
+        return lhs;
+    }
+
+    ExprPtr parseAdditive() {
+        ExprPtr lhs = parseMultiplicative();
+        while (checkSymbol("+") || checkSymbol("-")) {
+            Operator op = (advance().text == "+") ? Operator::Add : Operator::Subtract;
+            lhs = makeBinary(op, std::move(lhs), parseMultiplicative());
+        }
+        return lhs;
+    }
+
+    ExprPtr parseMultiplicative() {
+        ExprPtr lhs = parseUnary();
+        while (checkSymbol("*") || checkSymbol("/")) {
+            Operator op = (advance().text == "*") ? Operator::Multiply : Operator::Divide;
+            lhs = makeBinary(op, std::move(lhs), parseUnary());
+        }
+        return lhs;
+    }
+
+    ExprPtr parseUnary() {
+        if (checkSymbol("-")) {
+            advance();
+            auto expr = ExprPtr(nodes.make<Expr>());
+            expr->kind = ExprKind::Unary;
+            expr->op = Operator::Negate;
+            expr->operands.push_back(parseUnary());
+            return expr;
+        }
+        return parsePower();
+    }
+
+    ExprPtr parsePower() {
+        ExprPtr lhs = parsePrimary();
+        while (checkSymbol("^")) {
+            advance();
+            lhs = makeBinary(Operator::Power, std::move(lhs), parseExponent());
+        }
+        return lhs;
+    }
+
+    // "a ^ -1": the exponent may be negated; chains still group from the left
+    ExprPtr parseExponent() {
+        if (!checkSymbol("-")) {
+            return parsePrimary();
+        }
+        advance();
+        auto expr = ExprPtr(nodes.make<Expr>());
+        expr->kind = ExprKind::Unary;
+        expr->op = Operator::Negate;
+        expr->operands.push_back(parseExponent());
+        return expr;
+    }
+
+    ExprPtr parsePrimary() {
+        if (atEnd()) {
+            throw std::runtime_error("Expresso invlida: fim de linha inesperado.");
+        }
+
+        Token token = advance();
+        auto expr = ExprPtr(nodes.make<Expr>());
+        expr->text = token.text;
+
+        switch (token.type) {
+        case TokenType::Number:
+            expr->kind = ExprKind::Number;
+            expr->literal = Value::fromNumber(token.number);
+            return expr;
+        case TokenType::String:
+            expr->kind = ExprKind::String;
+            expr->literal = Value::fromString(std::string(token.text));
+            return expr;
+        case TokenType::FString:
+            expr->kind = ExprKind::FString;
+            parseTemplate(*expr);
+            return expr;
+        case TokenType::Symbol:
+            if (token.text == "(") {
+                ExprPtr inner = parseExpression();
+                if (!checkSymbol(")")) {
+                    throw std::runtime_error("Expresso invlida: parnteses no correspondentes.");
+                }
+                advance();
+                return inner;
+            }
+            if (token.text == "[") {
+                expr->kind = ExprKind::List;
+                while (!checkSymbol("]")) {
+                    expr->operands.push_back(parseExpression());
+                    if (!checkSymbol(",")) {
+                        break;
+                    }
+                    advance();
+                }
+                if (!checkSymbol("]")) {
+                    throw std::runtime_error("Expresso invlida: colchetes no correspondentes.");
+                }
+                advance();
+                return expr;
+            }
+            throw std::runtime_error("Expresso invlida: " + std::string(token.text));
+        case TokenType::Identifier:
+        case TokenType::EndOfLine:
+            break;
+        }
+
+        if (token.text == "true" || token.text == "false") {
+            expr->kind = ExprKind::Boolean;
+            expr->literal = Value::fromBoolean(token.text == "true");
+            return expr;
+        }
+        if (isKeyword(token.text)) {
+            throw std::runtime_error("Expresso invlida: " + std::string(token.text));
+        }
+
+        // "f(a, b)" always calls; "sqrt x" applies a known function to the next operand
+        if (checkSymbol("(") || (isFunctionName(token.text) && startsExpression())) {
+            expr->kind = ExprKind::Call;
+            expr->userFunction = isUserFunction(token.text);
+            if (checkSymbol("(")) {
+                parseArguments(expr->operands);
+            }
+            else {
+                expr->operands.push_back(parseUnary());
+            }
+            return expr;
+        }
+
+        expr->kind = ExprKind::Variable;
+        return expr;
+    }
+};
+
+// Binds every identifier in the tree to its interned symbol, so execution
+// reads and writes variables by slot instead of by name.
+class Resolver {
+public:
+    explicit Resolver(SymbolTable& symbols) : symbols(symbols) {
+    }
+
+    void resolve(std::vector<StmtPtr>& program) {
+        for (StmtPtr& stmt : program) {
+            resolveStatement(*stmt);
+        }
+    }
+
+private:
+    // Locals of the function or parallel loop body being resolved
+    struct Scope {
+        std::unordered_map<std::string, int32_t> slots;
+        int32_t result = 0;
+        Scope* enclosing = nullptr;     // parallel loop body: the scope around the loop
+        Stmt* capturer = nullptr;       // parallel loop body: the loop
+    };
+
+    SymbolTable& symbols;
+    Scope* scope = nullptr;
+
+    int32_t bind(const std::string& name) {
+        ++symbols.resolved;
+        return symbols.intern(name);
+    }
+
+    int32_t bindLocal(const std::string& name) {
+        int32_t local = findLocal(scope, name);
+        if (local >= 0) {
+            ++symbols.resolved;
+        }
+        return local;
+    }
+
+    // A parallel loop body reads the locals around it through copies taken when the
+    // loop starts, held in slots of its own iteration frame
+    int32_t findLocal(Scope* current, const std::string& name) {
+        if (!current) {
+            return -1;
+        }
+        auto it = current->slots.find(name);
+        if (it != current->slots.end()) {
+            return it->second;
+        }
+
+        int32_t outer = findLocal(current->enclosing, name);
+        if (outer < 0) {
+            return -1;
+        }
+        Stmt& loop = *current->capturer;
+        int32_t local = static_cast<int32_t>(loop.locals.size());
+        loop.locals.push_back(name);
+        loop.captures.emplace_back(outer, local);
+        current->slots.emplace(name, local);
+        return local;
+    }
+
+    // Parameters, the function's own name (its result) and every name assigned in the
+    // body are locals; anything else the body reads is a global.
+    void declareLocals(Stmt& def, Scope& function) {
+        for (const std::string& parameter : def.params) {
+            declareLocal(def, function, parameter);
+        }
+        function.result = static_cast<int32_t>(def.locals.size());
+        def.locals.push_back(def.name);
+        function.slots.emplace(def.name, function.result);
+        declareAssigned(def, function, def.body);
+    }
+
+    void declareLocal(Stmt& def, Scope& function, const std::string& name) {
+        if (function.slots.emplace(name, static_cast<int32_t>(def.locals.size())).second) {
+            def.locals.push_back(name);
+        }
+    }
+
+    // The body of a parallel loop has a frame of its own; only its 'into' target is
+    // assigned in the enclosing one
+    void declareAssigned(Stmt& def, Scope& function, const std::vector<StmtPtr>& block) {
+        for (const StmtPtr& stmt : block) {
+            switch (stmt->kind) {
+            case StmtKind::ForEach:
+                if (!stmt->collect.empty()) {
+                    declareLocal(def, function, stmt->collect);
+                }
+                if (stmt->parallel) {
+                    continue;
+                }
+                declareLocal(def, function, stmt->name);
+                break;
+            case StmtKind::Let:
+            case StmtKind::ToLower:
+            case StmtKind::ToUpper:
+                declareLocal(def, function, stmt->name);
+                break;
+            case StmtKind::Def:
+                continue;
+            default:
+                break;
+            }
+            declareAssigned(def, function, stmt->body);
+            declareAssigned(def, function, stmt->elseBody);
+        }
+    }
+
+    void resolveBlock(std::vector<StmtPtr>& block) {
+        for (StmtPtr& stmt : block) {
+            resolveStatement(*stmt);
+        }
+    }
+
+    void resolveStatement(Stmt& stmt) {
+        switch (stmt.kind) {
+        case StmtKind::ForEach:
+            if (!stmt.collect.empty()) {
+                stmt.collectLocal = bindLocal(stmt.collect);
+                if (stmt.collectLocal < 0) {
+                    stmt.collectSlot = bind(stmt.collect);
+                }
+            }
+            if (stmt.parallel) {
+                break;
+            }
+            stmt.local = bindLocal(stmt.name);
+            if (stmt.local < 0) {
+                stmt.slot = bind(stmt.name);
+            }
+            break;
+        case StmtKind::Let:
+            stmt.local = bindLocal(stmt.name);
+            if (stmt.local < 0) {
+                stmt.slot = bind(stmt.name);
+            }
+            break;
+        case StmtKind::Def:
+        case StmtKind::Call:
+            stmt.slot = bind(stmt.name);
+            break;
+        case StmtKind::Return:
+            stmt.local = scope->result;
+            break;
+        case StmtKind::ToLower:
+        case StmtKind::ToUpper:
+            stmt.local = bindLocal(stmt.name);
+            if (stmt.local < 0) {
+                stmt.slot = bind(stmt.name);
+            }
+            stmt.sourceLocal = bindLocal(stmt.source);
+            if (stmt.sourceLocal < 0) {
+                stmt.sourceSlot = bind(stmt.source);
+            }
+            break;
+        case StmtKind::BuiltinCommand:
+            stmt.builtin = builtins.find(stmt.name);
+            break;
+        case StmtKind::Print:
+        case StmtKind::If:
+        case StmtKind::Yield:
+            break;
+        }
+
+        if (stmt.value) {
+            resolveExpression(*stmt.value);
+        }
+        for (ExprPtr& argument : stmt.args) {
+            resolveExpression(*argument);
+        }
+
+        if (stmt.kind == StmtKind::Def) {
+            Scope function;
+            stmt.locals.clear();
+            declareLocals(stmt, function);
+
+            Scope* enclosing = scope;
+            scope = &function;
+            resolveBlock(stmt.body);
+            scope = enclosing;
+            return;
+        }
+        if (stmt.kind == StmtKind::ForEach && stmt.parallel) {
+            Scope body;
+            body.enclosing = scope;
+            body.capturer = &stmt;
+            stmt.locals.clear();
+            stmt.captures.clear();
+            declareLocal(stmt, body, stmt.name);
+            declareAssigned(stmt, body, stmt.body);
+            stmt.local = 0;
+
+            scope = &body;
+            resolveBlock(stmt.body);
+            scope = body.enclosing;
+            return;
+        }
+        resolveBlock(stmt.body);
+        resolveBlock(stmt.elseBody);
+    }
+
+    void resolveExpression(Expr& expr) {
+        if (expr.kind == ExprKind::Call) {
+            expr.builtin = expr.userFunction ? -1 : builtins.find(expr.text);
+            if (expr.builtin < 0) {
+                expr.slot = bind(expr.text);
+            }
+        }
+        else if (expr.kind == ExprKind::Variable) {
+            expr.local = bindLocal(expr.text);
+            if (expr.local < 0) {
+                expr.slot = bind(expr.text);
+            }
+        }
+        for (ExprPtr& operand : expr.operands) {
+            resolveExpression(*operand);
+        }
+    }
+};
+
+// --profile. Counts are exact: the running thread bumps them at every statement, call
+// and builtin. Time is sampled: that thread only publishes where it is, in relaxed
+// atomics, and a sampler thread reads the position every millisecond and tallies it.
+// A sample may catch a call half pushed; over many samples that does not matter.
+// Parallel foreach iterations that run on pool threads are not followed, so their
+// time is charged to the line of the loop.
+class Profiler {
+public:
+    static constexpr size_t maxDepth = 256;    // deeper calls are sampled as if at this depth
+
+    Profiler() : builtinCalls(builtins.size(), 0) {
+    }
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    ~Profiler() {
+        stop();
+    }
+
+    void start() {
+        started = std::chrono::steady_clock::now();
+        running = true;
+        sampler = std::thread([this] { sampleLoop(); });
+    }
+
+    void stop() {
+        if (!sampler.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        wake.notify_all();
+        sampler.join();
+        elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    }
+
+    // Called on the running thread
+
+    void enterLine(uint32_t line) {
+        if (line >= lineRuns.size()) {
+            lineRuns.resize(line + 1, 0);
+        }
+        ++lineRuns[line];
+        position.store(line, std::memory_order_relaxed);
+    }
+
+    void enterFunction(int32_t slot) {
+        countCall(slot);
+        uint32_t depth = callDepth.load(std::memory_order_relaxed);
+        if (depth < maxDepth) {
+            frames[depth].function.store(slot, std::memory_order_relaxed);
+            frames[depth].callerLine.store(position.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        callDepth.store(depth + 1, std::memory_order_release);
+    }
+
+    // A tail call puts the callee in the place of the function on top
+    void replaceFunction(int32_t slot) {
+        countCall(slot);
+        uint32_t depth = callDepth.load(std::memory_order_relaxed);
+        if (depth > 0 && depth <= maxDepth) {
+            frames[depth - 1].function.store(slot, std::memory_order_relaxed);
+        }
+    }
+
+    void leaveFunction() {
+        uint32_t depth = callDepth.load(std::memory_order_relaxed);
+        if (depth == 0) {
+            return;
+        }
+        if (depth <= maxDepth) {
+            position.store(frames[depth - 1].callerLine.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        callDepth.store(depth - 1, std::memory_order_release);
+    }
+
+    void enterBuiltin(int32_t id) {
+        ++builtinCalls[id];
+        builtin.store(id, std::memory_order_relaxed);
+    }
+
+    void leaveBuiltin() {
+        builtin.store(-1, std::memory_order_relaxed);
+    }
+
+    // What compiled code ran, counted after the fact; its time went to the line and
+    // function that called it
+    void addLineRuns(uint32_t line, uint64_t runs) {
+        if (line >= lineRuns.size()) {
+            lineRuns.resize(line + 1, 0);
+        }
+        lineRuns[line] += runs;
+    }
+
+    void addCalls(int32_t slot, uint64_t calls) {
+        countCall(slot, calls);
+    }
+
+    void addBuiltinCalls(int32_t id, uint64_t calls) {
+        builtinCalls[id] += calls;
+    }
+
+    // Forgets the calls an error left open
+    void unwind() {
+        callDepth.store(0, std::memory_order_release);
+        builtin.store(-1, std::memory_order_relaxed);
+    }
+
+    // Read once stopped
+
+    std::string report(const SymbolTable& symbols) const {
+        std::map<uint32_t, uint64_t> lineSamples;
+        std::map<int32_t, uint64_t> selfSamples;
+        std::map<int32_t, uint64_t> totalSamples;
+        std::map<int32_t, uint64_t> builtinSamples;
+        for (const auto& entry : stacks) {
+            StackView view(entry.first);
+            lineSamples[view.line] += entry.second;
+            if (view.functions > 0) {
+                selfSamples[entry.first[view.functions - 1]] += entry.second;
+            }
+            std::vector<int32_t> seen(entry.first.begin(), entry.first.begin() + view.functions);
+            std::sort(seen.begin(), seen.end());
+            seen.erase(std::unique(seen.begin(), seen.end()), seen.end());
+            for (int32_t slot : seen) {
+                totalSamples[slot] += entry.second;
+            }
+            if (view.builtin >= 0) {
+                builtinSamples[view.builtin] += entry.second;
+            }
+        }
+
+        char row[160];
+        std::string out;
+        snprintf(row, sizeof(row), "Perfil: %llu amostras em %.1f ms (uma a cada %d ms)\n", static_cast<unsigned long long>(samples), elapsed, static_cast<int>(interval.count()));
+        out += row;
+
+        // Lines that ran or were sampled, hottest first
+        std::vector<uint32_t> lines;
+        for (uint32_t line = 1; line < std::max<size_t>(lineRuns.size(), lineSamples.empty() ? 0 : lineSamples.rbegin()->first + 1); ++line) {
+            if ((line < lineRuns.size() && lineRuns[line] > 0) || lineSamples.count(line)) {
+                lines.push_back(line);
+            }
+        }
+        std::stable_sort(lines.begin(), lines.end(), [&](uint32_t a, uint32_t b) {
+            uint64_t sa = lookup(lineSamples, a);
+            uint64_t sb = lookup(lineSamples, b);
+            return (sa != sb) ? sa > sb : runsOf(a) > runsOf(b);
+        });
+        out += "\nLinhas mais quentes\n";
+        snprintf(row, sizeof(row), "  %6s %14s %12s %7s\n", "linha", "execues", "tempo (ms)", "%");
+        out += row;
+        for (size_t i = 0; i < lines.size() && i < hotLines; ++i) {
+            uint64_t sampled = lookup(lineSamples, lines[i]);
+            snprintf(row, sizeof(row), "  %6u %14llu %12.2f %6.1f%%\n", lines[i], static_cast<unsigned long long>(runsOf(lines[i])), timeOf(sampled), percentOf(sampled));
+            out += row;
+        }
+
+        std::vector<int32_t> functions;
+        for (size_t slot = 0; slot < functionCalls.size(); ++slot) {
+            if (functionCalls[slot] > 0) {
+                functions.push_back(static_cast<int32_t>(slot));
+            }
+        }
+        if (!functions.empty()) {
+            std::stable_sort(functions.begin(), functions.end(), [&](int32_t a, int32_t b) {
+                return lookup(selfSamples, a) > lookup(selfSamples, b);
+            });
+            out += "\nFunes\n";
+            snprintf(row, sizeof(row), "  %-20s %12s %14s %12s\n", "funo", "chamadas", "prpria (ms)", "total (ms)");
+            out += row;
+            for (int32_t slot : functions) {
+                snprintf(row, sizeof(row), "  %-20s %12llu %14.2f %12.2f\n", symbols.name(slot).c_str(), static_cast<unsigned long long>(functionCalls[slot]),
+                         timeOf(lookup(selfSamples, slot)), timeOf(lookup(totalSamples, slot)));
+                out += row;
+            }
+        }
+
+        std::vector<int32_t> called;
+        for (size_t id = 0; id < builtinCalls.size(); ++id) {
+            if (builtinCalls[id] > 0) {
+                called.push_back(static_cast<int32_t>(id));
+            }
+        }
+        if (!called.empty()) {
+            std::stable_sort(called.begin(), called.end(), [&](int32_t a, int32_t b) {
+                uint64_t sa = lookup(builtinSamples, a);
+                uint64_t sb = lookup(builtinSamples, b);
+                return (sa != sb) ? sa > sb : builtinCalls[a] > builtinCalls[b];
+            });
+            out += "\nBuiltins\n";
+            snprintf(row, sizeof(row), "  %-20s %12s %12s\n", "builtin", "chamadas", "tempo (ms)");
+            out += row;
+            for (int32_t id : called) {
+                snprintf(row, sizeof(row), "  %-20s %12llu %12.2f\n", builtins[id].name.c_str(), static_cast<unsigned long long>(builtinCalls[id]), timeOf(lookup(builtinSamples, id)));
+                out += row;
+            }
+        }
+        return out;
+    }
+
+    // One line per distinct stack, "main;f;g;linha 12;sqrt 37", as flame graph tools read it
+    bool writeFolded(const std::string& path, const SymbolTable& symbols) const {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        std::string line;
+        for (const auto& entry : stacks) {
+            StackView view(entry.first);
+            line = "main";
+            for (size_t i = 0; i < view.functions; ++i) {
+                line += ';';
+                line += symbols.name(entry.first[i]);
+            }
+            if (view.line > 0) {
+                line += ";linha " + std::to_string(view.line);
+            }
+            if (view.builtin >= 0) {
+                line += ';';
+                line += builtins[view.builtin].name;
+            }
+            line += ' ' + std::to_string(entry.second) + '\n';
+            file << line;
+        }
+        return static_cast<bool>(file);
+    }
+
+private:
+    static constexpr std::chrono::milliseconds interval{ 1 };
+    static constexpr size_t hotLines = 20;
+
+    struct Frame {
+        std::atomic<int32_t> function{ -1 };
+        std::atomic<uint32_t> callerLine{ 0 };
+    };
+
+    // Where the running thread is
+    Frame frames[maxDepth];
+    std::atomic<uint32_t> callDepth{ 0 };
+    std::atomic<uint32_t> position{ 0 };
+    std::atomic<int32_t> builtin{ -1 };
+
+    // Counted by the running thread
+    std::vector<uint64_t> lineRuns;
+    std::vector<uint64_t> functionCalls;
+    std::vector<uint64_t> builtinCalls;
+
+    // Tallied by the sampler. A stack is the function slots from the outside in, then
+    // -1 - line, then the builtin id when one was running.
+    std::map<std::vector<int32_t>, uint64_t> stacks;
+    uint64_t samples = 0;
+    std::thread sampler;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool running = false;
+    std::chrono::steady_clock::time_point started;
+    double elapsed = 0.0;
+
+    struct StackView {
+        size_t functions = 0;
+        uint32_t line = 0;
+        int32_t builtin = -1;
+
+        explicit StackView(const std::vector<int32_t>& stack) {
+            while (stack[functions] >= 0) {
+                ++functions;
+            }
+            line = static_cast<uint32_t>(-1 - stack[functions]);
+            if (functions + 1 < stack.size()) {
+                builtin = stack[functions + 1];
+            }
+        }
+    };
+
+    void countCall(int32_t slot, uint64_t calls = 1) {
+        if (static_cast<size_t>(slot) >= functionCalls.size()) {
+            functionCalls.resize(slot + 1, 0);
+        }
+        functionCalls[slot] += calls;
+    }
+
+    void sampleLoop() {
+        std::vector<int32_t> stack;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, interval, [this] { return !running; })) {
+            uint32_t depth = std::min<uint32_t>(callDepth.load(std::memory_order_acquire), maxDepth);
+            stack.clear();
+            for (uint32_t i = 0; i < depth; ++i) {
+                stack.push_back(std::max(frames[i].function.load(std::memory_order_relaxed), 0));
+            }
+            stack.push_back(-1 - static_cast<int32_t>(position.load(std::memory_order_relaxed)));
+            int32_t running = builtin.load(std::memory_order_relaxed);
+            if (running >= 0) {
+                stack.push_back(running);
+            }
+            ++stacks[stack];
+            ++samples;
+        }
+    }
+
+    template <typename Key>
+    static uint64_t lookup(const std::map<Key, uint64_t>& counts, Key key) {
+        auto it = counts.find(key);
+        return (it != counts.end()) ? it->second : 0;
+    }
+
+    uint64_t runsOf(uint32_t line) const {
+        return (line < lineRuns.size()) ? lineRuns[line] : 0;
+    }
+
+    double timeOf(uint64_t sampled) const {
+        return (samples > 0) ? elapsed * static_cast<double>(sampled) / static_cast<double>(samples) : 0.0;
+    }
+
+    double percentOf(uint64_t sampled) const {
+        return (samples > 0) ? 100.0 * static_cast<double>(sampled) / static_cast<double>(samples) : 0.0;
+    }
+};
+
+// --stats, and the counters embedders read through Context::metrics. Only the running
+// thread writes them, each with a plain load and store, so another thread may read
+// them at any time while the writer pays no locked instruction. Iterations of a
+// parallel foreach on pool threads are not counted.
+class Metrics {
+public:
+    std::atomic<uint64_t> statements{ 0 };
+    std::atomic<uint64_t> functionCalls{ 0 };       // tail calls included
+    std::atomic<uint64_t> builtinNanoseconds{ 0 };  // spent inside builtins
+    std::atomic<uint64_t> memoHits{ 0 };            // calls of pure functions answered from earlier results
+    std::atomic<uint64_t> memoMisses{ 0 };
+    std::atomic<uint64_t> heapAllocations{ 0 };     // made on the thread running the context
+
+    Metrics() : builtinCalls(new std::atomic<uint64_t>[builtins.size()]), builtinCount(builtins.size()) {
+        for (size_t id = 0; id < builtinCount; ++id) {
+            builtinCalls[id].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    static void bump(std::atomic<uint64_t>& counter, uint64_t amount = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    void enterBuiltin(int32_t id) {
+        bump(builtinCalls[id]);
+        builtinStarted = std::chrono::steady_clock::now();
+    }
+
+    void leaveBuiltin() {
+        auto elapsed = std::chrono::steady_clock::now() - builtinStarted;
+        bump(builtinNanoseconds, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+
+    // Calls made by compiled code, whose time is not measured
+    void addBuiltinCalls(int32_t id, uint64_t calls) {
+        bump(builtinCalls[id], calls);
+    }
+
+    uint64_t callsOf(int32_t id) const {
+        return builtinCalls[id].load(std::memory_order_relaxed);
+    }
+
+    std::string json(uint64_t bytesPrinted) const {
+        uint64_t totalBuiltinCalls = 0;
+        std::string perBuiltin;
+        for (size_t id = 0; id < builtinCount; ++id) {
+            uint64_t calls = callsOf(static_cast<int32_t>(id));
+            if (calls == 0) {
+                continue;
+            }
+            totalBuiltinCalls += calls;
+            perBuiltin += perBuiltin.empty() ? "" : ", ";
+            appendJsonString(perBuiltin, builtins[static_cast<int32_t>(id)].name);
+            perBuiltin += ": " + std::to_string(calls);
+        }
+
+        std::string out = "{\n  \"statements\": " + std::to_string(statements.load(std::memory_order_relaxed));
+        out += ",\n  \"function_calls\": " + std::to_string(functionCalls.load(std::memory_order_relaxed));
+        out += ",\n  \"builtin_calls\": " + std::to_string(totalBuiltinCalls);
+        out += ",\n  \"builtin_time_ms\": ";
+        appendGeneralNumber(out, static_cast<double>(builtinNanoseconds.load(std::memory_order_relaxed)) / 1e6);
+        out += ",\n  \"memo_hits\": " + std::to_string(memoHits.load(std::memory_order_relaxed));
+        out += ",\n  \"memo_misses\": " + std::to_string(memoMisses.load(std::memory_order_relaxed));
+        out += ",\n  \"bytes_printed\": " + std::to_string(bytesPrinted);
+        out += ",\n  \"heap_allocations\": " + std::to_string(heapAllocations.load(std::memory_order_relaxed));
+        out += ",\n  \"builtins\": {" + perBuiltin + "}\n}\n";
+        return out;
+    }
+
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> builtinCalls;
+    size_t builtinCount;
+    std::chrono::steady_clock::time_point builtinStarted;   // builtins never nest
+};
+
+// --trace=N: the lines of the last N statements run, kept in a ring for the report
+// printed when a run fails
+class ExecutionTrace {
+public:
+    explicit ExecutionTrace(size_t capacity) : ring(std::max<size_t>(capacity, 1)) {
+    }
+
+    size_t capacity() const {
+        return ring.size();
+    }
+
+    void record(uint32_t line) {
+        ring[next] = line;
+        next = (next + 1 == ring.size()) ? 0 : next + 1;
+        count = std::min(count + 1, ring.size());
+    }
+
+    // Oldest first
+    std::vector<uint32_t> lines() const {
+        std::vector<uint32_t> out;
+        out.reserve(count);
+        size_t first = (next + ring.size() - count) % ring.size();
+        for (size_t i = 0; i < count; ++i) {
+            out.push_back(ring[(first + i) % ring.size()]);
+        }
+        return out;
+    }
+
+private:
+    std::vector<uint32_t> ring;
+    size_t next = 0;
+    size_t count = 0;
+};
+
+// The lowest address the running thread's stack may reach while leaving `reserve`
+// bytes for whatever a call still does (expressions, builtins, unwinding). Where the
+// stack cannot be asked for its bounds, only a conservative share of it is used,
+// counted from where the thread first asks.
+uintptr_t nativeStackLimit() {
+    constexpr uintptr_t reserve = 256 * 1024;
+    thread_local uintptr_t limit = [] {
+        char here;
+        uintptr_t fallback = reinterpret_cast<uintptr_t>(&here) - 512 * 1024;
+#if defined(__linux__)
+        pthread_attr_t attributes;
+        void* low = nullptr;
+        size_t size = 0;
+        if (pthread_getattr_np(pthread_self(), &attributes) != 0) {
+            return fallback;
+        }
+        bool known = pthread_attr_getstack(&attributes, &low, &size) == 0 && size > 2 * reserve;
+        pthread_attr_destroy(&attributes);
+        return known ? reinterpret_cast<uintptr_t>(low) + reserve : fallback;
+#elif defined(__APPLE__)
+        uintptr_t high = reinterpret_cast<uintptr_t>(pthread_get_stackaddr_np(pthread_self()));
+        size_t size = pthread_get_stacksize_np(pthread_self());
+        return (size > 2 * reserve) ? high - size + reserve : fallback;
+#else
+        return fallback;
+#endif
+    }();
+    return limit;
+}
+
+// Results of a pure function, keyed on the bits of its arguments: numbers and booleans
+// by their double, strings by length and text. A call passing a list or a range is
+// not remembered. Holds up to `capacity` results and evicts the least recently used.
+class MemoCache {
+public:
+    explicit MemoCache(size_t capacity) : capacity(capacity) {
+    }
+
+    MemoCache(const MemoCache&) = delete;
+    MemoCache& operator=(const MemoCache&) = delete;
+
+    static bool appendKey(const Value& value, std::string& key) {
+        key += static_cast<char>(value.type);
+        switch (value.type) {
+        case ValueType::Number:
+        case ValueType::Boolean: {
+            char bits[sizeof(double)];
+            std::memcpy(bits, &value.number, sizeof(bits));
+            key.append(bits, sizeof(bits));
+            return true;
+        }
+        case ValueType::String: {
+            const std::string& text = value.text();
+            uint64_t length = text.size();
+            char bits[sizeof(length)];
+            std::memcpy(bits, &length, sizeof(bits));
+            key.append(bits, sizeof(bits));
+            key += text;
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    // The result found becomes the most recently used
+    const Value* find(std::string_view key) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second;
+    }
+
+    // A recursive call with the same arguments may have stored the result already
+    void store(std::string key, const Value& result) {
+        if (capacity == 0 || index.count(key) != 0) {
+            return;
+        }
+        if (entries.size() == capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        entries.emplace_front(std::move(key), result);
+        index.emplace(entries.front().first, entries.begin());
+    }
+
+private:
+    using Entry = std::pair<std::string, Value>;
+
+    size_t capacity;
+    std::list<Entry> entries;       // most recently used first
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index;    // views into the keys of entries
+};
+
+// Runs a resolved tree against the globals of one context. Everything it changes
+// while running is reached through the context, so interpreters on different
+// threads never touch the same data.
 class Interpreter {
 public:
-    void interpret(const std::vector<std::string>& tokens) {
-        if (tokens.empty()) {
-            return;
+    size_t maxCallDepth = 1000;     // nested calls allowed before a script is stopped
+    NumberFormat numberFormat = NumberFormat::Fixed;    // how print and text conversions write numbers
+    bool isolated = false;          // running parallel iterations: shared state is read-only
+    std::string* capture = nullptr; // output of the running parallel chunk; null writes to `output`
+    Profiler* profiler = nullptr;   // --profile; workers on pool threads have none of these
+    Metrics* metrics = nullptr;     // --stats
+    ExecutionTrace* trace = nullptr;// --trace
+    bool observed = false;          // one of the three is set; only then are the hooks below called
+    size_t memoCapacity = 4096;     // results kept per pure function; 0 keeps none
+
+    Interpreter(Globals& globals, Output& output) : globals(globals), output(output) {
+    }
+
+    // Statements [begin, end) of the program
+    void run(const std::vector<StmtPtr>& program, size_t begin, size_t end) {
+        resetFrames();
+        for (size_t i = begin; i < end; ++i) {
+            execute(*program[i]);
+        }
+    }
+
+    size_t symbolCount() const {
+        return globals.symbols->size();
+    }
+
+    const std::string& symbolName(int32_t slot) const {
+        return globals.symbols->name(slot);
+    }
+
+    void onLine(uint32_t line) {
+        if (profiler) {
+            profiler->enterLine(line);
+        }
+        if (metrics) {
+            Metrics::bump(metrics->statements);
+        }
+        if (trace) {
+            trace->record(line);
+        }
+    }
+
+    void onCall(int32_t slot) {
+        if (profiler) {
+            profiler->enterFunction(slot);
+        }
+        if (metrics) {
+            Metrics::bump(metrics->functionCalls);
+        }
+    }
+
+    void onTailCall(int32_t slot) {
+        if (profiler) {
+            profiler->replaceFunction(slot);
+        }
+        if (metrics) {
+            Metrics::bump(metrics->functionCalls);
+        }
+    }
+
+    void onReturn() {
+        if (profiler) {
+            profiler->leaveFunction();
+        }
+    }
+
+    void onMemo(bool hit) {
+        if (metrics) {
+            Metrics::bump(hit ? metrics->memoHits : metrics->memoMisses);
+        }
+    }
+
+    void onBuiltin(int32_t id) {
+        if (profiler) {
+            profiler->enterBuiltin(id);
+        }
+        if (metrics) {
+            metrics->enterBuiltin(id);
+        }
+    }
+
+    void onBuiltinDone() {
+        if (metrics) {
+            metrics->leaveBuiltin();
+        }
+        if (profiler) {
+            profiler->leaveBuiltin();
+        }
+    }
+
+    // The same, in bulk, for work compiled code has finished
+    void onLines(uint32_t line, uint64_t runs) {
+        if (profiler) {
+            profiler->addLineRuns(line, runs);
+        }
+        if (metrics) {
+            Metrics::bump(metrics->statements, runs);
+        }
+    }
+
+    void onCalls(int32_t slot, uint64_t calls) {
+        if (profiler) {
+            profiler->addCalls(slot, calls);
+        }
+        if (metrics) {
+            Metrics::bump(metrics->functionCalls, calls);
+        }
+    }
+
+    void onBuiltins(int32_t id, uint64_t calls) {
+        if (profiler) {
+            profiler->addBuiltinCalls(id, calls);
+        }
+        if (metrics) {
+            metrics->addBuiltinCalls(id, calls);
+        }
+    }
+
+    void execute(const Stmt& stmt) {
+        if (observed) {
+            onLine(stmt.line);
+        }
+        switch (stmt.kind) {
+        case StmtKind::Let:
+            interpretLet(stmt);
+            break;
+        case StmtKind::Print:
+            interpretPrint(stmt);
+            break;
+        case StmtKind::If:
+            interpretIf(stmt);
+            break;
+        case StmtKind::ForEach:
+            interpretForEach(stmt);
+            break;
+        case StmtKind::Def:
+            interpretFunction(stmt);
+            break;
+        case StmtKind::Return:
+            interpretReturn(stmt);
+            break;
+        case StmtKind::Call:
+            callFunction(stmt.slot, stmt.args, false);
+            break;
+        case StmtKind::BuiltinCommand:
+            interpretBuiltinCommand(stmt);
+            break;
+        case StmtKind::ToLower:
+            interpretCaseConversion(stmt, ::tolower);
+            break;
+        case StmtKind::ToUpper:
+            interpretCaseConversion(stmt, ::toupper);
+            break;
+        case StmtKind::Yield:
+            collectors.back().push_back(evaluate(*stmt.value));
+            break;
+        }
+    }
+
+    void executeBlock(const std::vector<StmtPtr>& block) {
+        for (const StmtPtr& stmt : block) {
+            execute(*stmt);
+            if (returning) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::string> split(const std::string& str, char delimiter) {
+        std::vector<std::string> tokens;
+        std::stringstream ss(str);
+        std::string token;
+        bool inQuotes = false;
+
+        while (std::getline(ss, token, delimiter)) {
+            if (!inQuotes) {
+                // Remove leading and trailing whitespace
+                token.erase(token.begin(), std::find_if(token.begin(), token.end(), [](int ch) {
+                    return !std::isspace(ch);
+                    }));
+                token.erase(std::find_if(token.rbegin(), token.rend(), [](int ch) {
+                    return !std::isspace(ch);
+                    }).base(), token.end());
+
+                if (!token.empty()) {
+                    tokens.push_back(token);
+                }
+            }
+            else {
+                tokens.back() += delimiter + token;
+            }
+
+            if (token.empty()) {
+                continue;
+            }
+            if (token.front() == '"' && token.back() == '"') {
+                inQuotes = false;
+            }
+            else if (token.front() == '"' && token.back() != '"') {
+                inQuotes = true;
+            }
+        }
+
+        return tokens;
+    }
+
+    void interpretIf(const Stmt& stmt) {
+        if (evaluate(*stmt.value).isTruthy()) {
+            executeBlock(stmt.body);
+        }
+        else {
+            executeBlock(stmt.elseBody);
+        }
+    }
+
+    const Value& getVariable(int32_t slot) {
+        const Variable& variable = globals.variables[slot];
+        if (!variable.defined) {
+            throw std::runtime_error("Varivel no encontrada: " + symbolName(slot));
+        }
+        return variable.value;
+    }
+
+    void setVariable(int32_t slot, Value value) {
+        Variable& variable = globals.variables[slot];
+        variable.value = std::move(value);
+        variable.defined = true;
+    }
+
+    const Value& getLocal(int32_t index, const std::string& name) {
+        const Variable& local = frameSlots[frameBase + index];
+        if (!local.defined) {
+            throw std::runtime_error("Varivel no encontrada: " + name);
+        }
+        return local.value;
+    }
+
+    void setLocal(int32_t index, Value value) {
+        Variable& local = frameSlots[frameBase + index];
+        local.value = std::move(value);
+        local.defined = true;
+    }
+
+    // Stores into a local when the resolver found one, otherwise into the global slot
+    void assign(int32_t local, int32_t slot, Value value) {
+        if (local >= 0) {
+            setLocal(local, std::move(value));
+        }
+        else {
+            setVariable(slot, std::move(value));
+        }
+    }
+
+    void interpretLet(const Stmt& stmt) {
+        assign(stmt.local, stmt.slot, evaluate(*stmt.value));
+    }
+
+    Value evaluate(const Expr& expr) {
+        switch (expr.kind) {
+        case ExprKind::Number:
+        case ExprKind::String:
+        case ExprKind::Boolean:
+            return expr.literal;
+        case ExprKind::FString: {
+            std::string text;
+            appendFString(expr, text);
+            return Value::fromString(std::move(text));
+        }
+        case ExprKind::Variable:
+            return (expr.local >= 0) ? getLocal(expr.local, expr.text) : getVariable(expr.slot);
+        case ExprKind::List: {
+            std::vector<Value> items;
+            items.reserve(expr.operands.size());
+            for (const ExprPtr& item : expr.operands) {
+                items.push_back(evaluate(*item));
+            }
+            return Value::fromList(std::move(items));
+        }
+        case ExprKind::Unary:
+            return Value::fromNumber(-evaluate(*expr.operands[0]).toNumber());
+        case ExprKind::Binary: {
+            // Left operand first, as in the bytecode; a call on the right may overwrite globals
+            Value lhs = evaluate(*expr.operands[0]);
+            return evaluateOperator(expr.op, lhs, evaluate(*expr.operands[1]));
+        }
+        case ExprKind::Call:
+            if (expr.builtin >= 0) {
+                return callBuiltin(expr.builtin, expr.operands);
+            }
+            return callFunction(expr.slot, expr.operands, true);
+        }
+        throw std::runtime_error("Expresso invlida.");
+    }
+
+    Value callBuiltin(int32_t id, const std::vector<ExprPtr>& arguments) {
+        const Builtin& builtin = builtins[id];
+        if (!builtin.accepts(arguments.size())) {
+            throw std::runtime_error("Nmero incorreto de argumentos para a funo " + builtin.name);
+        }
+        checkBuiltin(builtin);
+
+        // Arguments go on a stack kept across calls; nested calls push above them
+        size_t base = argumentStack.size();
+        try {
+            for (const ExprPtr& argument : arguments) {
+                argumentStack.push_back(evaluate(*argument));
+            }
+            if (observed) {
+                onBuiltin(id);
+            }
+            Value result = builtins.call(id, argumentStack.data() + base, arguments.size());
+            if (observed) {
+                onBuiltinDone();
+            }
+            argumentStack.resize(base);
+            return result;
+        }
+        catch (...) {
+            argumentStack.resize(base);
+            throw;
+        }
+    }
+
+    // Numeric results print in the short general format used by the math commands
+    void writeResult(const Value& result) {
+        if (capture) {
+            if (result.type == ValueType::Number) {
+                appendResultNumber(*capture, result.number, numberFormat);
+            }
+            else {
+                result.appendTo(*capture, numberFormat);
+            }
+            *capture += '\n';
+            return;
+        }
+
+        if (result.type == ValueType::Number) {
+            output.writeNumber(result.number, numberFormat);
+        }
+        else {
+            output.write(result.toString(numberFormat));
+        }
+        output.endLine();
+    }
+
+    void writeLine(const std::string& text) {
+        if (capture) {
+            *capture += text;
+            *capture += '\n';
+            return;
+        }
+        output.write(text);
+        output.endLine();
+    }
+
+    void writeLines(const std::string& text) {
+        if (capture) {
+            *capture += text;
+        }
+        else if (!text.empty()) {
+            output.writeLines(text);
+        }
+    }
+
+    void appendFString(const Expr& expr, std::string& out) {
+        out += expr.segments[0];
+        for (size_t i = 0; i < expr.operands.size(); ++i) {
+            appendValue(*expr.operands[i], out);
+            out += expr.segments[i + 1];
+        }
+    }
+
+    void appendValue(const Expr& expr, std::string& out) {
+        if (expr.kind == ExprKind::FString) {
+            appendFString(expr, out);
+        }
+        else if (expr.kind == ExprKind::String) {
+            out += expr.literal.text();
+        }
+        else {
+            evaluate(expr).appendTo(out, numberFormat);
+        }
+    }
+
+    void interpretPrint(const Stmt& stmt) {
+        // The buffer is taken while in use, so a print nested inside a hole gets its own
+        std::string text;
+        text.swap(printBuffer);
+        text.clear();
+        for (size_t i = 0; i < stmt.args.size(); ++i) {
+            appendValue(*stmt.args[i], text);
+
+            // Adicionar espao em branco entre os itens, exceto o ltimo
+            if (i < stmt.args.size() - 1) {
+                text += ' ';
+            }
+        }
+
+        writeLine(text);
+        printBuffer.swap(text);
+    }
+
+    // Lists and ranges are iterated in place; a string is still split on commas
+    Value toIterable(const Value& value) {
+        if (value.isSequence()) {
+            return value;
+        }
+
+        std::vector<Value> items;
+        for (const std::string& element : split(value.toString(numberFormat), ',')) {
+            double number = 0.0;
+            items.push_back(parseNumber(element, number) ? Value::fromNumber(number) : Value::fromString(element));
+        }
+        return Value::fromList(std::move(items));
+    }
+
+    void interpretForEach(const Stmt& stmt) {
+        if (stmt.parallel) {
+            interpretParallelForEach(stmt);
+            return;
+        }
+
+        Value iterable = toIterable(evaluate(*stmt.value));
+        bool collecting = !stmt.collect.empty();
+        if (collecting) {
+            collectors.emplace_back();
+        }
+
+        size_t count = iterable.length();
+        for (size_t i = 0; i < count; ++i) {
+            assign(stmt.local, stmt.slot, elementAt(iterable, i));
+            executeBlock(stmt.body);
+            if (returning) {
+                break;
+            }
+        }
+
+        if (collecting) {
+            Value collected = Value::fromList(std::move(collectors.back()));
+            collectors.pop_back();
+            if (!returning) {
+                assign(stmt.collectLocal, stmt.collectSlot, std::move(collected));
+            }
+        }
+    }
+
+    // Iterations run on the pool, each in a fresh frame of its own; output and yielded
+    // values are replayed in iteration order once every chunk has finished
+    void interpretParallelForEach(const Stmt& stmt) {
+        Value iterable = toIterable(evaluate(*stmt.value));
+        std::vector<Variable> captured = captureLocals(stmt.captures);
+        if (!WorkStealingPool::onWorkerThread()) {
+            while (workers.size() < parallelPool().size()) {
+                workers.push_back(spawnWorker());
+            }
+        }
+
+        std::vector<LoopChunk> chunks = runChunks(iterable.length(), [&](LoopChunk& chunk, size_t worker) {
+            if (worker == inlineWorker) {
+                runIterations(stmt, iterable, captured, chunk);
+                return;
+            }
+            Interpreter& runner = *workers[worker];
+            runner.maxCallDepth = maxCallDepth;
+            runner.numberFormat = numberFormat;
+            runner.memoCapacity = memoCapacity;
+            runner.resetFrames();
+            runner.runIterations(stmt, iterable, captured, chunk);
+        });
+
+        Value collected = mergeChunks(chunks);
+        if (!stmt.collect.empty()) {
+            assign(stmt.collectLocal, stmt.collectSlot, std::move(collected));
+        }
+    }
+
+    void runIterations(const Stmt& loop, const Value& iterable, const std::vector<Variable>& captured, LoopChunk& chunk) {
+        std::string* enclosingCapture = capture;
+        bool enclosingIsolated = isolated;
+        capture = &chunk.output;
+        isolated = true;
+        collectors.emplace_back();
+        size_t collectorDepth = collectors.size();
+
+        try {
+            for (size_t i = chunk.begin; i < chunk.end; ++i) {
+                size_t callerBase = activateFrame(startIteration(loop.locals.size(), loop.captures, captured, elementAt(iterable, i)));
+                executeBlock(loop.body);
+                releaseFrame(callerBase);
+            }
+            chunk.yields = std::move(collectors.back());
+        }
+        catch (...) {
+            chunk.error = std::current_exception();
+        }
+
+        collectors.resize(collectorDepth - 1);
+        capture = enclosingCapture;
+        isolated = enclosingIsolated;
+    }
+
+    // A fresh interpreter over the same context, for a pool thread
+    std::unique_ptr<Interpreter> spawnWorker() {
+        return std::make_unique<Interpreter>(globals, output);
+    }
+
+    std::vector<Variable> captureLocals(const std::vector<std::pair<int32_t, int32_t>>& captures) const {
+        std::vector<Variable> captured;
+        captured.reserve(captures.size());
+        for (const auto& capture : captures) {
+            captured.push_back(frameSlots[frameBase + capture.first]);
+        }
+        return captured;
+    }
+
+    // Reserves the frame of one parallel iteration: the element, then the captured locals
+    size_t startIteration(size_t localCount, const std::vector<std::pair<int32_t, int32_t>>& captures, const std::vector<Variable>& captured, Value element) {
+        size_t base = reserveFrame(localCount);
+        frameSlots[base].value = std::move(element);
+        frameSlots[base].defined = true;
+        for (size_t i = 0; i < captures.size(); ++i) {
+            frameSlots[base + captures[i].second] = captured[i];
+        }
+        return base;
+    }
+
+    // Output of every chunk up to the first that failed, whose error is then rethrown
+    Value mergeChunks(std::vector<LoopChunk>& chunks) {
+        size_t total = 0;
+        for (const LoopChunk& chunk : chunks) {
+            total += chunk.yields.size();
+        }
+
+        std::vector<Value> items;
+        items.reserve(total);
+        for (LoopChunk& chunk : chunks) {
+            writeLines(chunk.output);
+            if (chunk.error) {
+                std::rethrow_exception(chunk.error);
+            }
+            items.insert(items.end(), std::make_move_iterator(chunk.yields.begin()), std::make_move_iterator(chunk.yields.end()));
+        }
+        return Value::fromList(std::move(items));
+    }
+
+    void interpretFunction(const Stmt& stmt) {
+        checkDefine();
+        globals.functions[stmt.slot] = &stmt;
+    }
+
+    // Functions and impure builtins write state every thread shares
+    void checkDefine() const {
+        if (isolated) {
+            throw std::runtime_error("Comando 'def' no permitido dentro de um foreach paralelo.");
+        }
+    }
+
+    void checkBuiltin(const Builtin& builtin) const {
+        if (isolated && !builtin.pure) {
+            throw std::runtime_error("Funo com efeitos colaterais no permitida dentro de um foreach paralelo: " + builtin.name);
+        }
+    }
+
+    // "return f(...)" is a tail call: the callee takes over the current frame and runs
+    // from the loop in callFunction instead of nesting another one.
+    void interpretReturn(const Stmt& stmt) {
+        if (stmt.value && isTailCall(*stmt.value)) {
+            const Stmt& function = lookupFunction(stmt.value->slot, stmt.value->operands.size(), true);
+            size_t staging = stageArguments(function, stmt.value->operands);
+            replaceFrame(staging, function.locals.size());
+            tailCallee = &function;
+        }
+        else if (stmt.value) {
+            setLocal(stmt.local, evaluate(*stmt.value));
+        }
+        returning = true;
+    }
+
+    static bool isTailCall(const Expr& expr) {
+        return expr.kind == ExprKind::Call && expr.builtin < 0;
+    }
+
+    const Stmt& lookupFunction(int32_t slot, size_t argumentCount, bool wantsResult) {
+        if (!globals.functions[slot]) {
+            throw std::runtime_error((wantsResult ? "Funo no encontrada: " : "Comando desconhecido: ") + symbolName(slot));
+        }
+
+        const Stmt& function = *globals.functions[slot];
+        if (argumentCount != function.params.size()) {
+            throw std::runtime_error("Nmero incorreto de argumentos para a funo " + symbolName(slot));
+        }
+        return function;
+    }
+
+    // Arguments are evaluated in the caller's frame and copied straight into the
+    // callee's slots, which sit on top of the frame arena.
+    size_t stageArguments(const Stmt& function, const std::vector<ExprPtr>& arguments) {
+        size_t base = reserveFrame(function.locals.size());
+        for (size_t i = 0; i < arguments.size(); ++i) {
+            Value value = evaluate(*arguments[i]);
+            Variable& parameter = frameSlots[base + i];
+            parameter.value = function.booleanParams[i] ? Value::fromBoolean(value.isTruthy()) : std::move(value);
+            parameter.defined = true;
+        }
+        return base;
+    }
+
+    Value callFunction(int32_t slot, const std::vector<ExprPtr>& arguments, bool wantsResult) {
+        const Stmt* function = &lookupFunction(slot, arguments.size(), wantsResult);
+        checkCallDepth(callDepth);
+        checkNativeStack(callDepth);
+        size_t base = stageArguments(*function, arguments);
+
+        size_t callerBase = activateFrame(base);
+        MemoCache* memo = nullptr;
+        std::string key;
+        if (function->pure && wantsResult && memoKey(function->params.size(), key)) {
+            memo = &memos.try_emplace(function, memoCapacity).first->second;
+            const Value* cached = memo->find(key);
+            if (observed) {
+                onMemo(cached != nullptr);
+            }
+            if (cached) {
+                Value result = *cached;
+                releaseFrame(callerBase);
+                return result;
+            }
+        }
+        ++callDepth;
+        if (observed) {
+            onCall(slot);
+        }
+        while (true) {
+            executeBlock(function->body);
+            returning = false;
+            if (!tailCallee) {
+                break;
+            }
+            function = tailCallee;
+            tailCallee = nullptr;
+            if (observed) {
+                onTailCall(function->slot);
+            }
+        }
+        --callDepth;
+        if (observed) {
+            onReturn();
+        }
+
+        Value result;
+        if (wantsResult) {
+            result = getReturnValue(static_cast<int32_t>(function->params.size()), function->name);
+        }
+        releaseFrame(callerBase);
+        if (memo) {
+            memo->store(std::move(key), result);
+        }
+        return result;
+    }
+
+    // Key of the first `count` slots of the active frame, the arguments of a pure
+    // function; false when one of them cannot be part of a key
+    bool memoKey(size_t count, std::string& key) const {
+        if (memoCapacity == 0) {
+            return false;
+        }
+        key.clear();
+        for (size_t i = 0; i < count; ++i) {
+            if (!MemoCache::appendKey(frameSlots[frameBase + i].value, key)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Results remembered for the functions of a script that is no longer run
+    void forgetResults() {
+        memos.clear();
+        for (const std::unique_ptr<Interpreter>& worker : workers) {
+            worker->forgetResults();
+        }
+    }
+
+    void checkCallDepth(size_t depth) const {
+        if (depth >= maxCallDepth) {
+            throw std::runtime_error("Limite de recurso excedido: mais de " + std::to_string(maxCallDepth) + " chamadas aninhadas.");
+        }
+    }
+
+    // The tree walker, and code compiled by --emit-cpp, nest a native call for every
+    // script call, so a high --max-depth can run out of stack before it is reached
+    static void checkNativeStack(size_t depth) {
+        char here;
+        if (reinterpret_cast<uintptr_t>(&here) < nativeStackLimit()) {
+            throw std::runtime_error("Limite de recurso excedido: a pilha do sistema acabou com " + std::to_string(depth) + " chamadas aninhadas.");
+        }
+    }
+
+    const Value& getReturnValue(int32_t resultLocal, const std::string& name) {
+        const Variable& result = frameSlots[frameBase + resultLocal];
+        if (!result.defined) {
+            throw std::runtime_error("Funo no retornou um valor: " + name);
+        }
+        return result.value;
+    }
+
+    // Frame arena: the locals of every active call, contiguous and reused from call to
+    // call. It only grows when recursion goes deeper than it has gone before.
+    size_t reserveFrame(size_t count) {
+        size_t base = frameTop;
+        frameTop += count;
+        if (frameTop > frameSlots.size()) {
+            frameSlots.resize(std::max(frameTop, frameSlots.size() * 2));
+        }
+        return base;
+    }
+
+    size_t activateFrame(size_t base) {
+        size_t callerBase = frameBase;
+        frameBase = base;
+        return callerBase;
+    }
+
+    // Drops the active frame, releasing whatever its slots still hold
+    void releaseFrame(size_t callerBase) {
+        for (size_t i = frameBase; i < frameTop; ++i) {
+            frameSlots[i] = Variable();
+        }
+        frameTop = frameBase;
+        frameBase = callerBase;
+    }
+
+    // The callee's frame, already filled at `staging` above the active one, takes the
+    // active frame's place. Slots are moved down in order, so the ranges may overlap.
+    void replaceFrame(size_t staging, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            frameSlots[frameBase + i] = std::move(frameSlots[staging + i]);
+        }
+        for (size_t i = frameBase + count; i < frameTop; ++i) {
+            frameSlots[i] = Variable();
+        }
+        frameTop = frameBase + count;
+    }
+
+    void assignParameters(size_t base, const std::vector<bool>& booleanParams, const Value* values) {
+        for (size_t i = 0; i < booleanParams.size(); ++i) {
+            Variable& parameter = frameSlots[base + i];
+            parameter.value = booleanParams[i] ? Value::fromBoolean(values[i].isTruthy()) : values[i];
+            parameter.defined = true;
+        }
+    }
+
+    // A run that ended in an error may have left calls on the arena
+    void resetFrames() {
+        frameBase = 0;
+        releaseFrame(0);
+        returning = false;
+        tailCallee = nullptr;
+        callDepth = 0;
+        collectors.clear();
+    }
+
+    void interpretBuiltinCommand(const Stmt& stmt) {
+        writeResult(callBuiltin(stmt.builtin, stmt.args));
+    }
+
+    void interpretCaseConversion(const Stmt& stmt, int (*convert)(int)) {
+        const Value& source = (stmt.sourceLocal >= 0) ? getLocal(stmt.sourceLocal, stmt.source) : getVariable(stmt.sourceSlot);
+        std::string str = source.toString(numberFormat);
+        std::transform(str.begin(), str.end(), str.begin(), convert);
+        assign(stmt.local, stmt.slot, Value::fromString(std::move(str)));
+    }
+
+    Value evaluateOperator(Operator op, const Value& lhs, const Value& rhs) {
+        switch (op) {
+        case Operator::Equal:
+        case Operator::NotEqual:
+        case Operator::Less:
+        case Operator::LessEqual:
+        case Operator::Greater:
+        case Operator::GreaterEqual:
+            return Value::fromBoolean(compare(op, lhs, rhs));
+        default:
+            if (lhs.isSequence() || rhs.isSequence()) {
+                return elementwise(op, lhs, rhs);
+            }
+            return Value::fromNumber(evaluateOperator(op, lhs.toNumber(), rhs.toNumber()));
+        }
+    }
+
+    bool compare(Operator op, const Value& lhs, const Value& rhs) {
+        if (lhs.type == ValueType::String && rhs.type == ValueType::String) {
+            int order = lhs.text().compare(rhs.text());
+            return compare(op, static_cast<double>(order), 0.0);
+        }
+        return compare(op, lhs.toNumber(), rhs.toNumber());
+    }
+
+    bool compare(Operator op, double lhsValue, double rhsValue) {
+        switch (op) {
+        case Operator::Equal:
+            return lhsValue == rhsValue;
+        case Operator::NotEqual:
+            return lhsValue != rhsValue;
+        case Operator::Greater:
+            return lhsValue > rhsValue;
+        case Operator::GreaterEqual:
+            return lhsValue >= rhsValue;
+        case Operator::Less:
+            return lhsValue < rhsValue;
+        case Operator::LessEqual:
+            return lhsValue <= rhsValue;
+        default:
+            throw std::runtime_error("Operador desconhecido.");
+        }
+    }
+
+    double evaluateOperator(Operator op, double lhs, double rhs) {
+        switch (op) {
+        case Operator::Add:
+            return lhs + rhs;
+        case Operator::Subtract:
+            return lhs - rhs;
+        case Operator::Multiply:
+            return lhs * rhs;
+        case Operator::Divide:
+            if (rhs == 0) {
+                throw std::runtime_error("Diviso por zero.");
+            }
+            return lhs / rhs;
+        case Operator::Power:
+            return std::pow(lhs, rhs);
+        default:
+            throw std::runtime_error("Operador desconhecido.");
+        }
+    }
+
+private:
+    Globals& globals;
+    Output& output;
+    std::string printBuffer;
+    std::vector<Variable> frameSlots;
+    size_t frameBase = 0;
+    size_t frameTop = 0;
+    bool returning = false;     // set by return until the call that owns the frame sees it
+    const Stmt* tailCallee = nullptr;   // function a tail call left in the active frame
+    size_t callDepth = 0;
+    std::vector<std::vector<Value>> collectors;             // values yielded to each active foreach ... into
+    std::vector<Value> argumentStack;                       // arguments of the builtin calls under way
+    std::vector<std::unique_ptr<Interpreter>> workers;      // one per pool thread, for parallel loops
+    std::unordered_map<const Stmt*, MemoCache> memos;       // results of the pure functions called so far
+};
+
+// Folds constant subtrees, propagates top-level lets that are assigned only once and
+// replaces ifs whose condition is known by the branch that runs. Works on the
+// resolved tree, so the tree walker and the compiler both see the result.
+class Optimizer {
+public:
+    size_t folded = 0;          // expressions replaced by their value
+    size_t propagated = 0;      // variable reads replaced by a let constant
+    size_t deadBranches = 0;    // ifs replaced by one of their branches
+
+    explicit Optimizer(Interpreter& runtime) : runtime(runtime) {
+    }
+
+    // Propagation needs every write to be visible, so it is only safe on a whole script
+    void optimize(std::vector<StmtPtr>& program, size_t symbolCount, bool propagateLets) {
+        propagate = propagateLets;
+        constants.clear();
+        writes.assign(symbolCount, 0);
+        if (propagate) {
+            countWrites(program);
+        }
+        optimizeBlock(program, true);
+    }
+
+private:
+    Interpreter& runtime;
+    bool propagate = false;
+    std::vector<uint32_t> writes;                // assignments per slot anywhere in the program
+    std::unordered_map<int32_t, Value> constants;
+
+    static bool isConstant(const Expr& expr) {
+        return expr.kind == ExprKind::Number || expr.kind == ExprKind::String || expr.kind == ExprKind::Boolean;
+    }
+
+    void countWrites(const std::vector<StmtPtr>& block) {
+        for (const StmtPtr& stmt : block) {
+            switch (stmt->kind) {
+            case StmtKind::Let:
+            case StmtKind::ForEach:
+            case StmtKind::Def:
+            case StmtKind::ToLower:
+            case StmtKind::ToUpper:
+                if (stmt->slot >= 0) {
+                    ++writes[stmt->slot];
+                }
+                break;
+            default:
+                break;
+            }
+            if (stmt->collectSlot >= 0) {
+                ++writes[stmt->collectSlot];
+            }
+            countWrites(stmt->body);
+            countWrites(stmt->elseBody);
+        }
+    }
+
+    // A let only becomes a known constant once it has been passed at top level; reads
+    // before it, including bodies of functions defined earlier, keep the variable.
+    void optimizeBlock(std::vector<StmtPtr>& block, bool topLevel) {
+        size_t i = 0;
+        while (i < block.size()) {
+            Stmt& stmt = *block[i];
+            if (stmt.value) {
+                optimizeExpression(stmt.value);
+            }
+
+            if (stmt.kind == StmtKind::If && isConstant(*stmt.value)) {
+                std::vector<StmtPtr> branch = std::move(stmt.value->literal.isTruthy() ? stmt.body : stmt.elseBody);
+                block.erase(block.begin() + i);
+                block.insert(block.begin() + i, std::make_move_iterator(branch.begin()), std::make_move_iterator(branch.end()));
+                ++deadBranches;
+                continue;
+            }
+
+            for (ExprPtr& argument : stmt.args) {
+                optimizeExpression(argument);
+            }
+            optimizeBlock(stmt.body, false);
+            optimizeBlock(stmt.elseBody, false);
+
+            if (topLevel && propagate && stmt.kind == StmtKind::Let && stmt.slot >= 0 && writes[stmt.slot] == 1 && isConstant(*stmt.value)) {
+                constants[stmt.slot] = stmt.value->literal;
+            }
+            ++i;
+        }
+    }
+
+    void optimizeExpression(ExprPtr& expr) {
+        for (ExprPtr& operand : expr->operands) {
+            optimizeExpression(operand);
+        }
+
+        switch (expr->kind) {
+        case ExprKind::Variable: {
+            if (expr->local >= 0) {
+                return;
+            }
+            auto it = constants.find(expr->slot);
+            if (it != constants.end()) {
+                replaceWithLiteral(*expr, it->second);
+                ++propagated;
+            }
+            return;
+        }
+        case ExprKind::Call:
+            if (expr->builtin < 0 || !builtins[expr->builtin].pure || !builtins[expr->builtin].accepts(expr->operands.size())) {
+                return;
+            }
+            break;
+        case ExprKind::FString:
+        case ExprKind::Unary:
+        case ExprKind::Binary:
+            break;
+        default:
+            return;
+        }
+
+        for (const ExprPtr& operand : expr->operands) {
+            if (!isConstant(*operand)) {
+                return;
+            }
+        }
+
+        // Operands are literals and builtins are pure, so evaluating now cannot have side
+        // effects. Errors such as a division by zero are left to happen at run time.
+        try {
+            Value value = runtime.evaluate(*expr);
+            if (value.type == ValueType::Number || value.type == ValueType::Boolean || value.type == ValueType::String) {
+                replaceWithLiteral(*expr, value);
+                ++folded;
+            }
+        }
+        catch (const std::runtime_error&) {
+        }
+    }
+
+    static void replaceWithLiteral(Expr& expr, const Value& value) {
+        switch (value.type) {
+        case ValueType::Number:
+            expr.kind = ExprKind::Number;
+            break;
+        case ValueType::Boolean:
+            expr.kind = ExprKind::Boolean;
+            break;
+        default:
+            expr.kind = ExprKind::String;
+            break;
+        }
+        expr.literal = value;
+        expr.slot = -1;
+        expr.local = -1;
+        expr.builtin = -1;
+        expr.operands.clear();
+        expr.segments.clear();
+    }
+};
+
+// Writes a tree back as script text, for --dump-optimized
+class AstPrinter {
+public:
+    std::string print(const std::vector<StmtPtr>& program) {
+        std::string out;
+        printBlock(program, 0, out);
+        return out;
+    }
+
+private:
+    void printBlock(const std::vector<StmtPtr>& block, size_t depth, std::string& out) {
+        for (const StmtPtr& stmt : block) {
+            printStatement(*stmt, depth, out);
+        }
+    }
+
+    void printStatement(const Stmt& stmt, size_t depth, std::string& out) {
+        std::string indent(depth * 4, ' ');
+        out += indent;
+        switch (stmt.kind) {
+        case StmtKind::Let:
+            out += "let " + stmt.name + " = ";
+            printExpression(*stmt.value, out);
+            break;
+        case StmtKind::Print:
+            out += "print";
+            for (const ExprPtr& argument : stmt.args) {
+                out += ' ';
+                printExpression(*argument, out);
+            }
+            break;
+        case StmtKind::If:
+            out += "if ";
+            printExpression(*stmt.value, out);
+            out += " then\n";
+            printBlock(stmt.body, depth + 1, out);
+            if (!stmt.elseBody.empty()) {
+                out += indent + "else\n";
+                printBlock(stmt.elseBody, depth + 1, out);
+            }
+            out += indent + "endif";
+            break;
+        case StmtKind::ForEach:
+            out += (stmt.parallel ? "parallel foreach " : "foreach ") + stmt.name + " in ";
+            printExpression(*stmt.value, out);
+            if (!stmt.collect.empty()) {
+                out += " into " + stmt.collect;
+            }
+            out += " do\n";
+            printBlock(stmt.body, depth + 1, out);
+            out += indent + "end";
+            break;
+        case StmtKind::Def:
+            out += (stmt.pure ? "def pure " : "def ") + stmt.name + " =>";
+            for (size_t i = 0; i < stmt.params.size(); ++i) {
+                out += (i == 0) ? " " : ", ";
+                out += stmt.params[i];
+                if (stmt.booleanParams[i]) {
+                    out += ':';
+                }
+            }
+            out += '\n';
+            printBlock(stmt.body, depth + 1, out);
+            out += indent + "end";
+            break;
+        case StmtKind::Return:
+            out += "return";
+            if (stmt.value) {
+                out += ' ';
+                printExpression(*stmt.value, out);
+            }
+            break;
+        case StmtKind::Call:
+        case StmtKind::BuiltinCommand:
+            out += stmt.name;
+            for (size_t i = 0; i < stmt.args.size(); ++i) {
+                out += (i == 0) ? " " : ", ";
+                printExpression(*stmt.args[i], out);
+            }
+            break;
+        case StmtKind::ToLower:
+        case StmtKind::ToUpper:
+            out += (stmt.kind == StmtKind::ToLower ? "tolower " : "toupper ") + stmt.name + " " + stmt.source;
+            break;
+        case StmtKind::Yield:
+            out += "yield ";
+            printExpression(*stmt.value, out);
+            break;
+        }
+        out += '\n';
+    }
+
+    void printExpression(const Expr& expr, std::string& out) {
+        switch (expr.kind) {
+        case ExprKind::Number: {
+            char digits[32];
+            auto result = std::to_chars(digits, digits + sizeof(digits), expr.literal.number);
+            out.append(digits, result.ptr);
+            break;
+        }
+        case ExprKind::String:
+            out += '"' + expr.literal.text() + '"';
+            break;
+        case ExprKind::Boolean:
+            out += expr.literal.isTruthy() ? "true" : "false";
+            break;
+        case ExprKind::FString:
+            out += "f\"" + expr.segments[0];
+            for (size_t i = 0; i < expr.operands.size(); ++i) {
+                out += '{';
+                printExpression(*expr.operands[i], out);
+                out += '}' + expr.segments[i + 1];
+            }
+            out += '"';
+            break;
+        case ExprKind::Variable:
+            out += expr.text;
+            break;
+        case ExprKind::List:
+            out += '[';
+            printList(expr.operands, out);
+            out += ']';
+            break;
+        case ExprKind::Unary:
+            out += '-';
+            printOperand(*expr.operands[0], out);
+            break;
+        case ExprKind::Binary:
+            printOperand(*expr.operands[0], out);
+            out += ' ';
+            out += operatorSymbol(expr.op);
+            out += ' ';
+            printOperand(*expr.operands[1], out);
+            break;
+        case ExprKind::Call:
+            out += expr.text + '(';
+            printList(expr.operands, out);
+            out += ')';
+            break;
+        }
+    }
+
+    // Nested operators are always parenthesized, so the dump never depends on precedence
+    void printOperand(const Expr& expr, std::string& out) {
+        bool nested = expr.kind == ExprKind::Binary || expr.kind == ExprKind::Unary;
+        if (nested) {
+            out += '(';
+        }
+        printExpression(expr, out);
+        if (nested) {
+            out += ')';
+        }
+    }
+
+    void printList(const std::vector<ExprPtr>& items, std::string& out) {
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (i > 0) {
+                out += ", ";
+            }
+            printExpression(*items[i], out);
+        }
+    }
+
+    static const char* operatorSymbol(Operator op) {
+        switch (op) {
+        case Operator::Add:
+            return "+";
+        case Operator::Subtract:
+            return "-";
+        case Operator::Multiply:
+            return "*";
+        case Operator::Divide:
+            return "/";
+        case Operator::Power:
+            return "^";
+        case Operator::Equal:
+            return "==";
+        case Operator::NotEqual:
+            return "!=";
+        case Operator::Less:
+            return "<";
+        case Operator::LessEqual:
+            return "<=";
+        case Operator::Greater:
+            return ">";
+        case Operator::GreaterEqual:
+            return ">=";
+        case Operator::Negate:
+            return "-";
+        }
+        return "?";
+    }
+};
+
+// Bytecode: fixed-width instructions over a constant pool, run by the VirtualMachine below.
+#define HY_OPCODES(X) \
+    X(PushConstant) X(LoadVariable) X(StoreVariable) X(LoadLocal) X(StoreLocal) \
+    X(FormatString) X(MakeList) \
+    X(Negate) X(Add) X(Subtract) X(Multiply) X(Divide) X(Power) \
+    X(Equal) X(NotEqual) X(Less) X(LessEqual) X(Greater) X(GreaterEqual) \
+    X(CallBuiltin) X(PrintResult) X(Print) X(ToLower) X(ToUpper) \
+    X(Jump) X(JumpIfFalse) X(IterBegin) X(IterNext) \
+    X(Loop) X(CollectBegin) X(Yield) X(CollectEnd) X(ParallelForEach) X(Line) \
+    X(Define) X(Call) X(CallStatement) X(TailCall) X(Return) X(Halt)
+
+enum class OpCode : uint8_t {
+#define HY_OPCODE_ENUM(name) name,
+    HY_OPCODES(HY_OPCODE_ENUM)
+#undef HY_OPCODE_ENUM
+};
+
+struct Instruction {
+    OpCode op;
+    uint16_t count = 0;    // argument or item count
+    int32_t operand = 0;   // constant, slot, local, template, function or jump target
+};
+
+// Literal text around the values a Print or FormatString takes from the stack
+struct TextTemplate {
+    std::vector<std::string> segments;
+};
+
+// Parameters occupy the first frame slots and the result the one right after them
+struct FunctionProto {
+    int32_t slot;
+    size_t entry;
+    std::vector<bool> booleanParams;
+    std::vector<std::string> localNames;
+    bool pure = false;
+};
+
+// The body of a parallel foreach is compiled out of line, ending in Halt, and runs
+// once per iteration in a frame laid out like a function's
+struct ParallelLoop {
+    FunctionProto body;
+    std::vector<std::pair<int32_t, int32_t>> captures;
+    bool collects;
+};
+
+struct Chunk {
+    std::vector<Instruction> code;
+    std::vector<Value> constants;
+    std::vector<TextTemplate> templates;
+    std::vector<FunctionProto> functions;
+    std::vector<ParallelLoop> loops;
+    std::map<double, int32_t> numberConstants;
+    std::map<std::string, int32_t> textConstants;
+
+    int32_t addConstant(const Value& value) {
+        // -0 compares equal to 0 but prints differently, so it is never shared
+        if (value.type == ValueType::Number && !std::signbit(value.number)) {
+            auto it = numberConstants.find(value.number);
+            if (it != numberConstants.end()) {
+                return it->second;
+            }
+            return numberConstants[value.number] = pushConstant(value);
+        }
+        if (value.type == ValueType::String) {
+            auto it = textConstants.find(value.text());
+            if (it != textConstants.end()) {
+                return it->second;
+            }
+            return textConstants[value.text()] = pushConstant(value);
+        }
+        return pushConstant(value);
+    }
+
+private:
+    int32_t pushConstant(const Value& value) {
+        constants.push_back(value);
+        return static_cast<int32_t>(constants.size() - 1);
+    }
+};
+
+class Compiler {
+public:
+    // With line markers, for --profile, --stats and --trace, every statement starts
+    // with a Line instruction, which the observers of the run see. Without them the
+    // bytecode carries no line information and pays nothing.
+    Compiler(Chunk& chunk, bool lineMarkers) : chunk(chunk), lineMarkers(lineMarkers) {
+    }
+
+    // Appends the program to the chunk and returns the index of its first instruction
+    size_t compile(const std::vector<StmtPtr>& program) {
+        size_t entry = chunk.code.size();
+        compileBlock(program);
+        emit(OpCode::Halt);
+        return entry;
+    }
+
+private:
+    Chunk& chunk;
+    bool lineMarkers;
+
+    void emitLoad(int32_t local, int32_t slot) {
+        if (local >= 0) {
+            emit(OpCode::LoadLocal, local);
+        }
+        else {
+            emit(OpCode::LoadVariable, slot);
+        }
+    }
+
+    void emitStore(int32_t local, int32_t slot) {
+        if (local >= 0) {
+            emit(OpCode::StoreLocal, local);
+        }
+        else {
+            emit(OpCode::StoreVariable, slot);
+        }
+    }
+
+    size_t emit(OpCode op, int32_t operand = 0, uint16_t count = 0) {
+        Instruction instruction;
+        instruction.op = op;
+        instruction.count = count;
+        instruction.operand = operand;
+        chunk.code.push_back(instruction);
+        return chunk.code.size() - 1;
+    }
+
+    void patchJump(size_t at) {
+        chunk.code[at].operand = static_cast<int32_t>(chunk.code.size());
+    }
+
+    void compileBlock(const std::vector<StmtPtr>& block) {
+        for (const StmtPtr& stmt : block) {
+            compileStatement(*stmt);
+        }
+    }
+
+    void compileStatement(const Stmt& stmt) {
+        if (lineMarkers) {
+            emit(OpCode::Line, static_cast<int32_t>(stmt.line));
+        }
+        switch (stmt.kind) {
+        case StmtKind::Let:
+            compileExpression(*stmt.value);
+            emitStore(stmt.local, stmt.slot);
+            break;
+        case StmtKind::Print: {
+            // The whole line becomes one template: literals are inlined and only holes hit the stack
+            TextTemplate line;
+            line.segments.emplace_back();
+            for (size_t i = 0; i < stmt.args.size(); ++i) {
+                if (i != 0) {
+                    line.segments.back() += ' ';
+                }
+                compileTemplateItem(*stmt.args[i], line);
+            }
+            chunk.templates.push_back(std::move(line));
+            emit(OpCode::Print, static_cast<int32_t>(chunk.templates.size() - 1));
+            break;
+        }
+        case StmtKind::If: {
+            compileExpression(*stmt.value);
+            size_t elseJump = emit(OpCode::JumpIfFalse);
+            compileBlock(stmt.body);
+            size_t endJump = emit(OpCode::Jump);
+            patchJump(elseJump);
+            compileBlock(stmt.elseBody);
+            patchJump(endJump);
+            break;
+        }
+        case StmtKind::ForEach: {
+            compileExpression(*stmt.value);
+            if (stmt.parallel) {
+                compileParallelForEach(stmt);
+                break;
+            }
+
+            bool collecting = !stmt.collect.empty();
+            if (collecting) {
+                emit(OpCode::CollectBegin);
+            }
+            emit(OpCode::IterBegin);
+            size_t loop = chunk.code.size();
+            size_t exitJump = emit(OpCode::IterNext);
+            emitStore(stmt.local, stmt.slot);
+            compileBlock(stmt.body);
+            emit(OpCode::Loop, static_cast<int32_t>(loop));
+            patchJump(exitJump);
+            if (collecting) {
+                emit(OpCode::CollectEnd);
+                emitStore(stmt.collectLocal, stmt.collectSlot);
+            }
+            break;
+        }
+        case StmtKind::Yield:
+            compileExpression(*stmt.value);
+            emit(OpCode::Yield);
+            break;
+        case StmtKind::Def: {
+            size_t skipJump = emit(OpCode::Jump);
+            FunctionProto function{ stmt.slot, chunk.code.size(), stmt.booleanParams, stmt.locals, stmt.pure };
+            compileBlock(stmt.body);
+            emit(OpCode::Return);
+            patchJump(skipJump);
+
+            chunk.functions.push_back(function);
+            emit(OpCode::Define, static_cast<int32_t>(chunk.functions.size() - 1));
+            break;
+        }
+        case StmtKind::Return:
+            if (stmt.value && Interpreter::isTailCall(*stmt.value)) {
+                for (const ExprPtr& argument : stmt.value->operands) {
+                    compileExpression(*argument);
+                }
+                emit(OpCode::TailCall, stmt.value->slot, static_cast<uint16_t>(stmt.value->operands.size()));
+                break;
+            }
+            if (stmt.value) {
+                compileExpression(*stmt.value);
+                emit(OpCode::StoreLocal, stmt.local);
+            }
+            emit(OpCode::Return);
+            break;
+        case StmtKind::Call:
+            for (const ExprPtr& argument : stmt.args) {
+                compileExpression(*argument);
+            }
+            emit(OpCode::CallStatement, stmt.slot, static_cast<uint16_t>(stmt.args.size()));
+            break;
+        case StmtKind::BuiltinCommand:
+            compileBuiltinCall(stmt.builtin, stmt.args);
+            emit(OpCode::PrintResult);
+            break;
+        case StmtKind::ToLower:
+        case StmtKind::ToUpper:
+            emitLoad(stmt.sourceLocal, stmt.sourceSlot);
+            emit(stmt.kind == StmtKind::ToLower ? OpCode::ToLower : OpCode::ToUpper);
+            emitStore(stmt.local, stmt.slot);
+            break;
+        }
+    }
+
+    void compileParallelForEach(const Stmt& stmt) {
+        size_t skipJump = emit(OpCode::Jump);
+        ParallelLoop loop{ FunctionProto{ -1, chunk.code.size(), {}, stmt.locals }, stmt.captures, !stmt.collect.empty() };
+        compileBlock(stmt.body);
+        emit(OpCode::Halt);
+        patchJump(skipJump);
+
+        chunk.loops.push_back(std::move(loop));
+        emit(OpCode::ParallelForEach, static_cast<int32_t>(chunk.loops.size() - 1));
+        if (chunk.loops.back().collects) {
+            emitStore(stmt.collectLocal, stmt.collectSlot);
+        }
+    }
+
+    // Mirrors Interpreter::evaluate, leaving the result on the value stack
+    void compileExpression(const Expr& expr) {
+        switch (expr.kind) {
+        case ExprKind::Number:
+        case ExprKind::String:
+        case ExprKind::Boolean:
+            emit(OpCode::PushConstant, chunk.addConstant(expr.literal));
+            break;
+        case ExprKind::FString: {
+            TextTemplate text;
+            text.segments.emplace_back();
+            compileTemplateItem(expr, text);
+            chunk.templates.push_back(std::move(text));
+            emit(OpCode::FormatString, static_cast<int32_t>(chunk.templates.size() - 1));
+            break;
+        }
+        case ExprKind::Variable:
+            emitLoad(expr.local, expr.slot);
+            break;
+        case ExprKind::List:
+            for (const ExprPtr& item : expr.operands) {
+                compileExpression(*item);
+            }
+            emit(OpCode::MakeList, static_cast<int32_t>(expr.operands.size()));
+            break;
+        case ExprKind::Unary:
+            compileExpression(*expr.operands[0]);
+            emit(OpCode::Negate);
+            break;
+        case ExprKind::Binary:
+            compileExpression(*expr.operands[0]);
+            compileExpression(*expr.operands[1]);
+            emit(binaryOpCode(expr.op));
+            break;
+        case ExprKind::Call:
+            if (expr.builtin >= 0) {
+                compileBuiltinCall(expr.builtin, expr.operands);
+            }
+            else {
+                for (const ExprPtr& argument : expr.operands) {
+                    compileExpression(*argument);
+                }
+                emit(OpCode::Call, expr.slot, static_cast<uint16_t>(expr.operands.size()));
+            }
+            break;
+        }
+    }
+
+    void compileBuiltinCall(int32_t id, const std::vector<ExprPtr>& arguments) {
+        if (!builtins[id].accepts(arguments.size())) {
+            throw std::runtime_error("Nmero incorreto de argumentos para a funo " + builtins[id].name);
+        }
+        for (const ExprPtr& argument : arguments) {
+            compileExpression(*argument);
+        }
+        emit(OpCode::CallBuiltin, id, static_cast<uint16_t>(arguments.size()));
+    }
+
+    void compileTemplateItem(const Expr& expr, TextTemplate& target) {
+        if (expr.kind == ExprKind::String) {
+            target.segments.back() += expr.literal.text();
+        }
+        else if (expr.kind == ExprKind::FString) {
+            target.segments.back() += expr.segments[0];
+            for (size_t i = 0; i < expr.operands.size(); ++i) {
+                compileTemplateItem(*expr.operands[i], target);
+                target.segments.back() += expr.segments[i + 1];
+            }
+        }
+        else {
+            compileExpression(expr);
+            target.segments.emplace_back();
+        }
+    }
+
+    OpCode binaryOpCode(Operator op) {
+        switch (op) {
+        case Operator::Add:
+            return OpCode::Add;
+        case Operator::Subtract:
+            return OpCode::Subtract;
+        case Operator::Multiply:
+            return OpCode::Multiply;
+        case Operator::Divide:
+            return OpCode::Divide;
+        case Operator::Power:
+            return OpCode::Power;
+        case Operator::Equal:
+            return OpCode::Equal;
+        case Operator::NotEqual:
+            return OpCode::NotEqual;
+        case Operator::Less:
+            return OpCode::Less;
+        case Operator::LessEqual:
+            return OpCode::LessEqual;
+        case Operator::Greater:
+            return OpCode::Greater;
+        case Operator::GreaterEqual:
+            return OpCode::GreaterEqual;
+        default:
+            throw std::runtime_error("Operador desconhecido.");
+        }
+    }
+};
+
+// Baseline JIT for x86-64 (System V). A function whose body only does arithmetic and
+// comparisons on numbers, calls math builtins and other such functions and loops
+// over ranges is translated, instruction by instruction, into machine code that keeps
+// the value stack in xmm registers and the locals in its native frame. The machine
+// compiles a function once its calls and loop iterations pass a threshold, and only
+// enters the code when every argument is a number. Anything the code does not handle
+// inline, such as a division by zero, a local read before it is set, a callee that
+// does not qualify or deep recursion, makes it give up: the function has no side
+// effects, so the machine just runs the same call again interpreted, which reports
+// the error if there is one.
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(HY_NO_JIT)
+#define HY_JIT 1
+#endif
+
+#ifdef HY_JIT
+// What compiled code needs from the machine running it
+struct JitCall {
+    void* machine;      // the VirtualMachine
+    size_t depth;       // calls active, compiled ones included
+    size_t limit;       // depth at which compiled code gives up
+};
+
+// Both return 0 on success and 1 when the call has to run interpreted
+using JitEntry = int (*)(JitCall* call, const double* arguments, double* result);
+using JitCallHelper = int (*)(JitCall* call, int32_t slot, uint32_t count, double* arguments);
+
+// What code compiled with line markers reports, for observed runs: a statement by
+// its line, a call to itself by its slot and a builtin by its id
+enum class JitEvent : uint32_t {
+    Line,
+    Call,
+    Builtin
+};
+
+using JitObserveHelper = void (*)(JitCall* call, uint32_t event, int32_t value);
+
+static double jitPower(double base, double exponent) {
+    return std::pow(base, exponent);
+}
+
+// Element count of range(start, stop, step) from three consecutive doubles, as
+// RangeData computes it, or -1 when range would fail or the count does not fit
+static int64_t jitRangeCount(const double* bounds) {
+    double step = bounds[2];
+    if (step == 0.0 || std::isnan(step)) {
+        return -1;
+    }
+    double steps = std::ceil((bounds[1] - bounds[0]) / step);
+    if (!(steps > 0)) {
+        return 0;
+    }
+    return (steps < 9.2e18) ? static_cast<int64_t>(steps) : -1;
+}
+
+// Machine code mapped writable while it is copied in, then executable, never both
+class ExecutableCode {
+public:
+    static std::unique_ptr<ExecutableCode> make(const std::vector<uint8_t>& bytes) {
+        void* memory = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return nullptr;
+        }
+        std::memcpy(memory, bytes.data(), bytes.size());
+        if (mprotect(memory, bytes.size(), PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, bytes.size());
+            return nullptr;
+        }
+        return std::unique_ptr<ExecutableCode>(new ExecutableCode(memory, bytes.size()));
+    }
+
+    ~ExecutableCode() {
+        munmap(memory, size);
+    }
+
+    ExecutableCode(const ExecutableCode&) = delete;
+    ExecutableCode& operator=(const ExecutableCode&) = delete;
+
+    JitEntry entry() const {
+        return reinterpret_cast<JitEntry>(memory);
+    }
+
+private:
+    void* memory;
+    size_t size;
+
+    ExecutableCode(void* memory, size_t size) : memory(memory), size(size) {
+    }
+};
+
+// The x86-64 encodings the JIT uses and nothing more. Memory operands are always
+// [base + disp32], with a base that needs no SIB byte (not rsp or r12).
+class X86Emitter {
+public:
+    enum Register { rax = 0, rcx = 1, rdx = 2, rbx = 3, rsp = 4, rbp = 5, rsi = 6, rdi = 7 };
+    enum Condition { below = 0x2, equal = 0x4, notEqual = 0x5, belowEqual = 0x6, sign = 0x8, parity = 0xA, greaterEqual = 0xD };
+
+    // Scalar double operations, xmm to xmm
+    static constexpr uint8_t addsd = 0x58, mulsd = 0x59, subsd = 0x5C, divsd = 0x5E, sqrtsd = 0x51;
+
+    std::vector<uint8_t> bytes;
+
+    size_t newLabel() {
+        labels.push_back(SIZE_MAX);
+        return labels.size() - 1;
+    }
+
+    void bind(size_t label) {
+        labels[label] = bytes.size();
+    }
+
+    void jump(size_t label) {
+        byte(0xE9);
+        fixup(label);
+    }
+
+    void jumpIf(Condition condition, size_t label) {
+        byte(0x0F);
+        byte(static_cast<uint8_t>(0x80 | condition));
+        fixup(label);
+    }
+
+    // Resolves the jumps; false if one targets a label never bound
+    bool finish() {
+        for (const std::pair<size_t, size_t>& jump : fixups) {
+            if (labels[jump.second] == SIZE_MAX) {
+                return false;
+            }
+            int32_t distance = static_cast<int32_t>(labels[jump.second] - (jump.first + 4));
+            std::memcpy(bytes.data() + jump.first, &distance, 4);
+        }
+        return true;
+    }
+
+    void arithmetic(uint8_t op, int target, int source) {
+        sse(0xF2, op, target, source);
+    }
+
+    void arithmetic(uint8_t op, int target, Register base, int32_t displacement) {
+        sse(0xF2, op, target, base, displacement);
+    }
+
+    void loadDouble(int target, Register base, int32_t displacement) {
+        sse(0xF2, 0x10, target, base, displacement);
+    }
+
+    void storeDouble(Register base, int32_t displacement, int source) {
+        sse(0xF2, 0x11, source, base, displacement);
+    }
+
+    void moveDouble(int target, int source) {
+        sse(0x66, 0x28, target, source);   // movapd
+    }
+
+    void compareDoubles(int lhs, int rhs) {
+        sse(0x66, 0x2E, lhs, rhs);         // ucomisd
+    }
+
+    void xorDoubles(int target, int source) {
+        sse(0x66, 0x57, target, source);   // xorpd
+    }
+
+    void moveToDouble(int target, Register source) {
+        byte(0x66);
+        rex(true, target, source);
+        byte(0x0F);
+        byte(0x6E);                         // movq xmm, r64
+        direct(target, source);
+    }
+
+    void convertToDouble(int target, Register source) {
+        byte(0xF2);
+        rex(true, target, source);
+        byte(0x0F);
+        byte(0x2A);                         // cvtsi2sd xmm, r64
+        direct(target, source);
+    }
+
+    void moveImmediate(Register target, uint64_t value) {
+        rex(true, 0, target);
+        byte(static_cast<uint8_t>(0xB8 | (target & 7)));
+        append(&value, 8);
+    }
+
+    // Zero-extends into the whole register
+    void moveImmediate32(Register target, uint32_t value) {
+        rex(false, 0, target);
+        byte(static_cast<uint8_t>(0xB8 | (target & 7)));
+        append(&value, 4);
+    }
+
+    void load(Register target, Register base, int32_t displacement) {
+        rex(true, target, base);
+        byte(0x8B);
+        memory(target, base, displacement);
+    }
+
+    void store(Register base, int32_t displacement, Register source) {
+        rex(true, source, base);
+        byte(0x89);
+        memory(source, base, displacement);
+    }
+
+    void loadAddress(Register target, Register base, int32_t displacement) {
+        rex(true, target, base);
+        byte(0x8D);
+        memory(target, base, displacement);
+    }
+
+    void move(Register target, Register source) {
+        rex(true, source, target);
+        byte(0x89);
+        direct(source, target);
+    }
+
+    // Flags of lhs - rhs
+    void compare(Register lhs, Register rhs) {
+        rex(true, rhs, lhs);
+        byte(0x39);
+        direct(rhs, lhs);
+    }
+
+    void test(Register value, bool wide) {
+        rex(wide, value, value);
+        byte(0x85);
+        direct(value, value);
+    }
+
+    void increment(Register base, int32_t displacement) {
+        rex(true, 0, base);
+        byte(0xFF);
+        memory(0, base, displacement);
+    }
+
+    void call(Register target) {
+        rex(false, 0, target);
+        byte(0xFF);
+        byte(static_cast<uint8_t>(0xD0 | (target & 7)));
+    }
+
+    void push(Register source) {
+        byte(static_cast<uint8_t>(0x50 | source));
+    }
+
+    void reserveStack(uint32_t size) {
+        byte(0x48);
+        byte(0x81);
+        byte(0xEC);                         // sub rsp, imm32
+        append(&size, 4);
+    }
+
+    void leaveAndReturn() {
+        byte(0xC9);                         // leave
+        byte(0xC3);                         // ret
+    }
+
+private:
+    std::vector<size_t> labels;
+    std::vector<std::pair<size_t, size_t>> fixups;   // (position of rel32, label)
+
+    void byte(uint8_t value) {
+        bytes.push_back(value);
+    }
+
+    void append(const void* data, size_t size) {
+        const uint8_t* first = static_cast<const uint8_t*>(data);
+        bytes.insert(bytes.end(), first, first + size);
+    }
+
+    void fixup(size_t label) {
+        fixups.emplace_back(bytes.size(), label);
+        append("\0\0\0\0", 4);
+    }
+
+    void rex(bool wide, int reg, int rm) {
+        uint8_t prefix = static_cast<uint8_t>(0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+        if (prefix != 0x40) {
+            byte(prefix);
+        }
+    }
+
+    void direct(int reg, int rm) {
+        byte(static_cast<uint8_t>(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+    }
+
+    void memory(int reg, Register base, int32_t displacement) {
+        byte(static_cast<uint8_t>(0x80 | ((reg & 7) << 3) | (base & 7)));
+        append(&displacement, 4);
+    }
+
+    void sse(uint8_t prefix, uint8_t op, int reg, int rm) {
+        byte(prefix);
+        rex(false, reg, rm);
+        byte(0x0F);
+        byte(op);
+        direct(reg, rm);
+    }
+
+    void sse(uint8_t prefix, uint8_t op, int reg, Register base, int32_t displacement) {
+        byte(prefix);
+        rex(false, reg, base);
+        byte(0x0F);
+        byte(op);
+        memory(reg, base, displacement);
+    }
+};
+
+// Translates one function. The native frame holds, from its lowest address up: the
+// locals, spill slots for the value stack around calls, four slots per nested range
+// loop (index, count, start, step) and the result pointer. Value stack entry k lives
+// in xmm2 + k; xmm0 and xmm1 are scratch.
+class JitCompiler {
+public:
+    static constexpr size_t maxLocals = 64;     // locals known to be set fit one bit mask
+    static constexpr size_t maxDepth = 12;      // xmm2 to xmm13
+
+    JitCompiler(const Chunk& chunk, const FunctionProto& function, JitCallHelper callHelper, JitObserveHelper observeHelper)
+        : chunk(chunk), function(function), callHelper(callHelper), observeHelper(observeHelper), rangeBuiltin(builtins.find("range")), sqrtBuiltin(builtins.find("sqrt")) {
+        // The body runs up to the Define the jump before it skips to
+        begin = function.entry;
+        end = (begin > 0 && chunk.code[begin - 1].op == OpCode::Jump) ? static_cast<size_t>(chunk.code[begin - 1].operand) : begin;
+    }
+
+    // Null when the function does not qualify
+    std::unique_ptr<ExecutableCode> compile() {
+        if (!analyze()) {
+            return nullptr;
+        }
+        findUnsetReads();
+        emitFunction();
+        if (!out.finish()) {
+            return nullptr;
+        }
+        return ExecutableCode::make(out.bytes);
+    }
+
+private:
+    // Signaling NaN: arithmetic never produces it, so it marks a local not set yet
+    static constexpr uint64_t unsetLocal = 0x7FF0DEADBEEF0001ull;
+
+    const Chunk& chunk;
+    const FunctionProto& function;
+    JitCallHelper callHelper;
+    JitObserveHelper observeHelper;
+    int32_t rangeBuiltin;
+    int32_t sqrtBuiltin;
+    size_t begin = 0;
+    size_t end = 0;
+    size_t locals = 0;
+    size_t deepest = 0;             // spill slots: the deepest the value stack gets, plus one
+    size_t loopLevels = 0;          // range loops nested at most
+    std::vector<bool> jumpTarget;   // by instruction, from begin
+    std::vector<bool> checkedRead;  // LoadLocal or Return that may find its local unset
+    bool anyChecks = false;
+    bool observing = false;         // compiled with line markers
+    X86Emitter out;
+    uint32_t frameSize = 0;
+
+    const Instruction& at(size_t i) const {
+        return chunk.code[i];
+    }
+
+    static bool isComparison(OpCode op) {
+        return op == OpCode::Equal || op == OpCode::NotEqual || op == OpCode::Less || op == OpCode::LessEqual || op == OpCode::Greater || op == OpCode::GreaterEqual;
+    }
+
+    static bool isJump(OpCode op) {
+        return op == OpCode::Jump || op == OpCode::Loop || op == OpCode::JumpIfFalse || op == OpCode::IterNext;
+    }
+
+    // Checks every instruction and the shape of the value stack. Comparisons must feed
+    // the conditional jump right after them and range calls the loop right after them;
+    // every jump target is a statement boundary, with nothing on the stack.
+    bool analyze() {
+        locals = function.localNames.size();
+        size_t parameters = function.booleanParams.size();
+        if (end <= begin || locals <= parameters || locals > maxLocals) {
+            return false;
+        }
+        for (bool boolean : function.booleanParams) {
+            if (boolean) {
+                return false;
+            }
+        }
+
+        jumpTarget.assign(end - begin, false);
+        for (size_t i = begin; i < end; ++i) {
+            if (isJump(at(i).op)) {
+                if (at(i).operand < static_cast<int32_t>(begin) || at(i).operand >= static_cast<int32_t>(end)) {
+                    return false;
+                }
+                jumpTarget[at(i).operand - begin] = true;
+            }
+        }
+
+        size_t depth = 0;
+        std::vector<size_t> loopExits;
+        for (size_t i = begin; i < end; ++i) {
+            while (!loopExits.empty() && loopExits.back() == i) {
+                loopExits.pop_back();
+            }
+            if (jumpTarget[i - begin] && depth != 0) {
+                return false;
+            }
+
+            const Instruction& instruction = at(i);
+            deepest = std::max(deepest, depth + 1);   // a two-argument range stores its step one past the top
+            size_t pops = 0;
+            size_t pushes = 0;
+            switch (instruction.op) {
+            case OpCode::PushConstant:
+                if (chunk.constants[instruction.operand].type != ValueType::Number) {
+                    return false;
+                }
+                pushes = 1;
+                break;
+            case OpCode::LoadLocal:
+                pushes = 1;
+                break;
+            case OpCode::StoreLocal:
+            case OpCode::JumpIfFalse:
+                pops = 1;
+                break;
+            case OpCode::Negate:
+                pops = pushes = 1;
+                break;
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide:
+            case OpCode::Power:
+                pops = 2;
+                pushes = 1;
+                break;
+            case OpCode::Equal:
+            case OpCode::NotEqual:
+            case OpCode::Less:
+            case OpCode::LessEqual:
+            case OpCode::Greater:
+            case OpCode::GreaterEqual:
+                if (i + 1 >= end || at(i + 1).op != OpCode::JumpIfFalse || jumpTarget[i + 1 - begin]) {
+                    return false;
+                }
+                pops = 2;
+                pushes = 1;
+                break;
+            case OpCode::CallBuiltin:
+                if (instruction.operand == rangeBuiltin) {
+                    if (i + 1 >= end || at(i + 1).op != OpCode::IterBegin || jumpTarget[i + 1 - begin] || instruction.count < 2) {
+                        return false;
+                    }
+                    pops = instruction.count;
+                    loopLevels = std::max(loopLevels, loopExits.size() + 1);
+                    ++i;
+                    break;
+                }
+                if (!builtins[instruction.operand].numeric || instruction.count != 1) {
+                    return false;
+                }
+                pops = pushes = 1;
+                break;
+            case OpCode::IterNext:
+                if (i == begin || at(i - 1).op != OpCode::IterBegin) {
+                    return false;
+                }
+                loopExits.push_back(static_cast<size_t>(instruction.operand));
+                pushes = 1;
+                break;
+            case OpCode::Jump:
+            case OpCode::Loop:
+            case OpCode::Return:
+                break;
+            case OpCode::Line:
+                if (depth != 0) {
+                    return false;
+                }
+                observing = true;
+                break;
+            case OpCode::Call:
+                pops = instruction.count;
+                pushes = 1;
+                break;
+            case OpCode::TailCall:
+                pops = instruction.count;
+                break;
+            default:
+                return false;
+            }
+
+            if (depth < pops) {
+                return false;
+            }
+            depth = depth - pops + pushes;
+            if (depth > maxDepth) {
+                return false;
+            }
+            if ((instruction.op == OpCode::Jump || instruction.op == OpCode::Loop || instruction.op == OpCode::Return || instruction.op == OpCode::TailCall) && depth != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Forward pass over the control flow: which locals are certainly set before each
+    // instruction. Only reads of the others are checked at run time.
+    void findUnsetReads() {
+        size_t count = end - begin;
+        uint64_t parameters = (1ull << function.booleanParams.size()) - 1;
+        std::vector<uint64_t> setBefore(count, ~0ull);
+        setBefore[0] = parameters;
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = 0; i < count; ++i) {
+                const Instruction& instruction = at(begin + i);
+                uint64_t setAfter = setBefore[i];
+                if (instruction.op == OpCode::StoreLocal) {
+                    setAfter |= 1ull << instruction.operand;
+                }
+
+                size_t successors[2];
+                size_t successorCount = 0;
+                if (isJump(instruction.op)) {
+                    successors[successorCount++] = static_cast<size_t>(instruction.operand) - begin;
+                }
+                bool fallsThrough = instruction.op != OpCode::Jump && instruction.op != OpCode::Loop && instruction.op != OpCode::Return && instruction.op != OpCode::TailCall;
+                if (fallsThrough && i + 1 < count) {
+                    successors[successorCount++] = i + 1;
+                }
+                for (size_t s = 0; s < successorCount; ++s) {
+                    size_t next = successors[s];
+                    if (next != 0 && (setBefore[next] & setAfter) != setBefore[next]) {
+                        setBefore[next] &= setAfter;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        size_t result = function.booleanParams.size();
+        checkedRead.assign(count, false);
+        for (size_t i = 0; i < count; ++i) {
+            const Instruction& instruction = at(begin + i);
+            if (instruction.op == OpCode::LoadLocal) {
+                checkedRead[i] = !(setBefore[i] & (1ull << instruction.operand));
+            }
+            else if (instruction.op == OpCode::Return) {
+                checkedRead[i] = !(setBefore[i] & (1ull << result));
+            }
+            anyChecks = anyChecks || checkedRead[i];
+        }
+    }
+
+    static int valueRegister(size_t entry) {
+        return static_cast<int>(2 + entry);
+    }
+
+    int32_t slot(size_t index) const {
+        return -8 - static_cast<int32_t>(frameSize) + static_cast<int32_t>(8 * index);
+    }
+
+    int32_t local(size_t index) const {
+        return slot(index);
+    }
+
+    int32_t spillSlot(size_t entry) const {
+        return slot(locals + entry);
+    }
+
+    int32_t loopSlot(size_t level, size_t field) const {
+        return slot(locals + deepest + 4 * level + field);
+    }
+
+    int32_t resultPointer() const {
+        return slot(locals + deepest + 4 * loopLevels);
+    }
+
+    // xmm registers do not survive calls, so the live stack entries go to the frame
+    void spill(size_t from, size_t to) {
+        for (size_t entry = from; entry < to; ++entry) {
+            out.storeDouble(X86Emitter::rbp, spillSlot(entry), valueRegister(entry));
+        }
+    }
+
+    void reload(size_t from, size_t to) {
+        for (size_t entry = from; entry < to; ++entry) {
+            out.loadDouble(valueRegister(entry), X86Emitter::rbp, spillSlot(entry));
+        }
+    }
+
+    void callAddress(uint64_t target) {
+        out.moveImmediate(X86Emitter::rax, target);
+        out.call(X86Emitter::rax);
+    }
+
+    void emitFunction() {
+        using R = X86Emitter;
+        size_t parameters = function.booleanParams.size();
+
+        // rbp is 16-aligned after the push; with rbx pushed too, the frame keeps rsp aligned
+        frameSize = static_cast<uint32_t>(8 * (locals + deepest + 4 * loopLevels + 1));
+        if (frameSize % 16 == 0) {
+            frameSize += 8;
+        }
+        out.push(R::rbp);
+        out.move(R::rbp, R::rsp);
+        out.push(R::rbx);
+        out.reserveStack(frameSize);
+        out.move(R::rbx, R::rdi);
+        out.store(R::rbp, resultPointer(), R::rdx);
+        for (size_t i = 0; i < parameters; ++i) {
+            out.loadDouble(0, R::rsi, static_cast<int32_t>(8 * i));
+            out.storeDouble(R::rbp, local(i), 0);
+        }
+
+        size_t restart = out.newLabel();
+        size_t bail = out.newLabel();
+        size_t finish = out.newLabel();
+        size_t exit = out.newLabel();
+        std::vector<size_t> labels(end - begin);
+        for (size_t& label : labels) {
+            label = out.newLabel();
+        }
+
+        out.bind(restart);
+        if (anyChecks) {
+            out.moveImmediate(R::rax, unsetLocal);
+            for (size_t i = parameters; i < locals; ++i) {
+                out.store(R::rbp, local(i), R::rax);
+            }
+        }
+
+        size_t depth = 0;
+        std::vector<size_t> loopExits;
+        for (size_t i = begin; i < end; ++i) {
+            while (!loopExits.empty() && loopExits.back() == i) {
+                loopExits.pop_back();
+            }
+            out.bind(labels[i - begin]);
+            const Instruction& instruction = at(i);
+            switch (instruction.op) {
+            case OpCode::PushConstant: {
+                double value = chunk.constants[instruction.operand].number;
+                uint64_t bits;
+                std::memcpy(&bits, &value, 8);
+                if (bits == 0) {
+                    out.xorDoubles(valueRegister(depth), valueRegister(depth));
+                }
+                else {
+                    out.moveImmediate(R::rax, bits);
+                    out.moveToDouble(valueRegister(depth), R::rax);
+                }
+                ++depth;
+                break;
+            }
+            case OpCode::LoadLocal:
+                if (checkedRead[i - begin]) {
+                    out.load(R::rax, R::rbp, local(instruction.operand));
+                    out.moveImmediate(R::rcx, unsetLocal);
+                    out.compare(R::rax, R::rcx);
+                    out.jumpIf(R::equal, bail);
+                    out.moveToDouble(valueRegister(depth), R::rax);
+                }
+                else {
+                    out.loadDouble(valueRegister(depth), R::rbp, local(instruction.operand));
+                }
+                ++depth;
+                break;
+            case OpCode::StoreLocal:
+                --depth;
+                out.storeDouble(R::rbp, local(instruction.operand), valueRegister(depth));
+                break;
+            case OpCode::Negate:
+                out.moveImmediate(R::rax, 0x8000000000000000ull);
+                out.moveToDouble(0, R::rax);
+                out.xorDoubles(valueRegister(depth - 1), 0);
+                break;
+            case OpCode::Add:
+                out.arithmetic(R::addsd, valueRegister(depth - 2), valueRegister(depth - 1));
+                --depth;
+                break;
+            case OpCode::Subtract:
+                out.arithmetic(R::subsd, valueRegister(depth - 2), valueRegister(depth - 1));
+                --depth;
+                break;
+            case OpCode::Multiply:
+                out.arithmetic(R::mulsd, valueRegister(depth - 2), valueRegister(depth - 1));
+                --depth;
+                break;
+            case OpCode::Divide: {
+                // Only an exact zero raises the error; NaN divides like any other number
+                size_t divide = out.newLabel();
+                out.xorDoubles(0, 0);
+                out.compareDoubles(valueRegister(depth - 1), 0);
+                out.jumpIf(R::parity, divide);
+                out.jumpIf(R::equal, bail);
+                out.bind(divide);
+                out.arithmetic(R::divsd, valueRegister(depth - 2), valueRegister(depth - 1));
+                --depth;
+                break;
+            }
+            case OpCode::Power:
+                spill(0, depth - 2);
+                out.moveDouble(0, valueRegister(depth - 2));
+                out.moveDouble(1, valueRegister(depth - 1));
+                callAddress(reinterpret_cast<uint64_t>(&jitPower));
+                out.moveDouble(valueRegister(depth - 2), 0);
+                reload(0, depth - 2);
+                --depth;
+                break;
+            case OpCode::Equal:
+            case OpCode::NotEqual:
+            case OpCode::Less:
+            case OpCode::LessEqual:
+            case OpCode::Greater:
+            case OpCode::GreaterEqual:
+                emitBranch(instruction.op, valueRegister(depth - 2), valueRegister(depth - 1), labels[at(i + 1).operand - begin]);
+                depth -= 2;
+                ++i;
+                out.bind(labels[i - begin]);
+                break;
+            case OpCode::JumpIfFalse: {
+                // Taken for zero only: NaN is truthy
+                size_t truthy = out.newLabel();
+                --depth;
+                out.xorDoubles(0, 0);
+                out.compareDoubles(valueRegister(depth), 0);
+                out.jumpIf(R::parity, truthy);
+                out.jumpIf(R::equal, labels[instruction.operand - begin]);
+                out.bind(truthy);
+                break;
+            }
+            case OpCode::CallBuiltin:
+                if (observing) {
+                    emitObserve(depth, JitEvent::Builtin, instruction.operand);
+                }
+                if (instruction.operand == rangeBuiltin) {
+                    emitRange(depth, instruction.count, loopExits.size(), bail);
+                    depth -= instruction.count;
+                    ++i;
+                    out.bind(labels[i - begin]);
+                }
+                else if (instruction.operand == sqrtBuiltin) {
+                    out.arithmetic(R::sqrtsd, valueRegister(depth - 1), valueRegister(depth - 1));
+                }
+                else {
+                    spill(0, depth - 1);
+                    out.moveDouble(0, valueRegister(depth - 1));
+                    callAddress(reinterpret_cast<uint64_t>(builtins[instruction.operand].numeric));
+                    out.moveDouble(valueRegister(depth - 1), 0);
+                    reload(0, depth - 1);
+                }
+                break;
+            case OpCode::IterNext: {
+                loopExits.push_back(static_cast<size_t>(instruction.operand));
+                size_t level = loopExits.size() - 1;
+                out.load(R::rax, R::rbp, loopSlot(level, 0));
+                out.load(R::rcx, R::rbp, loopSlot(level, 1));
+                out.compare(R::rax, R::rcx);
+                out.jumpIf(R::greaterEqual, labels[instruction.operand - begin]);
+                out.convertToDouble(valueRegister(depth), R::rax);
+                out.arithmetic(R::mulsd, valueRegister(depth), R::rbp, loopSlot(level, 3));
+                out.arithmetic(R::addsd, valueRegister(depth), R::rbp, loopSlot(level, 2));
+                out.increment(R::rbp, loopSlot(level, 0));
+                ++depth;
+                break;
+            }
+            case OpCode::Jump:
+            case OpCode::Loop:
+                out.jump(labels[instruction.operand - begin]);
+                break;
+            case OpCode::Call:
+                emitCall(depth, instruction, bail);
+                depth = depth - instruction.count + 1;
+                break;
+            case OpCode::TailCall:
+                // Calling itself: new arguments in place and back to the top, as the
+                // interpreter reuses the frame. Any other callee is an ordinary call.
+                if (instruction.operand == function.slot && instruction.count == parameters) {
+                    if (observing) {
+                        emitObserve(depth, JitEvent::Call, function.slot);
+                    }
+                    for (size_t p = 0; p < parameters; ++p) {
+                        out.storeDouble(R::rbp, local(p), valueRegister(depth - parameters + p));
+                    }
+                    out.jump(restart);
+                }
+                else {
+                    emitCall(depth, instruction, bail);
+                    out.storeDouble(R::rbp, local(parameters), valueRegister(depth - instruction.count));
+                    out.jump(finish);
+                }
+                depth -= instruction.count;
+                break;
+            case OpCode::Line:
+                emitObserve(depth, JitEvent::Line, instruction.operand);
+                break;
+            case OpCode::Return:
+                if (checkedRead[i - begin]) {
+                    out.load(R::rax, R::rbp, local(parameters));
+                    out.moveImmediate(R::rcx, unsetLocal);
+                    out.compare(R::rax, R::rcx);
+                    out.jumpIf(R::equal, bail);
+                }
+                out.jump(finish);
+                break;
+            default:
+                break;
+            }
+        }
+
+        out.bind(bail);
+        out.moveImmediate32(R::rax, 1);
+        out.jump(exit);
+
+        out.bind(finish);
+        out.loadDouble(0, R::rbp, local(parameters));
+        out.load(R::rax, R::rbp, resultPointer());
+        out.storeDouble(R::rax, 0, 0);
+        out.moveImmediate32(R::rax, 0);
+
+        out.bind(exit);
+        out.load(R::rbx, R::rbp, -8);
+        out.leaveAndReturn();
+    }
+
+    // Jumps to `otherwise` when the comparison is false; every comparison with NaN is,
+    // except !=
+    void emitBranch(OpCode op, int lhs, int rhs, size_t otherwise) {
+        using R = X86Emitter;
+        switch (op) {
+        case OpCode::Less:
+            out.compareDoubles(rhs, lhs);
+            out.jumpIf(R::belowEqual, otherwise);
+            break;
+        case OpCode::LessEqual:
+            out.compareDoubles(rhs, lhs);
+            out.jumpIf(R::below, otherwise);
+            break;
+        case OpCode::Greater:
+            out.compareDoubles(lhs, rhs);
+            out.jumpIf(R::belowEqual, otherwise);
+            break;
+        case OpCode::GreaterEqual:
+            out.compareDoubles(lhs, rhs);
+            out.jumpIf(R::below, otherwise);
+            break;
+        case OpCode::Equal:
+            out.compareDoubles(lhs, rhs);
+            out.jumpIf(R::parity, otherwise);
+            out.jumpIf(R::notEqual, otherwise);
+            break;
+        default: {
+            size_t unequal = out.newLabel();
+            out.compareDoubles(lhs, rhs);
+            out.jumpIf(R::parity, unequal);
+            out.jumpIf(R::equal, otherwise);
+            out.bind(unequal);
+            break;
+        }
+        }
+    }
+
+    // Arguments go to the spill slots, in order, and the callee writes its result over
+    // the first one
+    void emitCall(size_t depth, const Instruction& instruction, size_t bail) {
+        using R = X86Emitter;
+        size_t first = depth - instruction.count;
+        spill(0, depth);
+        out.move(R::rdi, R::rbx);
+        out.moveImmediate32(R::rsi, static_cast<uint32_t>(instruction.operand));
+        out.moveImmediate32(R::rdx, instruction.count);
+        out.loadAddress(R::rcx, R::rbp, spillSlot(first));
+        callAddress(reinterpret_cast<uint64_t>(callHelper));
+        out.test(R::rax, false);
+        out.jumpIf(R::notEqual, bail);
+        reload(0, first + 1);
+    }
+
+    void emitObserve(size_t depth, JitEvent event, int32_t value) {
+        using R = X86Emitter;
+        spill(0, depth);
+        out.move(R::rdi, R::rbx);
+        out.moveImmediate32(R::rsi, static_cast<uint32_t>(event));
+        out.moveImmediate32(R::rdx, static_cast<uint32_t>(value));
+        callAddress(reinterpret_cast<uint64_t>(observeHelper));
+        reload(0, depth);
+    }
+
+    // range(...) right before a foreach: sets up the loop's index, count, start and step
+    void emitRange(size_t depth, size_t count, size_t level, size_t bail) {
+        using R = X86Emitter;
+        size_t first = depth - count;
+        if (count == 2) {
+            double one = 1.0;
+            uint64_t bits;
+            std::memcpy(&bits, &one, 8);
+            out.moveImmediate(R::rax, bits);
+            out.store(R::rbp, spillSlot(depth), R::rax);
+        }
+        spill(0, depth);
+        out.loadAddress(R::rdi, R::rbp, spillSlot(first));
+        callAddress(reinterpret_cast<uint64_t>(&jitRangeCount));
+        out.test(R::rax, true);
+        out.jumpIf(R::sign, bail);
+        out.store(R::rbp, loopSlot(level, 1), R::rax);
+        out.moveImmediate32(R::rax, 0);
+        out.store(R::rbp, loopSlot(level, 0), R::rax);
+        out.loadDouble(0, R::rbp, spillSlot(first));
+        out.storeDouble(R::rbp, loopSlot(level, 2), 0);
+        out.loadDouble(0, R::rbp, spillSlot(first + 2));
+        out.storeDouble(R::rbp, loopSlot(level, 3), 0);
+        reload(0, first);
+    }
+};
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HY_COMPUTED_GOTO 1
+#endif
+
+class VirtualMachine {
+public:
+    bool jit = true;    // compile hot numeric functions where the JIT is built in
+
+    VirtualMachine(const Chunk& chunk, Interpreter& runtime) : chunk(chunk), runtime(runtime) {
+    }
+
+    void run(size_t entry) {
+        reset();
+        execute(entry);
+    }
+
+    // A run that ended in an error may have left anything on the stacks
+    void reset() {
+        stack.clear();
+        iterators.clear();
+        frames.clear();
+        collectors.clear();
+        pendingMemos.clear();
+        runtime.resetFrames();
+    }
+
+    // Runs from entry to the next Halt
+    void execute(size_t entry) {
+        const Instruction* code = chunk.code.data();
+        const Instruction* ip = code + entry;
+
+        // A computed goto leaves a block without running destructors, so a case either
+        // moves its locals away or ends their scope before it dispatches
+#ifdef HY_COMPUTED_GOTO
+        static void* const labels[] = {
+#define HY_OPCODE_LABEL(name) &&op_##name,
+            HY_OPCODES(HY_OPCODE_LABEL)
+#undef HY_OPCODE_LABEL
+        };
+#define VM_DISPATCH() goto *labels[static_cast<size_t>(ip->op)]
+#define VM_CASE(name) op_##name
+        VM_DISPATCH();
+#else
+#define VM_DISPATCH() goto dispatch
+#define VM_CASE(name) case OpCode::name
+    dispatch:
+        switch (ip->op) {
+#endif
+
+// Numbers take the inline path; anything else goes through Interpreter::evaluateOperator
+#define VM_BINARY(name, op, numericResult) \
+        VM_CASE(name): { \
+            Value& lhs = stack[stack.size() - 2]; \
+            const Value& rhs = stack.back(); \
+            if (lhs.type == ValueType::Number && rhs.type == ValueType::Number) { \
+                numericResult; \
+            } \
+            else { \
+                lhs = runtime.evaluateOperator(op, lhs, rhs); \
+            } \
+            stack.pop_back(); \
+            ++ip; \
+            VM_DISPATCH(); \
+        }
+
+        VM_CASE(PushConstant):
+            stack.push_back(chunk.constants[ip->operand]);
+            ++ip;
+            VM_DISPATCH();
+
+        VM_CASE(LoadVariable):
+            stack.push_back(runtime.getVariable(ip->operand));
+            ++ip;
+            VM_DISPATCH();
+
+        VM_CASE(StoreVariable):
+            runtime.setVariable(ip->operand, std::move(stack.back()));
+            stack.pop_back();
+            ++ip;
+            VM_DISPATCH();
+
+        VM_CASE(LoadLocal):
+            stack.push_back(runtime.getLocal(ip->operand, frames.back().function->localNames[ip->operand]));
+            ++ip;
+            VM_DISPATCH();
+
+        VM_CASE(StoreLocal):
+            runtime.setLocal(ip->operand, std::move(stack.back()));
+            stack.pop_back();
+            ++ip;
+            VM_DISPATCH();
+
+        VM_CASE(FormatString): {
+            std::string text;
+            formatTemplate(chunk.templates[ip->operand], text);
+            stack.push_back(Value::fromString(std::move(text)));
+            ++ip;
+            VM_DISPATCH();
+        }
+
+        VM_CASE(MakeList): {
+            std::vector<Value> items(std::make_move_iterator(stack.end() - ip->operand), std::make_move_iterator(stack.end()));
+            stack.resize(stack.size() - ip->operand);
+            stack.push_back(Value::fromList(std::move(items)));
+            ++ip;
+            VM_DISPATCH();
+        }
+
+        VM_CASE(Negate):
+            stack.back() = Value::fromNumber(-stack.back().toNumber());
+            ++ip;
+            VM_DISPATCH();
+
+        VM_BINARY(Add, Operator::Add, lhs.number += rhs.number)
+        VM_BINARY(Subtract, Operator::Subtract, lhs.number -= rhs.number)
+        VM_BINARY(Multiply, Operator::Multiply, lhs.number *= rhs.number)
+        VM_BINARY(Divide, Operator::Divide, if (rhs.number == 0) { throw std::runtime_error("Diviso por zero."); } lhs.number /= rhs.number)
+        VM_BINARY(Power, Operator::Power, lhs.number = std::pow(lhs.number, rhs.number))
+        VM_BINARY(Equal, Operator::Equal, lhs = Value::fromBoolean(lhs.number == rhs.number))
+        VM_BINARY(NotEqual, Operator::NotEqual, lhs = Value::fromBoolean(lhs.number != rhs.number))
+        VM_BINARY(Less, Operator::Less, lhs = Value::fromBoolean(lhs.number < rhs.number))
+        VM_BINARY(LessEqual, Operator::LessEqual, lhs = Value::fromBoolean(lhs.number <= rhs.number))
+        VM_BINARY(Greater, Operator::Greater, lhs = Value::fromBoolean(lhs.number > rhs.number))
+        VM_BINARY(GreaterEqual, Operator::GreaterEqual, lhs = Value::fromBoolean(lhs.number >= rhs.number))
+
+        VM_CASE(CallBuiltin): {
+            const Builtin& builtin = builtins[ip->operand];
+            if (runtime.observed) {
+                runtime.onBuiltin(ip->operand);
+            }
+            if (builtin.numeric && stack.back().type == ValueType::Number) {
+                stack.back().number = builtin.numeric(stack.back().number);
+            }
+            else {
+                runtime.checkBuiltin(builtin);
+                Value result = builtin.function(stack.data() + stack.size() - ip->count, ip->count);
+                stack.resize(stack.size() - ip->count);
+                stack.push_back(std::move(result));
+            }
+            if (runtime.observed) {
+                runtime.onBuiltinDone();
+            }
+            ++ip;
+            VM_DISPATCH();
+        }
+
+        VM_CASE(PrintResult):
+            runtime.writeResult(stack.back());
+            stack.pop_back();
+            ++ip;
+            VM_DISPATCH();
+
+        VM_CASE(Print):
+            printBuffer.clear();
+            formatTemplate(chunk.templates[ip->operand], printBuffer);
+            runtime.writeLine(printBuffer);
+            ++ip;
+            VM_DISPATCH();
+
+        VM_CASE(ToLower):
+        VM_CASE(ToUpper): {
+            std::string str = stack.back().toString(runtime.numberFormat);
+            std::transform(str.begin(), str.end(), str.begin(), ip->op == OpCode::ToLower ? ::tolower : ::toupper);
+            stack.back() = Value::fromString(std::move(str));
+            ++ip;
+            VM_DISPATCH();
+        }
+
+        VM_CASE(Jump):
+            ip = code + ip->operand;
+            VM_DISPATCH();
+
+        // The jump back of a foreach. Iterations heat up the function they run in, as calls do.
+        VM_CASE(Loop):
+#ifdef HY_JIT
+            if (!frames.empty() && frames.back().function->slot >= 0) {
+                ++compiledFor(*frames.back().function).heat;
+            }
+#endif
+            ip = code + ip->operand;
+            VM_DISPATCH();
+
+        VM_CASE(JumpIfFalse): {
+            bool condition = stack.back().isTruthy();
+            stack.pop_back();
+            ip = condition ? ip + 1 : code + ip->operand;
+            VM_DISPATCH();
+        }
+
+        VM_CASE(IterBegin): {
+            Iterator iterator;
+            iterator.source = runtime.toIterable(stack.back());
+            switch (iterator.source.type) {
+            case ValueType::Range:
+                iterator.range = &iterator.source.range();
+                iterator.count = iterator.range->count;
+                break;
+            case ValueType::NumberList:
+                iterator.numbers = iterator.source.numbers().data();
+                iterator.count = iterator.source.numbers().size();
+                break;
+            default:
+                iterator.items = iterator.source.items().data();
+                iterator.count = iterator.source.items().size();
+                break;
+            }
+            iterators.push_back(std::move(iterator));
+            stack.pop_back();
+            ++ip;
+            VM_DISPATCH();
+        }
+
+        VM_CASE(IterNext): {
+            Iterator& iterator = iterators.back();
+            if (iterator.index < iterator.count) {
+                if (iterator.items) {
+                    stack.push_back(iterator.items[iterator.index]);
+                }
+                else if (iterator.range) {
+                    stack.push_back(Value::fromNumber(iterator.range->at(iterator.index)));
+                }
+                else {
+                    stack.push_back(Value::fromNumber(iterator.numbers[iterator.index]));
+                }
+                ++iterator.index;
+                ++ip;
+            }
+            else {
+                iterators.pop_back();
+                ip = code + ip->operand;
+            }
+            VM_DISPATCH();
+        }
+
+        VM_CASE(CollectBegin):
+            collectors.emplace_back();
+            ++ip;
+            VM_DISPATCH();
+
+        VM_CASE(Yield):
+            collectors.back().push_back(std::move(stack.back()));
+            stack.pop_back();
+            ++ip;
+            VM_DISPATCH();
+
+        VM_CASE(CollectEnd):
+            stack.push_back(Value::fromList(std::move(collectors.back())));
+            collectors.pop_back();
+            ++ip;
+            VM_DISPATCH();
+
+        VM_CASE(ParallelForEach): {
+            {
+                const ParallelLoop& loop = chunk.loops[ip->operand];
+                Value iterable = runtime.toIterable(stack.back());
+                stack.pop_back();
+                Value collected = runParallel(loop, iterable);
+                if (loop.collects) {
+                    stack.push_back(std::move(collected));
+                }
+            }
+            ++ip;
+            VM_DISPATCH();
+        }
+
+        VM_CASE(Define): {
+            runtime.checkDefine();
+            const FunctionProto& function = chunk.functions[ip->operand];
+            if (functionBySlot.size() < runtime.symbolCount()) {
+                functionBySlot.resize(runtime.symbolCount(), -1);
+            }
+            functionBySlot[function.slot] = ip->operand;
+            ++ip;
+            VM_DISPATCH();
+        }
+
+        VM_CASE(Call):
+        VM_CASE(CallStatement): {
+            bool wantsResult = (ip->op == OpCode::Call);
+            const FunctionProto& function = lookupFunction(*ip, wantsResult);
+            runtime.checkCallDepth(frames.size());
+#ifdef HY_JIT
+            if (wantsResult && jit && runCompiled(function, ip->count)) {
+                ++ip;
+                VM_DISPATCH();
+            }
+#endif
+
+            size_t base = runtime.reserveFrame(function.localNames.size());
+            runtime.assignParameters(base, function.booleanParams, stack.data() + stack.size() - ip->count);
+            stack.resize(stack.size() - ip->count);
+
+            size_t callerBase = runtime.activateFrame(base);
+            bool memoized = false;
+            if (function.pure && wantsResult && recall(function, callerBase, memoized)) {
+                ++ip;
+                VM_DISPATCH();
+            }
+            frames.push_back({ ip + 1, &function, callerBase, iterators.size(), collectors.size(), wantsResult, memoized });
+            if (runtime.observed) {
+                runtime.onCall(function.slot);
+            }
+            ip = code + function.entry;
+            VM_DISPATCH();
+        }
+
+        // Reuses the current frame: same return address, same caller, no extra depth
+        VM_CASE(TailCall): {
+            const FunctionProto& function = lookupFunction(*ip, true);
+            Frame& frame = frames.back();
+            iterators.resize(frame.iteratorDepth);
+            collectors.resize(frame.collectorDepth);
+
+            size_t staging = runtime.reserveFrame(function.localNames.size());
+            runtime.assignParameters(staging, function.booleanParams, stack.data() + stack.size() - ip->count);
+            stack.resize(stack.size() - ip->count);
+            runtime.replaceFrame(staging, function.localNames.size());
+
+            frame.function = &function;
+            if (runtime.observed) {
+                runtime.onTailCall(function.slot);
+            }
+            ip = code + function.entry;
+            VM_DISPATCH();
+        }
+
+        // A return from inside a loop also drops the loop's iterator and collector
+        VM_CASE(Return): {
+            const Frame& frame = frames.back();
+            iterators.resize(frame.iteratorDepth);
+            collectors.resize(frame.collectorDepth);
+            if (frame.wantsResult) {
+                int32_t result = static_cast<int32_t>(frame.function->booleanParams.size());
+                stack.push_back(runtime.getReturnValue(result, frame.function->localNames[result]));
+                if (frame.memoized) {
+                    remember(stack.back());
+                }
+            }
+            runtime.releaseFrame(frame.callerBase);
+            ip = frame.returnAddress;
+            frames.pop_back();
+            if (runtime.observed) {
+                runtime.onReturn();
+            }
+            VM_DISPATCH();
+        }
+
+        VM_CASE(Line):
+            if (runtime.observed) {
+                runtime.onLine(static_cast<uint32_t>(ip->operand));
+            }
+            ++ip;
+            VM_DISPATCH();
+
+        VM_CASE(Halt):
+            return;
+
+#ifndef HY_COMPUTED_GOTO
+        }
+#endif
+#undef VM_BINARY
+#undef VM_DISPATCH
+#undef VM_CASE
+    }
+
+private:
+    // Points into the payload the source keeps alive; ranges are never materialized
+    struct Iterator {
+        Value source;
+        const Value* items = nullptr;
+        const RangeData* range = nullptr;
+        const double* numbers = nullptr;
+        size_t index = 0;
+        size_t count = 0;
+    };
+
+    struct Frame {
+        const Instruction* returnAddress;
+        const FunctionProto* function;
+        size_t callerBase;          // frame arena base to restore on return
+        size_t iteratorDepth;
+        size_t collectorDepth;
+        bool wantsResult;
+        bool memoized = false;      // the result goes to the key on top of pendingMemos
+    };
+
+    struct PendingMemo {
+        MemoCache* cache;
+        std::string key;
+    };
+
+    // A pool thread's own machine, with its own frames, for the iterations it runs
+    struct Worker {
+        std::unique_ptr<Interpreter> runtime;
+        std::unique_ptr<VirtualMachine> vm;
+
+        Worker(const Chunk& chunk, Interpreter& parent) : runtime(parent.spawnWorker()), vm(std::make_unique<VirtualMachine>(chunk, *runtime)) {
+        }
+    };
+
+    const Chunk& chunk;
+    Interpreter& runtime;
+    std::vector<Value> stack;
+    std::vector<Iterator> iterators;
+    std::vector<Frame> frames;
+    std::vector<std::vector<Value>> collectors;
+    std::vector<int32_t> functionBySlot;
+    std::string printBuffer;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::unique_ptr<MemoCache>> memos;  // indexed like chunk.functions
+    std::vector<PendingMemo> pendingMemos;          // keys of the memoized calls under way
+
+#ifdef HY_JIT
+    static constexpr uint32_t jitThreshold = 200;   // calls and loop iterations before a function is compiled
+    static constexpr uint32_t maxBails = 8;         // runs handed back before the code is dropped
+    static constexpr size_t jitNesting = 2048;      // compiled calls deep, bounded by the native stack
+
+    // Indexed like chunk.functions
+    struct CompiledFunction {
+        std::unique_ptr<ExecutableCode> code;
+        JitEntry entry = nullptr;
+        uint32_t heat = 0;
+        uint32_t bails = 0;
+        bool rejected = false;      // does not qualify, or gave up too often
+    };
+    std::vector<CompiledFunction> compiled;
+
+    // Counts by index, with the indexes that have any
+    struct Tally {
+        std::vector<uint64_t> counts;
+        std::vector<size_t> touched;
+
+        void add(size_t index) {
+            if (index >= counts.size()) {
+                counts.resize(index + 1, 0);
+            }
+            if (counts[index]++ == 0) {
+                touched.push_back(index);
+            }
+        }
+
+        template <typename Report>
+        void drain(Report report) {
+            for (size_t index : touched) {
+                report(index, counts[index]);
+                counts[index] = 0;
+            }
+            touched.clear();
+        }
+    };
+
+    // What compiled code did in an observed run, reported when the outermost compiled
+    // call returns. A call that bails out is run again by the interpreter, which
+    // reports it itself, so its share is dropped.
+    Tally observedLines;
+    Tally observedCalls;
+    Tally observedBuiltins;
+    std::vector<uint32_t> recentLines;  // for the trace, oldest first
+
+    CompiledFunction& compiledFor(const FunctionProto& function) {
+        if (compiled.size() < chunk.functions.size()) {
+            compiled.resize(chunk.functions.size());
+        }
+        return compiled[static_cast<size_t>(&function - chunk.functions.data())];
+    }
+
+    // A pure function stays with the interpreter, which looks its calls up
+    bool compile(const FunctionProto& function, CompiledFunction& target) {
+        if (function.pure) {
+            target.rejected = true;
+            return false;
+        }
+        try {
+            target.code = JitCompiler(chunk, function, &callFromCompiled, &observeFromCompiled).compile();
+        }
+        catch (const std::bad_alloc&) {
+            target.code.reset();
+        }
+        target.entry = target.code ? target.code->entry() : nullptr;
+        target.rejected = !target.code;
+        return target.code != nullptr;
+    }
+
+    // Runs a call with compiled code when the function is hot and qualifies and the
+    // arguments on the stack are numbers, replacing them with the result. False leaves
+    // the call to the interpreter.
+    bool runCompiled(const FunctionProto& function, size_t count) {
+        CompiledFunction& target = compiledFor(function);
+        if (!target.entry && (target.rejected || ++target.heat < jitThreshold || !compile(function, target))) {
+            return false;
+        }
+
+        double arguments[JitCompiler::maxLocals];
+        const Value* values = stack.data() + stack.size() - count;
+        for (size_t i = 0; i < count; ++i) {
+            if (values[i].type != ValueType::Number) {
+                return false;
+            }
+            arguments[i] = values[i].number;
+        }
+
+        JitCall call{ this, frames.size() + 1, std::min(runtime.maxCallDepth, frames.size() + jitNesting) };
+        double result = 0.0;
+        if (runtime.observed) {
+            observe(JitEvent::Call, function.slot);
+        }
+        int status = target.entry(&call, arguments, &result);
+        if (runtime.observed) {
+            reportObservations(status == 0);
+        }
+        if (status != 0) {
+            if (++target.bails >= maxBails) {
+                target.code.reset();
+                target.entry = nullptr;
+                target.rejected = true;
+            }
+            return false;
+        }
+        stack.resize(stack.size() - count);
+        stack.push_back(Value::fromNumber(result));
+        return true;
+    }
+
+    // Calls made by compiled code. The callee is compiled on the spot if it qualifies:
+    // its caller is hot already. Nothing may throw through compiled frames.
+    static int callFromCompiled(JitCall* call, int32_t slot, uint32_t count, double* arguments) {
+        VirtualMachine& machine = *static_cast<VirtualMachine*>(call->machine);
+        if (call->depth >= call->limit) {
+            return 1;
+        }
+        int32_t index = (static_cast<size_t>(slot) < machine.functionBySlot.size()) ? machine.functionBySlot[slot] : -1;
+        if (index < 0 || machine.chunk.functions[index].booleanParams.size() != count) {
+            return 1;
+        }
+        const FunctionProto& function = machine.chunk.functions[index];
+        CompiledFunction& target = machine.compiledFor(function);
+        if (!target.entry && (target.rejected || !machine.compile(function, target))) {
+            return 1;
+        }
+        if (machine.runtime.observed) {
+            machine.observe(JitEvent::Call, slot);
+        }
+        JitCall inner{ call->machine, call->depth + 1, call->limit };
+        return target.entry(&inner, arguments, arguments);
+    }
+
+    static void observeFromCompiled(JitCall* call, uint32_t event, int32_t value) {
+        VirtualMachine& machine = *static_cast<VirtualMachine*>(call->machine);
+        if (machine.runtime.observed) {
+            machine.observe(static_cast<JitEvent>(event), value);
+        }
+    }
+
+    // Runs on compiled frames, so an allocation failure only loses the count
+    void observe(JitEvent event, int32_t value) {
+        try {
+            switch (event) {
+            case JitEvent::Line:
+                observedLines.add(static_cast<size_t>(value));
+                if (runtime.trace) {
+                    size_t capacity = runtime.trace->capacity();
+                    if (recentLines.size() >= 2 * capacity) {
+                        recentLines.erase(recentLines.begin(), recentLines.end() - capacity);
+                    }
+                    recentLines.push_back(static_cast<uint32_t>(value));
+                }
+                break;
+            case JitEvent::Call:
+                observedCalls.add(static_cast<size_t>(value));
+                break;
+            case JitEvent::Builtin:
+                observedBuiltins.add(static_cast<size_t>(value));
+                break;
+            }
+        }
+        catch (const std::bad_alloc&) {
+        }
+    }
+
+    void reportObservations(bool finished) {
+        if (!finished) {
+            auto drop = [](size_t, uint64_t) {};
+            observedLines.drain(drop);
+            observedCalls.drain(drop);
+            observedBuiltins.drain(drop);
+            recentLines.clear();
+            return;
+        }
+        observedLines.drain([this](size_t line, uint64_t runs) { runtime.onLines(static_cast<uint32_t>(line), runs); });
+        observedCalls.drain([this](size_t slot, uint64_t calls) { runtime.onCalls(static_cast<int32_t>(slot), calls); });
+        observedBuiltins.drain([this](size_t id, uint64_t calls) { runtime.onBuiltins(static_cast<int32_t>(id), calls); });
+        if (runtime.trace) {
+            size_t first = recentLines.size() - std::min(recentLines.size(), runtime.trace->capacity());
+            for (size_t i = first; i < recentLines.size(); ++i) {
+                runtime.trace->record(recentLines[i]);
+            }
+        }
+        recentLines.clear();
+    }
+#endif
+
+    // Same scheme as Interpreter::interpretParallelForEach, with the functions defined
+    // so far handed to every worker
+    Value runParallel(const ParallelLoop& loop, const Value& iterable) {
+        std::vector<Variable> captured = runtime.captureLocals(loop.captures);
+        if (!WorkStealingPool::onWorkerThread()) {
+            while (workers.size() < parallelPool().size()) {
+                workers.push_back(std::make_unique<Worker>(chunk, runtime));
+            }
+            for (const std::unique_ptr<Worker>& worker : workers) {
+                worker->runtime->maxCallDepth = runtime.maxCallDepth;
+                worker->runtime->numberFormat = runtime.numberFormat;
+                worker->runtime->memoCapacity = runtime.memoCapacity;
+                worker->vm->functionBySlot = functionBySlot;
+                worker->vm->jit = jit;
+            }
+        }
+
+        std::vector<LoopChunk> chunks = runChunks(iterable.length(), [&](LoopChunk& part, size_t worker) {
+            if (worker == inlineWorker) {
+                runIterations(loop, iterable, captured, part);
+                return;
+            }
+            VirtualMachine& runner = *workers[worker]->vm;
+            runner.reset();
+            runner.runIterations(loop, iterable, captured, part);
+        });
+        return runtime.mergeChunks(chunks);
+    }
+
+    void runIterations(const ParallelLoop& loop, const Value& iterable, const std::vector<Variable>& captured, LoopChunk& part) {
+        std::string* enclosingCapture = runtime.capture;
+        bool enclosingIsolated = runtime.isolated;
+        runtime.capture = &part.output;
+        runtime.isolated = true;
+        collectors.emplace_back();
+        size_t collectorDepth = collectors.size();
+
+        try {
+            for (size_t i = part.begin; i < part.end; ++i) {
+                size_t base = runtime.startIteration(loop.body.localNames.size(), loop.captures, captured, elementAt(iterable, i));
+                frames.push_back({ nullptr, &loop.body, runtime.activateFrame(base), iterators.size(), collectors.size(), false });
+                execute(loop.body.entry);
+                runtime.releaseFrame(frames.back().callerBase);
+                frames.pop_back();
+            }
+            part.yields = std::move(collectors.back());
+        }
+        catch (...) {
+            part.error = std::current_exception();
+        }
+
+        collectors.resize(collectorDepth - 1);
+        runtime.capture = enclosingCapture;
+        runtime.isolated = enclosingIsolated;
+    }
+
+    // A call of a pure function whose frame is active: true when an earlier result is
+    // pushed in place of running it, which drops the frame. Otherwise `pending` tells
+    // whether Return is to remember the result.
+    bool recall(const FunctionProto& function, size_t callerBase, bool& pending) {
+        std::string key;
+        if (!runtime.memoKey(function.booleanParams.size(), key)) {
+            return false;
+        }
+        size_t index = static_cast<size_t>(&function - chunk.functions.data());
+        if (memos.size() < chunk.functions.size()) {
+            memos.resize(chunk.functions.size());
+        }
+        if (!memos[index]) {
+            memos[index] = std::make_unique<MemoCache>(runtime.memoCapacity);
+        }
+
+        const Value* cached = memos[index]->find(key);
+        if (runtime.observed) {
+            runtime.onMemo(cached != nullptr);
+        }
+        if (cached) {
+            stack.push_back(*cached);
+            runtime.releaseFrame(callerBase);
+            return true;
+        }
+        pendingMemos.push_back({ memos[index].get(), std::move(key) });
+        pending = true;
+        return false;
+    }
+
+    void remember(const Value& result) {
+        PendingMemo& memo = pendingMemos.back();
+        memo.cache->store(std::move(memo.key), result);
+        pendingMemos.pop_back();
+    }
+
+    const FunctionProto& lookupFunction(const Instruction& call, bool wantsResult) const {
+        int32_t index = (static_cast<size_t>(call.operand) < functionBySlot.size()) ? functionBySlot[call.operand] : -1;
+        if (index < 0) {
+            throw std::runtime_error((wantsResult ? "Funo no encontrada: " : "Comando desconhecido: ") + runtime.symbolName(call.operand));
+        }
+
+        const FunctionProto& function = chunk.functions[index];
+        if (call.count != function.booleanParams.size()) {
+            throw std::runtime_error("Nmero incorreto de argumentos para a funo " + runtime.symbolName(call.operand));
+        }
+        return function;
+    }
+
+    // Consumes one stack value per hole of the template
+    void formatTemplate(const TextTemplate& text, std::string& out) {
+        size_t holes = text.segments.size() - 1;
+        const Value* values = stack.data() + stack.size() - holes;
+        out += text.segments[0];
+        for (size_t i = 0; i < holes; ++i) {
+            values[i].appendTo(out, runtime.numberFormat);
+            out += text.segments[i + 1];
+        }
+        stack.resize(stack.size() - holes);
+    }
+};
+
+// Embedding API. A Script is parsed, resolved, optimized and compiled once and only
+// read afterwards, so any number of contexts may run it at the same time, on any
+// threads. A Context owns everything a run changes: variables, functions, frames and
+// output. Builtins are shared by all of them, so embedders register theirs in
+// `builtins` before compiling scripts.
+struct ScriptPart {
+    size_t begin;               // statements [begin, end) of the program
+    size_t end;
+    size_t entry;               // first instruction in the chunk
+    std::string compileError;   // raised when the bytecode runs; the tree walker meets it in place
+};
+
+class Script {
+public:
+    Arena nodes;                // memory of every node in program, so declared before it
+    SymbolTable symbols;
+    std::vector<StmtPtr> program;
+    Chunk chunk;
+    std::vector<ScriptPart> parts;
+    size_t folded = 0;
+    size_t propagated = 0;
+    size_t deadBranches = 0;
+    bool hasTree = true;        // false when only the bytecode was loaded from the cache
+    NumberFormat numberFormat = NumberFormat::Fixed;    // of the constants folded into text
+    bool lineMarkers = false;   // statements are seen by profilers, metrics and traces
+
+    // Syntax errors are thrown as SyntaxError, with an offset into `source`. Contexts
+    // running the script should print numbers in the same format.
+    static std::shared_ptr<const Script> compile(std::string_view source, bool optimize = true, NumberFormat numbers = NumberFormat::Fixed, bool lineMarkers = false) {
+        auto script = std::make_shared<Script>();
+        script->numberFormat = numbers;
+        script->lineMarkers = lineMarkers;
+        script->append(source, optimize, true);
+        return script;
+    }
+
+    // Syntax errors come back as runtime_error naming the line and column
+    static std::shared_ptr<const Script> load(const std::string& path, bool optimize = true, NumberFormat numbers = NumberFormat::Fixed) {
+        SourceFile source;
+        if (!source.open(path)) {
+            throw std::runtime_error("Arquivo no encontrado: " + path);
+        }
+        try {
+            return compile(source.text(), optimize, numbers);
+        }
+        catch (const SyntaxError& e) {
+            throw std::runtime_error(describeSyntaxError(e, source.text()));
+        }
+    }
+
+    // Adds code that sees the functions and variables of the parts before it, as the
+    // interactive mode does line by line, and returns the index of the new part.
+    // Lets are only propagated when the source is the whole script.
+    size_t append(std::string_view source, bool optimize, bool wholeScript) {
+        std::vector<StmtPtr> statements = parser.parseProgram(lexer.tokenize(source));
+        Resolver resolver(symbols);
+        resolver.resolve(statements);
+        if (optimize) {
+            Globals none;
+            none.symbols = &symbols;
+            Output unused;
+            Interpreter folding(none, unused);
+            folding.numberFormat = numberFormat;
+            Optimizer optimizer(folding);
+            optimizer.optimize(statements, symbols.size(), wholeScript);
+            folded += optimizer.folded;
+            propagated += optimizer.propagated;
+            deadBranches += optimizer.deadBranches;
+        }
+
+        ScriptPart part{ program.size(), 0, 0, std::string() };
+        try {
+            Compiler compiler(chunk, lineMarkers);
+            part.entry = compiler.compile(statements);
+        }
+        catch (const std::runtime_error& e) {
+            part.compileError = e.what();
+        }
+        for (StmtPtr& stmt : statements) {
+            program.push_back(std::move(stmt));
+        }
+        part.end = program.size();
+        parts.push_back(std::move(part));
+        return parts.size() - 1;
+    }
+
+private:
+    Lexer lexer;
+    Parser parser{ nodes };     // remembers the functions of earlier parts
+};
+
+// Compiled scripts kept on disk, so later runs skip lexing, parsing, resolving,
+// optimizing and compiling. The file is mapped and its sections copied out as they
+// lie: a header, then the symbols, constants, templates, code, functions, loops and
+// parts of the Script, in host byte order. Only the bytecode is kept, so a script
+// loaded from the cache runs on the VM even when the tree walker is asked for.
+class ScriptCache {
+public:
+    static constexpr uint32_t formatVersion = 5;     // bumped whenever the opcodes or the layout change
+
+    // Covers everything the bytecode depends on: the source, whether it was optimized,
+    // the number format and the builtins it calls by id
+    static uint64_t key(std::string_view source, bool optimize, NumberFormat numbers) {
+        uint64_t hash = fnv1a(fnvOffset, source);
+        hash = fnv1a(hash, optimize ? "optimized" : "plain");
+        if (numbers == NumberFormat::Shortest) {
+            hash = fnv1a(hash, "short numbers");    // constants folded into text are written differently
+        }
+        for (size_t id = 0; id < builtins.size(); ++id) {
+            const Builtin& entry = builtins[static_cast<int32_t>(id)];
+            const char shape[3] = { static_cast<char>(entry.minArity), static_cast<char>(entry.arity), entry.pure ? 'p' : 'i' };
+            hash = fnv1a(hash, entry.name);
+            hash = fnv1a(hash, std::string_view(shape, sizeof(shape)));
+        }
+        return hash;
+    }
+
+    // `<script>.hyc` beside the script, or a file named after the key in `directory`
+    static std::string pathFor(const std::string& scriptPath, const std::string& directory, uint64_t key) {
+        if (directory.empty()) {
+            return scriptPath + ".hyc";
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.hyc", static_cast<unsigned long long>(key));
+        char last = directory.back();
+        return (last == '/' || last == '\\') ? directory + name : directory + "/" + name;
+    }
+
+    // A missing, truncated or damaged file, another format version or another key all
+    // give nullptr, and the caller compiles the source instead
+    static std::shared_ptr<const Script> load(const std::string& path, uint64_t key) {
+        SourceFile file;
+        if (!file.open(path)) {
+            return nullptr;
+        }
+        std::string_view bytes = file.text();
+        Header header;
+        if (bytes.size() < sizeof(header)) {
+            return nullptr;
+        }
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        std::string_view body = bytes.substr(sizeof(header));
+        if (std::memcmp(header.magic, magic, sizeof(header.magic)) != 0 || header.version != formatVersion
+            || header.byteOrder != byteOrderMark || header.instructionSize != sizeof(Instruction)
+            || header.key != key || header.bodySize != body.size() || header.bodyHash != fnv1a(fnvOffset, body)) {
+            return nullptr;
+        }
+
+        try {
+            Reader in(body);
+            auto script = std::make_shared<Script>();
+            script->hasTree = false;
+            for (size_t count = in.count(); count > 0; --count) {
+                script->symbols.intern(in.text());
+            }
+            script->symbols.resolved = in.scalar<uint64_t>();
+            script->folded = in.scalar<uint64_t>();
+            script->propagated = in.scalar<uint64_t>();
+            script->deadBranches = in.scalar<uint64_t>();
+            script->numberFormat = static_cast<NumberFormat>(in.scalar<uint8_t>());
+
+            Chunk& chunk = script->chunk;
+            chunk.constants.resize(in.count());
+            for (Value& constant : chunk.constants) {
+                ValueType type = static_cast<ValueType>(in.scalar<uint8_t>());
+                if (type == ValueType::String) {
+                    constant = Value::fromString(in.text());
+                }
+                else if (type == ValueType::Boolean) {
+                    constant = Value::fromBoolean(in.scalar<double>() != 0.0);
+                }
+                else {
+                    constant = Value::fromNumber(in.scalar<double>());
+                }
+            }
+            chunk.templates.resize(in.count());
+            for (TextTemplate& text : chunk.templates) {
+                text.segments.resize(in.count());
+                for (std::string& segment : text.segments) {
+                    segment = in.text();
+                }
+            }
+            chunk.code.resize(in.count(sizeof(Instruction)));
+            std::memcpy(chunk.code.data(), in.take(chunk.code.size() * sizeof(Instruction)), chunk.code.size() * sizeof(Instruction));
+            chunk.functions.resize(in.count());
+            for (FunctionProto& function : chunk.functions) {
+                readFunction(in, function, chunk.code.size());
+            }
+            chunk.loops.resize(in.count());
+            for (ParallelLoop& loop : chunk.loops) {
+                readFunction(in, loop.body, chunk.code.size());
+                loop.captures.resize(in.count());
+                for (auto& capture : loop.captures) {
+                    capture.first = in.scalar<int32_t>();
+                    capture.second = in.scalar<int32_t>();
+                }
+                loop.collects = in.scalar<uint8_t>() != 0;
+            }
+            script->parts.resize(in.count());
+            for (ScriptPart& part : script->parts) {
+                part.begin = 0;
+                part.end = 0;
+                part.entry = in.offset(chunk.code.size());
+                part.compileError = in.text();
+            }
+            return in.atEnd() ? script : nullptr;
+        }
+        catch (const std::runtime_error&) {
+            return nullptr;
+        }
+    }
+
+    // Goes through a temporary file, so a run starting meanwhile never maps half a cache.
+    // Failing to write is not an error; the next run just compiles again.
+    static bool store(const Script& script, const std::string& path, uint64_t key) {
+        Writer out;
+        out.count(script.symbols.size());
+        for (size_t id = 0; id < script.symbols.size(); ++id) {
+            out.text(script.symbols.name(static_cast<int32_t>(id)));
+        }
+        out.scalar(static_cast<uint64_t>(script.symbols.resolved));
+        out.scalar(static_cast<uint64_t>(script.folded));
+        out.scalar(static_cast<uint64_t>(script.propagated));
+        out.scalar(static_cast<uint64_t>(script.deadBranches));
+        out.scalar(static_cast<uint8_t>(script.numberFormat));
+
+        const Chunk& chunk = script.chunk;
+        out.count(chunk.constants.size());
+        for (const Value& constant : chunk.constants) {
+            out.scalar(static_cast<uint8_t>(constant.type));
+            if (constant.type == ValueType::String) {
+                out.text(constant.text());
+            }
+            else {
+                out.scalar(constant.number);
+            }
+        }
+        out.count(chunk.templates.size());
+        for (const TextTemplate& text : chunk.templates) {
+            out.count(text.segments.size());
+            for (const std::string& segment : text.segments) {
+                out.text(segment);
+            }
+        }
+        out.count(chunk.code.size());
+        for (const Instruction& instruction : chunk.code) {
+            // Field by field, so no stray padding bytes reach the file
+            char packed[sizeof(Instruction)] = {};
+            std::memcpy(packed + offsetof(Instruction, op), &instruction.op, sizeof(instruction.op));
+            std::memcpy(packed + offsetof(Instruction, count), &instruction.count, sizeof(instruction.count));
+            std::memcpy(packed + offsetof(Instruction, operand), &instruction.operand, sizeof(instruction.operand));
+            out.bytes.append(packed, sizeof(packed));
+        }
+        out.count(chunk.functions.size());
+        for (const FunctionProto& function : chunk.functions) {
+            writeFunction(out, function);
+        }
+        out.count(chunk.loops.size());
+        for (const ParallelLoop& loop : chunk.loops) {
+            writeFunction(out, loop.body);
+            out.count(loop.captures.size());
+            for (const auto& capture : loop.captures) {
+                out.scalar(capture.first);
+                out.scalar(capture.second);
+            }
+            out.scalar(static_cast<uint8_t>(loop.collects ? 1 : 0));
+        }
+        out.count(script.parts.size());
+        for (const ScriptPart& part : script.parts) {
+            out.scalar(static_cast<uint64_t>(part.entry));
+            out.text(part.compileError);
+        }
+
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, magic, sizeof(header.magic));
+        header.version = formatVersion;
+        header.byteOrder = byteOrderMark;
+        header.instructionSize = sizeof(Instruction);
+        header.key = key;
+        header.bodySize = out.bytes.size();
+        header.bodyHash = fnv1a(fnvOffset, out.bytes);
+
+        std::string temporary = path + ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(out.bytes.data(), static_cast<std::streamsize>(out.bytes.size()));
+            if (!file) {
+                file.close();
+                std::remove(temporary.c_str());
+                return false;
+            }
+        }
+#ifdef _WIN32
+        std::remove(path.c_str());
+#endif
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static constexpr char magic[4] = { 'H', 'Y', 'C', 'B' };
+    static constexpr uint32_t byteOrderMark = 0x01020304;
+    static constexpr uint64_t fnvOffset = 14695981039346656037ull;
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t byteOrder;         // reads back differently on a machine of the other endianness
+        uint32_t instructionSize;
+        uint64_t key;
+        uint64_t bodySize;
+        uint64_t bodyHash;          // catches a file damaged after it was written
+    };
+
+    static uint64_t fnv1a(uint64_t hash, std::string_view bytes) {
+        for (char c : bytes) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    struct Writer {
+        std::string bytes;
+
+        template <typename T>
+        void scalar(T value) {
+            bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void count(size_t value) {
+            scalar(static_cast<uint64_t>(value));
+        }
+
+        void text(std::string_view value) {
+            count(value.size());
+            bytes.append(value.data(), value.size());
+        }
+    };
+
+    // Every read is bounds checked; running off the end throws
+    class Reader {
+    public:
+        explicit Reader(std::string_view bytes) : cursor(bytes.data()), end(bytes.data() + bytes.size()) {
+        }
+
+        const char* take(size_t size) {
+            if (size > static_cast<size_t>(end - cursor)) {
+                throw std::runtime_error("Cache truncado.");
+            }
+            const char* at = cursor;
+            cursor += size;
+            return at;
+        }
+
+        template <typename T>
+        T scalar() {
+            T value;
+            std::memcpy(&value, take(sizeof(value)), sizeof(value));
+            return value;
+        }
+
+        // A count can never exceed what is left, which keeps a bad one from
+        // reserving huge vectors
+        size_t count(size_t elementSize = 1) {
+            uint64_t value = scalar<uint64_t>();
+            if (value > static_cast<uint64_t>(end - cursor) / elementSize) {
+                throw std::runtime_error("Cache truncado.");
+            }
+            return static_cast<size_t>(value);
+        }
+
+        // A position in the code
+        size_t offset(size_t codeSize) {
+            uint64_t value = scalar<uint64_t>();
+            if (value >= codeSize) {
+                throw std::runtime_error("Cache com endereo invlido.");
+            }
+            return static_cast<size_t>(value);
+        }
+
+        std::string text() {
+            size_t size = count();
+            return std::string(take(size), size);
+        }
+
+        bool atEnd() const {
+            return cursor == end;
+        }
+
+    private:
+        const char* cursor;
+        const char* end;
+    };
+
+    static void writeFunction(Writer& out, const FunctionProto& function) {
+        out.scalar(function.slot);
+        out.scalar(static_cast<uint64_t>(function.entry));
+        out.count(function.booleanParams.size());
+        for (bool boolean : function.booleanParams) {
+            out.scalar(static_cast<uint8_t>(boolean ? 1 : 0));
+        }
+        out.count(function.localNames.size());
+        for (const std::string& name : function.localNames) {
+            out.text(name);
+        }
+        out.scalar(static_cast<uint8_t>(function.pure ? 1 : 0));
+    }
+
+    static void readFunction(Reader& in, FunctionProto& function, size_t codeSize) {
+        function.slot = in.scalar<int32_t>();
+        function.entry = in.offset(codeSize);
+        function.booleanParams.resize(in.count());
+        for (size_t i = 0; i < function.booleanParams.size(); ++i) {
+            function.booleanParams[i] = in.scalar<uint8_t>() != 0;
+        }
+        function.localNames.resize(in.count());
+        for (std::string& name : function.localNames) {
+            name = in.text();
+        }
+        function.pure = in.scalar<uint8_t>() != 0;
+    }
+};
+
+class Context {
+public:
+    bool treeWalker = false;
+    bool jit = true;
+    size_t maxCallDepth = 1000;
+    size_t memoSize = 4096;             // results kept per pure function
+    NumberFormat numberFormat = NumberFormat::Fixed;    // print and text conversions; the one scripts were compiled for
+    Profiler* profiler = nullptr;       // scripts run with any of these three must be compiled
+    Metrics* metrics = nullptr;         // with line markers for their statements to be seen
+    ExecutionTrace* trace = nullptr;
+    Output output;
+
+    Context() : runtime(globals, output) {
+    }
+
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+    void run(const std::shared_ptr<const Script>& script) {
+        for (size_t part = 0; part < script->parts.size(); ++part) {
+            run(script, part);
+        }
+    }
+
+    void run(const std::shared_ptr<const Script>& script, size_t part) {
+        bind(script);
+        runtime.maxCallDepth = maxCallDepth;
+        runtime.numberFormat = numberFormat;
+        runtime.memoCapacity = memoSize;
+        runtime.profiler = profiler;
+        runtime.metrics = metrics;
+        runtime.trace = trace;
+        runtime.observed = profiler || metrics || trace;
+        if (profiler) {
+            profiler->unwind();
+        }
+        const ScriptPart& code = script->parts[part];
+        AllocationCounting counting(metrics ? &metrics->heapAllocations : nullptr);
+        try {
+            if (treeWalker && script->hasTree) {
+                runtime.run(script->program, code.begin, code.end);
+                return;
+            }
+            if (!code.compileError.empty()) {
+                throw std::runtime_error(code.compileError);
+            }
+            vm->jit = jit;
+            vm->run(code.entry);
+        }
+        catch (const ValueError& e) {
+            throw std::runtime_error(e.describe(numberFormat));
+        }
+    }
+
+    // The counters as JSON; like the counters themselves, safe to read from any thread
+    std::string metricsJson() const {
+        return metrics ? metrics->json(output.bytesWritten()) : std::string("{}\n");
+    }
+
+    bool has(const std::string& name) const {
+        int32_t slot = boundSlot(name);
+        return (slot >= 0) ? globals.variables[slot].defined : parked.count(name) != 0;
+    }
+
+    Value get(const std::string& name) const {
+        int32_t slot = boundSlot(name);
+        if (slot >= 0 && globals.variables[slot].defined) {
+            return globals.variables[slot].value;
+        }
+        auto it = parked.find(name);
+        if (it != parked.end()) {
+            return it->second;
+        }
+        throw std::runtime_error("Varivel no encontrada: " + name);
+    }
+
+    void set(const std::string& name, Value value) {
+        int32_t slot = boundSlot(name);
+        if (slot >= 0) {
+            globals.variables[slot].value = std::move(value);
+            globals.variables[slot].defined = true;
+        }
+        else {
+            parked[name] = std::move(value);
+        }
+    }
+
+private:
+    Globals globals;
+    Interpreter runtime;
+    std::unique_ptr<VirtualMachine> vm;
+    std::shared_ptr<const Script> bound;            // script the globals are laid out for
+    std::unordered_map<std::string, Value> parked;  // variables whose names it does not use
+
+    int32_t boundSlot(const std::string& name) const {
+        int32_t slot = bound ? bound->symbols.find(name) : -1;
+        return (slot >= 0 && static_cast<size_t>(slot) < globals.variables.size()) ? slot : -1;
+    }
+
+    // Variables keep their values from script to script by name. Functions belong to
+    // the script that defined them.
+    void bind(const std::shared_ptr<const Script>& script) {
+        if (script != bound) {
+            for (size_t slot = 0; slot < globals.variables.size(); ++slot) {
+                if (globals.variables[slot].defined) {
+                    parked[bound->symbols.name(static_cast<int32_t>(slot))] = std::move(globals.variables[slot].value);
+                }
+            }
+            globals.variables.clear();
+            globals.functions.clear();
+            globals.symbols = &script->symbols;
+            bound = script;
+            vm = std::make_unique<VirtualMachine>(script->chunk, runtime);
+            runtime.forgetResults();
+        }
+
+        // Parts appended since the last run may have added names
+        size_t known = globals.variables.size();
+        globals.variables.resize(script->symbols.size());
+        globals.functions.resize(script->symbols.size(), nullptr);
+        for (size_t slot = known; slot < globals.variables.size(); ++slot) {
+            auto it = parked.find(script->symbols.name(static_cast<int32_t>(slot)));
+            if (it != parked.end()) {
+                globals.variables[slot].value = std::move(it->second);
+                globals.variables[slot].defined = true;
+                parked.erase(it);
+            }
+        }
+    }
+};
+
+// What a script compiled ahead of time by --emit-cpp runs on: the values, operators,
+// builtins and output of the interpreter itself, so both print the same. The
+// generated translation unit defines HY_RUNTIME_ONLY, which leaves main out, and
+// includes this file.
+class NativeRuntime {
+public:
+    // A variable that only ever holds numbers
+    struct Number {
+        double value = 0.0;
+        bool defined = false;
+    };
+
+    // Held by every call of a compiled function: checks the depth limit on the way in
+    // and, on the way out, drops the collectors of any loop the function returned from
+    class Frame {
+    public:
+        explicit Frame(NativeRuntime& runtime) : runtime(runtime), collectorDepth(runtime.collectors.size()) {
+            runtime.interpreter.checkCallDepth(runtime.depth);
+            Interpreter::checkNativeStack(runtime.depth);
+            ++runtime.depth;
         }
 
-        const std::string& command = tokens[0];
-        if (command == "if") {
-            interpretIf(tokens);
+        ~Frame() {
+            --runtime.depth;
+            runtime.collectors.resize(collectorDepth);
         }
-        else if (command == "let") {
-            interpretLet(tokens);
+
+        Frame(const Frame&) = delete;
+        Frame& operator=(const Frame&) = delete;
+
+        // A tail call to the function itself runs the body again in this frame
+        void restart() {
+            runtime.collectors.resize(collectorDepth);
         }
-        else if (command == "print") {
-            interpretPrint(tokens);
+
+    private:
+        NativeRuntime& runtime;
+        size_t collectorDepth;
+    };
+
+    Output output;
+    int32_t pendingCall = -1;               // function a tail call left to the caller's call site
+    std::vector<Value> pendingArguments;    // its arguments
+
+    // In the number format the script was compiled for
+    explicit NativeRuntime(NumberFormat numbers = NumberFormat::Fixed) : interpreter(globals, output) {
+        interpreter.numberFormat = numbers;
+    }
+
+    NumberFormat numbers() const {
+        return interpreter.numberFormat;
+    }
+
+    // The whole program: takes --max-depth=N like the interpreter and reports an error
+    // the same way
+    int run(int argc, char* argv[], void (*script)(NativeRuntime&)) {
+        setlocale(LC_ALL, "Portuguese");
+#ifdef _WIN32
+        output.setPolicy(_isatty(1) ? FlushPolicy::Line : FlushPolicy::Full);
+#else
+        output.setPolicy(isatty(1) ? FlushPolicy::Line : FlushPolicy::Full);
+#endif
+        for (int i = 1; i < argc; ++i) {
+            std::string argument = argv[i];
+            size_t depth = 0;
+            const char* last = argument.data() + argument.size();
+            if (argument.rfind("--max-depth=", 0) != 0 || std::from_chars(argument.data() + 12, last, depth).ptr != last || depth == 0) {
+                std::cout << "Uso: " << argv[0] << " [--max-depth=N]" << std::endl;
+                return 1;
+            }
+            interpreter.maxCallDepth = depth;
         }
-        else if (command == "foreach") {
-            interpretForEach(tokens);
+
+        try {
+            script(*this);
         }
-        else if (command == "def") {
-            interpretFunction(tokens);
+        catch (const ValueError& e) {
+            output.flush();
+            std::cout << "Erro: " << e.describe(numbers()) << std::endl;
+            return 1;
+        }
+        catch (const std::exception& e) {
+            output.flush();
+            std::cout << "Erro: " << e.what() << std::endl;
+            return 1;
         }
-        else if (command == "sqrt") {
-            interpretSqrt(tokens);
+        output.flush();
+        return 0;
+    }
+
+    static double number(const Number& variable, const char* name) {
+        if (!variable.defined) {
+            throw std::runtime_error(std::string("Varivel no encontrada: ") + name);
         }
-        else if (command == "abs") {
-            interpretAbs(tokens);
+        return variable.value;
+    }
+
+    static const Value& value(const Variable& variable, const char* name) {
+        if (!variable.defined) {
+            throw std::runtime_error(std::string("Varivel no encontrada: ") + name);
         }
-        else if (command == "round") {
-            interpretRound(tokens);
+        return variable.value;
+    }
+
+    static void set(Number& variable, double value) {
+        variable.value = value;
+        variable.defined = true;
+    }
+
+    static void set(Variable& variable, Value value) {
+        variable.value = std::move(value);
+        variable.defined = true;
+    }
+
+    static double divide(double lhs, double rhs) {
+        if (rhs == 0) {
+            throw std::runtime_error("Diviso por zero.");
         }
-        else if (command == "floor") {
-            interpretFloor(tokens);
+        return lhs / rhs;
+    }
+
+    Value binary(Operator op, const Value& lhs, const Value& rhs) {
+        return interpreter.evaluateOperator(op, lhs, rhs);
+    }
+
+    bool compare(Operator op, const Value& lhs, const Value& rhs) {
+        return interpreter.compare(op, lhs, rhs);
+    }
+
+    Value iterable(const Value& value) {
+        return interpreter.toIterable(value);
+    }
+
+    // range(start, stop, step) iterated by a foreach, without a Value around it
+    static RangeData range(double start, double stop, double step) {
+        if (step == 0.0 || std::isnan(step)) {
+            throw std::runtime_error("Passo invlido em range.");
         }
-        else if (command == "ceil") {
-            interpretCeil(tokens);
+        return RangeData(start, stop, step);
+    }
+
+    // Arity was checked when the script was compiled
+    Value builtin(int32_t id, std::initializer_list<Value> arguments) {
+        interpreter.checkBuiltin(builtins[id]);
+        return builtins[id].function(arguments.begin(), arguments.size());
+    }
+
+    void print(const std::string& line) {
+        interpreter.writeLine(line);
+    }
+
+    void printResult(const Value& result) {
+        interpreter.writeResult(result);
+    }
+
+    Value convertCase(const Value& source, bool lower) const {
+        std::string str = source.toString(numbers());
+        std::transform(str.begin(), str.end(), str.begin(), lower ? ::tolower : ::toupper);
+        return Value::fromString(std::move(str));
+    }
+
+    void define() const {
+        interpreter.checkDefine();
+    }
+
+    // Iterations of a parallel foreach run one after the other, with shared state
+    // read-only as on the pool; returns the setting to restore afterwards
+    bool enterParallel() {
+        bool enclosing = interpreter.isolated;
+        interpreter.isolated = true;
+        return enclosing;
+    }
+
+    void leaveParallel(bool enclosing) {
+        interpreter.isolated = enclosing;
+    }
+
+    void beginCollect() {
+        collectors.emplace_back();
+    }
+
+    void yield(Value value) {
+        collectors.back().push_back(std::move(value));
+    }
+
+    Value endCollect() {
+        Value collected = Value::fromList(std::move(collectors.back()));
+        collectors.pop_back();
+        return collected;
+    }
+
+    // Leaves `function` to the call site, which runs it once this call has returned
+    void tailCall(int32_t function, std::initializer_list<Value> arguments) {
+        pendingCall = function;
+        pendingArguments.assign(arguments.begin(), arguments.end());
+    }
+
+    // Results of the pure functions, kept by def as the interpreter keeps them
+    bool memoKey(std::initializer_list<Value> arguments, std::string& key) const {
+        if (interpreter.memoCapacity == 0) {
+            return false;
         }
-        else if (command == "sin") {
-            interpretSin(tokens);
+        for (const Value& argument : arguments) {
+            if (!MemoCache::appendKey(argument, key)) {
+                return false;
+            }
         }
-        else if (command == "cos") {
-            interpretCos(tokens);
+        return true;
+    }
+
+    const Value* recall(size_t function, std::string_view key) {
+        if (memos.size() <= function) {
+            memos.resize(function + 1);
         }
-        else if (command == "tan") {
-            interpretTan(tokens);
+        if (!memos[function]) {
+            memos[function] = std::make_unique<MemoCache>(interpreter.memoCapacity);
         }
-        else if (command == "log") {
-            interpretLog(tokens);
+        return memos[function]->find(key);
+    }
+
+    void remember(size_t function, std::string key, const Value& result) {
+        memos[function]->store(std::move(key), result);
+    }
+
+    [[noreturn]] static void missingFunction(const char* name, bool undefined, bool wantsResult) {
+        if (undefined) {
+            throw std::runtime_error((wantsResult ? "Funo no encontrada: " : "Comando desconhecido: ") + std::string(name));
         }
-        else if (command == "exp") {
-            interpretExp(tokens);
+        throw std::runtime_error(std::string("Nmero incorreto de argumentos para a funo ") + name);
+    }
+
+    [[noreturn]] static void noResult(const char* name) {
+        throw std::runtime_error(std::string("Funo no retornou um valor: ") + name);
+    }
+
+private:
+    Globals globals;
+    Interpreter interpreter;
+    size_t depth = 0;
+    std::vector<std::vector<Value>> collectors;
+    std::vector<std::unique_ptr<MemoCache>> memos;
+};
+
+// --emit-cpp: writes a script as a C++ translation unit that runs on NativeRuntime.
+// Every variable becomes a C++ variable of its own, a double when everything stored
+// in it is known to be a number and a Value otherwise. Expressions are split into
+// temporaries in the order the VM evaluates them, each def becomes a function, and a
+// call runs the def its name is bound to at that moment, as in the VM. A tail call to
+// the function itself jumps back to the start; one to another function is left to
+// the call site, so chains of them do not grow the native stack. Parallel loops run
+// their iterations one after the other, under the same restrictions. Only the sign of
+// a NaN may come out differently: the C++ compiler is free to rearrange arithmetic
+// around one.
+class CppEmitter {
+public:
+    explicit CppEmitter(const Script& script) : script(script) {
+    }
+
+    std::string emit(const std::string& sourceName) {
+        rangeBuiltin = builtins.find("range");
+        globalNumbers.assign(script.symbols.size(), true);
+        usedBuiltins.assign(builtins.size(), false);
+        usedGlobals.assign(script.symbols.size(), false);
+        collectDefs(script.program);
+        do {
+            changed = false;
+            inferBlock(script.program, nullptr);
+        } while (changed);
+        bool anyTailCalls = false;
+        for (const Stmt* def : defs) {
+            leavesTailCalls.push_back(hasTailCalls(def->body, defIndex[def]));
+            anyTailCalls = anyTailCalls || leavesTailCalls.back();
         }
-        else if (command == "tolower") {
-            interpretToLower(tokens);
+
+        std::string compileError;
+        for (const ScriptPart& part : script.parts) {
+            if (!part.compileError.empty()) {
+                compileError = part.compileError;
+                break;
+            }
         }
-        else if (command == "toupper") {
-            interpretToUpper(tokens);
+
+        // Functions first, so the builtins and globals they use are known by the end
+        std::string functions;
+        if (compileError.empty()) {
+            for (size_t k = 0; k < defs.size(); ++k) {
+                emitFunction(k, functions);
+            }
         }
-        else if (functions.count(command)) {
-            interpretFunctionCall(tokens);
+        std::string entry;
+        sink = &entry;
+        scope = Scope{ nullptr, "" };
+        function = nullptr;
+        temps = 0;
+        line("void script(NativeRuntime& rt) {");
+        ++indent;
+        if (compileError.empty()) {
+            emitBlock(script.program);
         }
         else {
-            throw std::runtime_error("Comando desconhecido: " + command);
+            line("throw std::runtime_error(" + quote(compileError) + ");");
+        }
+        --indent;
+        line("}");
+
+        std::string out = "// Generated by hyperLanguage --emit-cpp from " + sourceName + ". Build it with the\n"
+            "// interpreter's source on the include path:\n"
+            "//   g++ -std=c++17 -O2 -pthread -I <directory of hyperLanguage.cpp> program.cpp\n"
+            "#define HY_RUNTIME_ONLY\n"
+            "#include \"hyperLanguage.cpp\"\n\n";
+        for (size_t id = 0; id < usedBuiltins.size(); ++id) {
+            if (usedBuiltins[id]) {
+                out += "const int32_t " + builtinName(static_cast<int32_t>(id)) + " = builtins.find(" + quote(builtins[static_cast<int32_t>(id)].name) + ");\n";
+            }
         }
+        for (size_t slot = 0; slot < script.symbols.size(); ++slot) {
+            if (usedGlobals[slot]) {
+                out += std::string(globalNumbers[slot] ? "NativeRuntime::Number " : "Variable ") + globalName(static_cast<int32_t>(slot)) + ";\n";
+            }
+        }
+        for (const auto& bound : defsBySlot) {
+            out += "int32_t " + boundName(bound.first) + " = -1;\n";
+        }
+        out += '\n';
+        for (size_t k = 0; k < defs.size(); ++k) {
+            out += signature(k) + ";\n";
+        }
+        if (anyTailCalls) {
+            out += "Value resume(NativeRuntime& rt, bool wantsResult);\n";
+        }
+        out += '\n';
+        out += functions;
+        if (anyTailCalls) {
+            out += resumeFunction();
+        }
+        out += entry;
+        out += "\nint main(int argc, char* argv[]) {\n";
+        out += (script.numberFormat == NumberFormat::Shortest) ? "    NativeRuntime runtime(NumberFormat::Shortest);\n" : "    NativeRuntime runtime;\n";
+        out += "    return runtime.run(argc, argv, script);\n"
+            "}\n";
+        return out;
     }
 
-    std::vector<std::string> split(const std::string& str, char delimiter) {
-        std::vector<std::string> tokens;
-        std::stringstream ss(str);
-        std::string token;
-        bool inQuotes = false;
+private:
+    enum class Type {
+        Number,
+        Boolean,
+        Value
+    };
 
-        while (std::getline(ss, token, delimiter)) {
-            if (!inQuotes) {
-                // Remove leading and trailing whitespace
-                token.erase(token.begin(), std::find_if(token.begin(), token.end(), [](int ch) {
-                    return !std::isspace(ch);
-                    }));
-                token.erase(std::find_if(token.rbegin(), token.rend(), [](int ch) {
-                    return !std::isspace(ch);
-                    }).base(), token.end());
+    // A C++ expression holding the result of a script expression, used exactly once
+    struct Operand {
+        std::string code;
+        Type type;
+        bool temporary = false;     // a Value temporary, moved from when used
+    };
 
-                if (!token.empty()) {
-                    tokens.push_back(token);
+    // The frame locals resolve against: a def, the body of a parallel foreach, or the
+    // top level when owner is null
+    struct Scope {
+        const Stmt* owner;
+        std::string prefix;
+    };
+
+    const Script& script;
+    int32_t rangeBuiltin = -1;
+    std::vector<bool> globalNumbers;                                    // by slot
+    std::unordered_map<const Stmt*, std::vector<bool>> localNumbers;    // by frame owner, then local
+    std::vector<const Stmt*> defs;                                      // a def's index names its function
+    std::map<int32_t, std::vector<size_t>> defsBySlot;
+    std::vector<bool> usedBuiltins;
+    std::vector<bool> usedGlobals;                                      // by slot
+    std::unordered_map<const Stmt*, size_t> defIndex;
+    std::vector<bool> leavesTailCalls;                                  // by def: may leave a call to its call site
+    bool changed = false;
+
+    std::string* sink = nullptr;
+    size_t indent = 0;
+    size_t temps = 0;
+    Scope scope{ nullptr, "" };
+    const Stmt* function = nullptr;     // def being emitted
+    size_t functionIndex = 0;
+    bool usesDone = false;
+    bool usesRestart = false;
+    size_t parallelBodies = 0;
+
+    void collectDefs(const std::vector<StmtPtr>& block) {
+        for (const StmtPtr& stmt : block) {
+            if (stmt->kind == StmtKind::Def) {
+                defsBySlot[stmt->slot].push_back(defs.size());
+                defIndex[stmt.get()] = defs.size();
+                defs.push_back(stmt.get());
+                std::vector<bool>& numbers = localNumbers[stmt.get()];
+                numbers.assign(stmt->locals.size(), true);
+                for (size_t i = 0; i < stmt->booleanParams.size(); ++i) {
+                    numbers[i] = !stmt->booleanParams[i];
                 }
             }
-            else {
-                tokens.back() += delimiter + token;
+            else if (stmt->kind == StmtKind::ForEach && stmt->parallel) {
+                localNumbers[stmt.get()].assign(stmt->locals.size(), true);
             }
+            collectDefs(stmt->body);
+            collectDefs(stmt->elseBody);
+        }
+    }
 
-            if (token.front() == '"' && token.back() == '"') {
-                inQuotes = false;
+    // Whether a "return f(...)" in the body may call another def than `self`
+    bool hasTailCalls(const std::vector<StmtPtr>& block, size_t self) const {
+        for (const StmtPtr& stmt : block) {
+            if (stmt->kind == StmtKind::Return && stmt->value && Interpreter::isTailCall(*stmt->value)) {
+                for (size_t k : callable(stmt->value->slot, stmt->value->operands.size())) {
+                    if (k != self) {
+                        return true;
+                    }
+                }
             }
-            else if (token.front() == '"' && token.back() != '"') {
-                inQuotes = true;
+            if (stmt->kind != StmtKind::Def && (hasTailCalls(stmt->body, self) || hasTailCalls(stmt->elseBody, self))) {
+                return true;
             }
         }
+        return false;
+    }
 
-        return tokens;
+    // Types: every variable starts out as a number and is widened to a Value once
+    // something else may be stored in it, until nothing changes
+
+    void widen(const Stmt* owner, int32_t local, int32_t slot, Type type) {
+        if (type == Type::Number) {
+            return;
+        }
+        std::vector<bool>::reference number = (local >= 0) ? localNumbers[owner][local] : globalNumbers[slot];
+        if (number) {
+            number = false;
+            changed = true;
+        }
     }
 
-    std::string join(const std::vector<std::string>& tokens, char delimiter) {
-        std::stringstream ss;
-        for (size_t i = 0; i < tokens.size(); ++i) {
-            if (i != 0) {
-                ss << delimiter;
+    bool isNumber(const Stmt* owner, int32_t local, int32_t slot) {
+        return (local >= 0) ? localNumbers[owner][local] : globalNumbers[slot];
+    }
+
+    void inferBlock(const std::vector<StmtPtr>& block, const Stmt* owner) {
+        for (const StmtPtr& stmt : block) {
+            if (stmt->value) {
+                inferCalls(*stmt->value, owner);
+            }
+            for (const ExprPtr& argument : stmt->args) {
+                inferCalls(*argument, owner);
+            }
+
+            switch (stmt->kind) {
+            case StmtKind::Let:
+                widen(owner, stmt->local, stmt->slot, typeOf(*stmt->value, owner));
+                break;
+            case StmtKind::If:
+                inferBlock(stmt->body, owner);
+                inferBlock(stmt->elseBody, owner);
+                break;
+            case StmtKind::ForEach: {
+                Type element = isRange(*stmt->value) ? Type::Number : Type::Value;
+                if (stmt->parallel) {
+                    widen(stmt.get(), 0, -1, element);
+                    for (const auto& capture : stmt->captures) {
+                        widen(stmt.get(), capture.second, -1, isNumber(owner, capture.first, -1) ? Type::Number : Type::Value);
+                    }
+                    inferBlock(stmt->body, stmt.get());
+                }
+                else {
+                    widen(owner, stmt->local, stmt->slot, element);
+                    inferBlock(stmt->body, owner);
+                }
+                if (!stmt->collect.empty()) {
+                    widen(owner, stmt->collectLocal, stmt->collectSlot, Type::Value);
+                }
+                break;
+            }
+            case StmtKind::Def:
+                inferBlock(stmt->body, stmt.get());
+                break;
+            case StmtKind::Return:
+                if (stmt->value) {
+                    widen(owner, stmt->local, -1, typeOf(*stmt->value, owner));
+                }
+                break;
+            case StmtKind::Call:
+                inferArguments(stmt->slot, stmt->args, owner);
+                break;
+            case StmtKind::ToLower:
+            case StmtKind::ToUpper:
+                widen(owner, stmt->local, stmt->slot, Type::Value);
+                break;
+            case StmtKind::Print:
+            case StmtKind::BuiltinCommand:
+            case StmtKind::Yield:
+                break;
             }
-            ss << tokens[i];
         }
-        return ss.str();
     }
 
-    void interpretIf(const std::vector<std::string>& tokens) {
-        if (tokens.size() < 4 || tokens[2] != "then") {
-            throw std::runtime_error("Sintaxe incorreta para o comando 'if'.");
+    void inferCalls(const Expr& expr, const Stmt* owner) {
+        for (const ExprPtr& operand : expr.operands) {
+            inferCalls(*operand, owner);
+        }
+        if (expr.kind == ExprKind::Call && expr.builtin < 0) {
+            inferArguments(expr.slot, expr.operands, owner);
         }
+    }
 
-        const std::string& condition = tokens[1];
-        const std::vector<std::string>& ifBlock = getBlock(tokens, 3, "endif");
-        const std::vector<std::string>& elseBlock = getBlock(tokens, 3 + ifBlock.size() + 1, "endif");
+    // Parameters take the types of the arguments of every call that may reach them
+    void inferArguments(int32_t slot, const std::vector<ExprPtr>& arguments, const Stmt* owner) {
+        for (size_t k : callable(slot, arguments.size())) {
+            for (size_t i = 0; i < arguments.size(); ++i) {
+                widen(defs[k], static_cast<int32_t>(i), -1, typeOf(*arguments[i], owner));
+            }
+        }
+    }
 
-        if (evaluateCondition(condition)) {
-            interpret(ifBlock);
+    // The defs a call with `count` arguments may run
+    std::vector<size_t> callable(int32_t slot, size_t count) const {
+        std::vector<size_t> found;
+        auto it = defsBySlot.find(slot);
+        if (it != defsBySlot.end()) {
+            for (size_t k : it->second) {
+                if (defs[k]->params.size() == count) {
+                    found.push_back(k);
+                }
+            }
         }
-        else {
-            if (!elseBlock.empty()) {
-                interpret(elseBlock);
+        return found;
+    }
+
+    bool resultIsNumber(size_t k) {
+        return localNumbers[defs[k]][defs[k]->params.size()];
+    }
+
+    static bool isComparison(Operator op) {
+        return op == Operator::Equal || op == Operator::NotEqual || op == Operator::Less || op == Operator::LessEqual || op == Operator::Greater || op == Operator::GreaterEqual;
+    }
+
+    bool isRange(const Expr& expr) const {
+        return expr.kind == ExprKind::Call && expr.builtin >= 0 && expr.builtin == rangeBuiltin;
+    }
+
+    Type typeOf(const Expr& expr, const Stmt* owner) {
+        switch (expr.kind) {
+        case ExprKind::Number:
+        case ExprKind::Unary:
+            return Type::Number;
+        case ExprKind::Boolean:
+            return Type::Boolean;
+        case ExprKind::String:
+        case ExprKind::FString:
+        case ExprKind::List:
+            return Type::Value;
+        case ExprKind::Variable:
+            return isNumber(owner, expr.local, expr.slot) ? Type::Number : Type::Value;
+        case ExprKind::Binary:
+            if (isComparison(expr.op)) {
+                return Type::Boolean;
+            }
+            // Only a list on either side keeps arithmetic from giving a number
+            return (typeOf(*expr.operands[0], owner) != Type::Value && typeOf(*expr.operands[1], owner) != Type::Value) ? Type::Number : Type::Value;
+        case ExprKind::Call:
+            if (expr.builtin >= 0) {
+                return builtinType(expr, owner);
             }
+            return callType(expr.slot, expr.operands.size());
         }
+        return Type::Value;
     }
 
-    double getVariableValue(const std::string& variable) {
-        if (isNumber(variable)) {
-            return std::stod(variable);
+    Type builtinType(const Expr& call, const Stmt* owner) {
+        const Builtin& builtin = builtins[call.builtin];
+        if (builtin.numeric && call.operands.size() == 1 && typeOf(*call.operands[0], owner) != Type::Value) {
+            return Type::Number;
         }
+        return returnsNumber(builtin) ? Type::Number : Type::Value;
+    }
+
+    // Builtins whose result is a number whatever their arguments
+    static bool returnsNumber(const Builtin& builtin) {
+        static const char* const numeric[] = { "len", "sum", "min", "max", "mean" };
+        return std::find(std::begin(numeric), std::end(numeric), builtin.name) != std::end(numeric);
+    }
+
+    Type callType(int32_t slot, size_t count) {
+        std::vector<size_t> targets = callable(slot, count);
+        if (targets.empty()) {
+            return Type::Value;
+        }
+        for (size_t k : targets) {
+            if (!resultIsNumber(k)) {
+                return Type::Value;
+            }
+        }
+        return Type::Number;
+    }
 
-        if (variables.count(variable)) {
-            return std::stod(variables[variable]);
+    // Names
+
+    static std::string identifier(const std::string& name) {
+        std::string id;
+        for (char c : name) {
+            id += (std::isalnum(static_cast<unsigned char>(c)) && static_cast<unsigned char>(c) < 0x80) ? c : '_';
         }
+        return id;
+    }
+
+    std::string globalName(int32_t slot) const {
+        return "g" + std::to_string(slot) + "_" + identifier(script.symbols.name(slot));
+    }
 
-        throw std::runtime_error("Varivel no encontrada: " + variable);
+    std::string boundName(int32_t slot) const {
+        return "bound" + std::to_string(slot) + "_" + identifier(script.symbols.name(slot));
     }
 
-    bool evaluateCondition(const std::string& condition) {
-        std::vector<std::string> tokens = split(condition, ' ');
-        std::string lhs = tokens[0];
-        std::string op = tokens[1];
-        std::string rhs = tokens[2];
+    std::string functionName(size_t k) const {
+        return "f" + std::to_string(k) + "_" + identifier(defs[k]->name);
+    }
 
-        double lhsValue = getVariableValue(lhs);
-        double rhsValue = getVariableValue(rhs);
+    std::string builtinName(int32_t id) const {
+        return "builtin_" + identifier(builtins[id].name);
+    }
 
-        if (op == "==") {
-            return lhsValue == rhsValue;
+    std::string localName(const Scope& frame, int32_t local) const {
+        return frame.prefix + std::to_string(local) + "_" + identifier(frame.owner->locals[local]);
+    }
+
+    struct Storage {
+        std::string name;       // the C++ variable
+        std::string text;       // the script's name, for errors
+        bool number;
+    };
+
+    Storage variable(int32_t local, int32_t slot) {
+        if (local >= 0) {
+            return Storage{ localName(scope, local), scope.owner->locals[local], localNumbers[scope.owner][local] };
         }
-        else if (op == "!=") {
-            return lhsValue != rhsValue;
+        usedGlobals[slot] = true;
+        return Storage{ globalName(slot), script.symbols.name(slot), globalNumbers[slot] };
+    }
+
+    static std::string quote(const std::string& text) {
+        std::string out = "\"";
+        for (char c : text) {
+            unsigned char byte = static_cast<unsigned char>(c);
+            if (c == '"' || c == '\\' || c == '?') {
+                out += '\\';
+                out += c;
+            }
+            else if (byte >= 0x20 && byte < 0x7F) {
+                out += c;
+            }
+            else {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\%03o", byte);
+                out += escape;
+            }
         }
-        else if (op == ">") {
-            return lhsValue > rhsValue;
+        return out + "\"";
+    }
+
+    static std::string numberLiteral(double value) {
+        if (std::isnan(value)) {
+            return std::signbit(value) ? "-std::nan(\"\")" : "std::nan(\"\")";
         }
-        else if (op == ">=") {
-            return lhsValue >= rhsValue;
+        if (std::isinf(value)) {
+            return (value < 0) ? "-HUGE_VAL" : "HUGE_VAL";
         }
-        else if (op == "<") {
-            return lhsValue < rhsValue;
+        char buffer[64];
+        std::string text(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+        if (text.find_first_of(".e") == std::string::npos) {
+            text += ".0";
         }
-        else if (op == "<=") {
-            return lhsValue <= rhsValue;
+        return text;
+    }
+
+    // Output
+
+    void line(const std::string& text) {
+        sink->append(indent * 4, ' ');
+        *sink += text;
+        *sink += '\n';
+    }
+
+    std::string temp() {
+        return "t" + std::to_string(temps++);
+    }
+
+    Operand declare(Type type, const std::string& init) {
+        std::string name = temp();
+        line(std::string(type == Type::Number ? "double " : type == Type::Boolean ? "bool " : "Value ") + name + " = " + init + ";");
+        return Operand{ name, type, type == Type::Value };
+    }
+
+    static std::string asNumber(const Operand& operand) {
+        switch (operand.type) {
+        case Type::Number:
+            return operand.code;
+        case Type::Boolean:
+            return "(" + operand.code + " ? 1.0 : 0.0)";
+        case Type::Value:
+            break;
         }
-        else {
-            throw std::runtime_error("Operador desconhecido: " + op);
+        return operand.code + ".toNumber()";
+    }
+
+    static std::string asValue(const Operand& operand) {
+        switch (operand.type) {
+        case Type::Number:
+            return "Value::fromNumber(" + operand.code + ")";
+        case Type::Boolean:
+            return "Value::fromBoolean(" + operand.code + ")";
+        case Type::Value:
+            break;
         }
+        return operand.temporary ? "std::move(" + operand.code + ")" : operand.code;
     }
 
-    void interpretLet(const std::vector<std::string>& tokens) {
-        if (tokens.size() < 4 || tokens[2] != "=") {
-            throw std::runtime_error("Sintaxe incorreta para o comando 'let'.");
+    static std::string asCondition(const Operand& operand) {
+        switch (operand.type) {
+        case Type::Number:
+            return operand.code + " != 0.0";
+        case Type::Boolean:
+            return operand.code;
+        case Type::Value:
+            break;
         }
+        return operand.code + ".isTruthy()";
+    }
 
-        std::string variable = tokens[1];
-        std::string valueStr = join(std::vector<std::string>(tokens.begin() + 3, tokens.end()), ' ');
+    void store(int32_t local, int32_t slot, const Operand& operand) {
+        Storage target = variable(local, slot);
+        line("NativeRuntime::set(" + target.name + ", " + (target.number ? asNumber(operand) : asValue(operand)) + ");");
+    }
 
-        if (valueStr.front() == '"' && valueStr.back() == '"') {
-            // Valor de texto (string)
-            std::string value = valueStr.substr(1, valueStr.size() - 2);
-            variables[variable] = value;
+    Operand load(int32_t local, int32_t slot) {
+        Storage source = variable(local, slot);
+        if (source.number) {
+            return declare(Type::Number, "NativeRuntime::number(" + source.name + ", " + quote(source.text) + ")");
         }
-        else if (valueStr == "true" || valueStr == "false") {
-            // Valor booleano
-            bool value = (valueStr == "true");
-            variables[variable] = (value ? "true" : "false");
+        return declare(Type::Value, "NativeRuntime::value(" + source.name + ", " + quote(source.text) + ")");
+    }
+
+    // Functions
+
+    std::string signature(size_t k) {
+        const Stmt& def = *defs[k];
+        std::string text = std::string(resultIsNumber(k) ? "double " : "Value ") + functionName(k) + "(NativeRuntime& rt, bool wantsResult";
+        for (size_t i = 0; i < def.params.size(); ++i) {
+            text += std::string(localNumbers[&def][i] ? ", double a" : ", Value a") + std::to_string(i);
         }
-        else {
-            // Valor numrico
-            try {
-                double value = std::stod(valueStr);
-                variables[variable] = std::to_string(value);
+        return text + ")";
+    }
+
+    void emitFunction(size_t k, std::string& out) {
+        const Stmt& def = *defs[k];
+        std::string body;
+        sink = &body;
+        indent = 2;
+        temps = 0;
+        scope = Scope{ &def, "l" };
+        function = &def;
+        functionIndex = k;
+        usesDone = false;
+        usesRestart = false;
+        emitBlock(def.body);
+
+        sink = &out;
+        indent = 0;
+        line(signature(k) + " {");
+        ++indent;
+        line("NativeRuntime::Frame frame(rt);");
+        const std::vector<bool>& numbers = localNumbers[&def];
+        // A result a tail call leaves to the call site is not this function's to remember
+        bool memoized = def.pure && !leavesTailCalls[k];
+        if (memoized) {
+            std::string arguments;
+            for (size_t i = 0; i < def.params.size(); ++i) {
+                arguments += (i == 0) ? " " : ", ";
+                arguments += numbers[i] ? "Value::fromNumber(a" + std::to_string(i) + ")" : "a" + std::to_string(i);
             }
-            catch (const std::exception&) {
-                throw std::runtime_error("Valor invlido para atribuio.");
+            line("std::string key;");
+            line("bool memoized = wantsResult && rt.memoKey({" + arguments + (arguments.empty() ? "}, key);" : " }, key);"));
+            line("if (memoized) {");
+            line("    if (const Value* cached = rt.recall(" + std::to_string(k) + ", key)) {");
+            line(std::string("        return ") + (numbers[def.params.size()] ? "cached->number;" : "*cached;"));
+            line("    }");
+            line("}");
+        }
+        for (size_t i = 0; i < def.locals.size(); ++i) {
+            std::string type = numbers[i] ? "NativeRuntime::Number " : "Variable ";
+            std::string name = localName(scope, static_cast<int32_t>(i));
+            if (i < def.params.size()) {
+                line(type + name + "{ " + (numbers[i] ? "a" + std::to_string(i) : "std::move(a" + std::to_string(i) + ")") + ", true };");
+            }
+            else {
+                line(type + name + ";");
+            }
+        }
+        if (usesRestart) {
+            --indent;
+            line("restart:");
+            ++indent;
+        }
+        line("{");
+        out += body;
+        line("}");
+        if (usesDone) {
+            --indent;
+            line("done:");
+            ++indent;
+        }
+
+        std::string result = localName(scope, static_cast<int32_t>(def.params.size()));
+        line("if (!" + result + ".defined) {");
+        line("    if (wantsResult) {");
+        line("        NativeRuntime::noResult(" + quote(def.name) + ");");
+        line("    }");
+        line(std::string("    return ") + (numbers[def.params.size()] ? "0.0;" : "Value();"));
+        line("}");
+        if (memoized) {
+            line("if (memoized) {");
+            line("    rt.remember(" + std::to_string(k) + ", std::move(key), " + (numbers[def.params.size()] ? "Value::fromNumber(" + result + ".value)" : result + ".value") + ");");
+            line("}");
+        }
+        line("return " + (numbers[def.params.size()] ? result + ".value;" : "std::move(" + result + ".value);"));
+        --indent;
+        line("}");
+        line("");
+    }
+
+    // Runs the functions tail calls leave to a call site until one returns for good
+    std::string resumeFunction() {
+        std::string out;
+        sink = &out;
+        indent = 0;
+        line("Value resume(NativeRuntime& rt, bool wantsResult) {");
+        line("    Value result;");
+        line("    while (rt.pendingCall >= 0) {");
+        line("        int32_t function = rt.pendingCall;");
+        line("        std::vector<Value> arguments = std::move(rt.pendingArguments);");
+        line("        rt.pendingCall = -1;");
+        line("        switch (function) {");
+        for (size_t k = 0; k < defs.size(); ++k) {
+            std::string call = functionName(k) + "(rt, wantsResult";
+            for (size_t i = 0; i < defs[k]->params.size(); ++i) {
+                std::string argument = "arguments[" + std::to_string(i) + "]";
+                call += ", " + (localNumbers[defs[k]][i] ? argument + ".number" : "std::move(" + argument + ")");
+            }
+            call += ")";
+            line("        case " + std::to_string(k) + ":");
+            line("            result = " + (resultIsNumber(k) ? "Value::fromNumber(" + call + ")" : call) + ";");
+            line("            break;");
+        }
+        line("        }");
+        line("    }");
+        line("    return result;");
+        line("}");
+        line("");
+        return out;
+    }
+
+    // The argument list of a call to def k, converted to its parameter types
+    std::string argumentsFor(size_t k, const std::vector<Operand>& arguments) {
+        std::string text;
+        for (size_t i = 0; i < arguments.size(); ++i) {
+            text += ", ";
+            if (defs[k]->booleanParams[i]) {
+                text += "Value::fromBoolean(" + asCondition(arguments[i]) + ")";
+            }
+            else {
+                text += localNumbers[defs[k]][i] ? asNumber(arguments[i]) : asValue(arguments[i]);
             }
         }
+        return text;
     }
 
-    double evaluateExpression(const std::string& expression) {
-        std::vector<std::string> tokens = split(expression, ' ');
-
-        // Check for function calls
-        if (tokens.size() > 1 && functions.count(tokens[0])) {
-            return evaluateFunctionCall(tokens);
+    std::vector<Operand> evaluateAll(const std::vector<ExprPtr>& expressions) {
+        std::vector<Operand> operands;
+        for (const ExprPtr& expr : expressions) {
+            operands.push_back(expression(*expr));
         }
-
-        // Check for arithmetic expressions
-        std::vector<std::string> postfix = infixToPostfix(tokens);
-        return evaluatePostfix(postfix);
+        return operands;
     }
 
-    std::vector<std::string> infixToPostfix(const std::vector<std::string>& infix) {
-        std::vector<std::string> postfix;
-        std::vector<std::string> operators;
+    // A call to whatever def `slot` is bound to when it runs
+    Operand call(int32_t slot, const std::vector<ExprPtr>& argumentExprs, bool wantsResult) {
+        std::vector<Operand> arguments = evaluateAll(argumentExprs);
+        std::vector<size_t> targets = callable(slot, arguments.size());
+        std::string name = quote(script.symbols.name(slot));
+        Type type = callType(slot, arguments.size());
+        Operand result{ "", type, type == Type::Value };
+        if (wantsResult) {
+            result.code = temp();
+            line(std::string(type == Type::Number ? "double " : "Value ") + result.code + (type == Type::Number ? " = 0.0;" : ";"));
+        }
+        if (defsBySlot.find(slot) == defsBySlot.end()) {
+            line("NativeRuntime::missingFunction(" + name + ", true, " + (wantsResult ? "true" : "false") + ");");
+            return result;
+        }
 
-        for (const std::string& token : infix) {
-            if (isNumber(token)) {
-                postfix.push_back(token);
+        std::string bound = boundName(slot);
+        line("switch (" + bound + ") {");
+        for (size_t k : targets) {
+            std::string invocation = functionName(k) + "(rt, " + (wantsResult ? "true" : "false") + argumentsFor(k, arguments) + ")";
+            line("case " + std::to_string(k) + ":");
+            if (wantsResult) {
+                bool convert = type == Type::Value && resultIsNumber(k);
+                line("    " + result.code + " = " + (convert ? "Value::fromNumber(" + invocation + ")" : invocation) + ";");
+            }
+            else {
+                line("    " + invocation + ";");
             }
-            else if (isFunction(token)) {
-                operators.push_back(token);
+            line("    break;");
+        }
+        line("default:");
+        line("    NativeRuntime::missingFunction(" + name + ", " + bound + " < 0, " + (wantsResult ? "true" : "false") + ");");
+        line("}");
+        bool leaves = false;
+        for (size_t k : targets) {
+            leaves = leaves || leavesTailCalls[k];
+        }
+        if (leaves) {
+            line("if (rt.pendingCall >= 0) {");
+            if (wantsResult) {
+                line("    " + result.code + " = resume(rt, true)" + (type == Type::Number ? ".number;" : ";"));
             }
-            else if (token == "(") {
-                operators.push_back(token);
+            else {
+                line("    resume(rt, false);");
             }
-            else if (token == ")") {
-                while (!operators.empty() && operators.back() != "(") {
-                    postfix.push_back(operators.back());
-                    operators.pop_back();
-                }
+            line("}");
+        }
+        return result;
+    }
 
-                if (operators.empty() || operators.back() != "(") {
-                    throw std::runtime_error("Expresso invlida: parnteses no correspondentes.");
-                }
+    // "return f(...)": the function itself starts over; any other is left to the call site
+    void tailCall(const Expr& callee) {
+        std::vector<Operand> arguments = evaluateAll(callee.operands);
+        std::vector<size_t> targets = callable(callee.slot, arguments.size());
+        std::string name = quote(script.symbols.name(callee.slot));
+        if (defsBySlot.find(callee.slot) == defsBySlot.end()) {
+            line("NativeRuntime::missingFunction(" + name + ", true, true);");
+            return;
+        }
 
-                operators.pop_back();  // Remove the "("
+        std::string bound = boundName(callee.slot);
+        line("switch (" + bound + ") {");
+        for (size_t k : targets) {
+            line("case " + std::to_string(k) + ":");
+            ++indent;
+            if (k == functionIndex) {
+                restart(arguments);
             }
             else {
-                while (!operators.empty() && getPrecedence(operators.back()) >= getPrecedence(token)) {
-                    postfix.push_back(operators.back());
-                    operators.pop_back();
+                std::string packed;
+                for (size_t i = 0; i < arguments.size(); ++i) {
+                    packed += (i == 0) ? " " : ", ";
+                    packed += defs[k]->booleanParams[i] ? "Value::fromBoolean(" + asCondition(arguments[i]) + ")" : asValue(arguments[i]);
                 }
-
-                operators.push_back(token);
-            }
-        }
-
-        while (!operators.empty()) {
-            if (operators.back() == "(") {
-                throw std::runtime_error("Expresso invlida: parnteses no correspondentes.");
+                line("rt.tailCall(" + std::to_string(k) + ", {" + packed + (packed.empty() ? "});" : " });"));
+                line(std::string("return ") + (resultIsNumber(functionIndex) ? "0.0;" : "Value();"));
             }
-
-            postfix.push_back(operators.back());
-            operators.pop_back();
+            --indent;
         }
-
-        return postfix;
+        line("default:");
+        line("    NativeRuntime::missingFunction(" + name + ", " + bound + " < 0, true);");
+        line("}");
     }
 
-    double evaluatePostfix(const std::vector<std::string>& postfix) {
-        std::vector<double> stack;
-
-        for (const std::string& token : postfix) {
-            if (isNumber(token)) {
-                stack.push_back(std::stod(token));
+    void restart(const std::vector<Operand>& arguments) {
+        const Stmt& def = *function;
+        const std::vector<bool>& numbers = localNumbers[&def];
+        for (size_t i = 0; i < def.locals.size(); ++i) {
+            std::string name = localName(scope, static_cast<int32_t>(i));
+            if (i >= arguments.size()) {
+                line(name + " = {};");
             }
-            else if (isFunction(token)) {
-                if (stack.empty()) {
-                    throw std::runtime_error("Expresso invlida: funo sem argumentos.");
-                }
-
-                double arg = stack.back();
-                stack.pop_back();
-
-                double result = evaluateFunction(token, arg);
-                stack.push_back(result);
+            else if (def.booleanParams[i]) {
+                line(name + " = { Value::fromBoolean(" + asCondition(arguments[i]) + "), true };");
             }
             else {
-                if (stack.size() < 2) {
-                    throw std::runtime_error("Expresso invlida: operador sem operandos suficientes.");
-                }
-
-                double rhs = stack.back();
-                stack.pop_back();
-
-                double lhs = stack.back();
-                stack.pop_back();
-
-                double result = evaluateOperator(token, lhs, rhs);
-                stack.push_back(result);
+                line(name + " = { " + (numbers[i] ? asNumber(arguments[i]) : asValue(arguments[i])) + ", true };");
             }
         }
-
-        if (stack.size() != 1) {
-            throw std::runtime_error("Expresso invlida: sobraram valores na pilha.");
-        }
-
-        return stack.back();
+        line("frame.restart();");
+        line("goto restart;");
+        usesRestart = true;
     }
 
-    double evaluateFunction(const std::string& function, double arg) {
-        if (function == "sqrt") {
-            return std::sqrt(arg);
-        }
-        else if (function == "abs") {
-            return std::abs(arg);
-        }
-        else if (function == "round") {
-            return std::round(arg);
-        }
-        else if (function == "floor") {
-            return std::floor(arg);
-        }
-        else if (function == "ceil") {
-            return std::ceil(arg);
+    // Expressions
+
+    Operand expression(const Expr& expr) {
+        switch (expr.kind) {
+        case ExprKind::Number:
+            return Operand{ numberLiteral(expr.literal.number), Type::Number };
+        case ExprKind::Boolean:
+            return Operand{ expr.literal.number != 0.0 ? "true" : "false", Type::Boolean };
+        case ExprKind::String:
+            return declare(Type::Value, "Value::fromString(" + quote(expr.literal.text()) + ")");
+        case ExprKind::FString: {
+            std::string text = temp();
+            line("std::string " + text + ";");
+            std::string literal;
+            appendItem(expr, text, literal);
+            flushLiteral(text, literal);
+            return declare(Type::Value, "Value::fromString(std::move(" + text + "))");
         }
-        else if (function == "sin") {
-            return std::sin(arg);
+        case ExprKind::Variable:
+            return load(expr.local, expr.slot);
+        case ExprKind::List: {
+            std::vector<Operand> items = evaluateAll(expr.operands);
+            std::string list;
+            for (const Operand& item : items) {
+                list += list.empty() ? " " : ", ";
+                list += asValue(item);
+            }
+            return declare(Type::Value, "Value::fromList({" + list + (list.empty() ? "})" : " })"));
         }
-        else if (function == "cos") {
-            return std::cos(arg);
+        case ExprKind::Unary:
+            return declare(Type::Number, "-" + asNumber(expression(*expr.operands[0])));
+        case ExprKind::Binary:
+            return binary(expr);
+        case ExprKind::Call:
+            if (expr.builtin >= 0) {
+                return builtinCall(expr.builtin, expr.operands);
+            }
+            return call(expr.slot, expr.operands, true);
         }
-        else if (function == "tan") {
-            return std::tan(arg);
+        throw std::runtime_error("Expresso invlida.");
+    }
+
+    Operand binary(const Expr& expr) {
+        static const char* const operators[] = { "Add", "Subtract", "Multiply", "Divide", "Power", "Equal", "NotEqual", "Less", "LessEqual", "Greater", "GreaterEqual" };
+        static const char* const symbols[] = { "+", "-", "*", "/", "", "==", "!=", "<", "<=", ">", ">=" };
+        size_t op = static_cast<size_t>(expr.op);
+        Operand lhs = expression(*expr.operands[0]);
+        Operand rhs = expression(*expr.operands[1]);
+        bool numbers = lhs.type != Type::Value && rhs.type != Type::Value;
+        std::string viaValues = "(Operator::" + std::string(operators[op]) + ", " + asValue(lhs) + ", " + asValue(rhs) + ")";
+        if (isComparison(expr.op)) {
+            if (numbers) {
+                return declare(Type::Boolean, asNumber(lhs) + " " + symbols[op] + " " + asNumber(rhs));
+            }
+            return declare(Type::Boolean, "rt.compare" + viaValues);
         }
-        else if (function == "log") {
-            return std::log(arg);
+        if (!numbers) {
+            return declare(Type::Value, "rt.binary" + viaValues);
         }
-        else if (function == "exp") {
-            return std::exp(arg);
+        if (expr.op == Operator::Divide) {
+            return declare(Type::Number, "NativeRuntime::divide(" + asNumber(lhs) + ", " + asNumber(rhs) + ")");
         }
-        else {
-            throw std::runtime_error("Funo desconhecida: " + function);
+        if (expr.op == Operator::Power) {
+            return declare(Type::Number, "std::pow(" + asNumber(lhs) + ", " + asNumber(rhs) + ")");
         }
+        return declare(Type::Number, asNumber(lhs) + " " + symbols[op] + " " + asNumber(rhs));
     }
 
-    std::vector<std::string> getBlock(const std::vector<std::string>& tokens, size_t startIndex, const std::string& endCommand) {
-        std::vector<std::string> block;
-        int nestingLevel = 0;
-        bool foundEndCommand = false;
-
-        for (size_t i = startIndex; i < tokens.size(); ++i) {
-            const std::string& token = tokens[i];
-
-            if (token == endCommand) {
-                if (nestingLevel == 0) {
-                    foundEndCommand = true;
-                    break;
-                }
-                else {
-                    --nestingLevel;
-                }
-            }
-            else if (token == "if" || token == "elseif" || token == "else") {
-                ++nestingLevel;
+    Operand builtinCall(int32_t id, const std::vector<ExprPtr>& argumentExprs) {
+        std::vector<Operand> arguments = evaluateAll(argumentExprs);
+        const Builtin& builtin = builtins[id];
+        if (builtin.numeric && arguments.size() == 1 && arguments[0].type != Type::Value) {
+            static const char* const direct[] = { "sqrt", "abs", "round", "floor", "ceil", "sin", "cos", "tan", "log", "exp" };
+            if (std::find(std::begin(direct), std::end(direct), builtin.name) != std::end(direct)) {
+                return declare(Type::Number, "std::" + (builtin.name == "abs" ? std::string("fabs") : builtin.name) + "(" + asNumber(arguments[0]) + ")");
             }
-
-            block.push_back(token);
+            usedBuiltins[id] = true;
+            return declare(Type::Number, "builtins[" + builtinName(id) + "].numeric(" + asNumber(arguments[0]) + ")");
         }
 
-        if (!foundEndCommand) {
-            throw std::runtime_error("Estrutura de bloco invlida: faltando comando '" + endCommand + "'.");
+        usedBuiltins[id] = true;
+        std::string list;
+        for (const Operand& argument : arguments) {
+            list += list.empty() ? " " : ", ";
+            list += asValue(argument);
         }
-
-        return block;
+        std::string invocation = "rt.builtin(" + builtinName(id) + ", {" + list + " })";
+        if (returnsNumber(builtin)) {
+            return declare(Type::Number, invocation + ".number");
+        }
+        return declare(Type::Value, invocation);
     }
 
-    double calculateExpression(const std::string& operand1, const std::string& operatorSymbol, const std::string& operand2) {
-        double value1 = std::stod(operand1);
-        double value2 = std::stod(operand2);
-        double result = 0.0;
-
-        if (operatorSymbol == "+") {
-            result = value1 + value2;
-        }
-        else if (operatorSymbol == "-") {
-            result = value1 - value2;
-        }
-        else if (operatorSymbol == "*") {
-            result = value1 * value2;
+    // Literal text is gathered and appended in one piece, as the compiler's templates do
+    void appendItem(const Expr& expr, const std::string& text, std::string& literal) {
+        if (expr.kind == ExprKind::String) {
+            literal += expr.literal.text();
         }
-        else if (operatorSymbol == "/") {
-            if (value2 == 0.0) {
-                throw std::runtime_error("Erro: diviso por zero.");
+        else if (expr.kind == ExprKind::FString) {
+            literal += expr.segments[0];
+            for (size_t i = 0; i < expr.operands.size(); ++i) {
+                appendItem(*expr.operands[i], text, literal);
+                literal += expr.segments[i + 1];
             }
-            result = value1 / value2;
         }
         else {
-            throw std::runtime_error("Operador invlido: " + operatorSymbol);
+            flushLiteral(text, literal);
+            Operand value = expression(expr);
+            switch (value.type) {
+            case Type::Number:
+                line("appendNumber(" + text + ", " + value.code + ", rt.numbers());");
+                break;
+            case Type::Boolean:
+                line(text + " += " + value.code + " ? \"true\" : \"false\";");
+                break;
+            case Type::Value:
+                line(value.code + ".appendTo(" + text + ", rt.numbers());");
+                break;
+            }
         }
-
-        return result;
     }
-    
-    void interpretPrint(const std::vector<std::string>& tokens) {
-        if (tokens.size() < 2) {
-            throw std::runtime_error("Sintaxe incorreta para o comando 'print'.");
+
+    void flushLiteral(const std::string& text, std::string& literal) {
+        if (!literal.empty()) {
+            line(text + " += " + quote(literal) + ";");
+            literal.clear();
         }
+    }
 
-        std::ostringstream resultStream;
-        for (size_t i = 1; i < tokens.size(); ++i) {
-            std::string token = tokens[i];
+    // Statements
 
-            if (token.front() == '"' && token.back() == '"') {
-                // Remover as aspas no incio e no final do token
-                token = token.substr(1, token.length() - 2);
-            }
-            else if (token.front() == 'f') {
-                // Remover o prefixo "f" para f-string
-                token = token.substr(1);
-            }
-
-            if (token.find("{") != std::string::npos && token.find("}") != std::string::npos) {
-                // Processar f-string (formatao de string)
-                std::regex variableRegex("\\{(.*?)\\}");
-                std::string::const_iterator searchStartPos = token.begin();
-                std::string::const_iterator searchEndPos = token.end();
-                std::smatch match;
-                while (std::regex_search(searchStartPos, searchEndPos, match, variableRegex)) {
-                    std::string variableName = match.str(1);
-                    if (variables.count(variableName) > 0) {
-                        resultStream << match.prefix() << variables[variableName];
-                        searchStartPos = match.suffix().first;
-                    }
-                    else {
-                        throw std::runtime_error("Varivel '" + variableName + "' no foi definida.");
-                    }
+    void emitBlock(const std::vector<StmtPtr>& block) {
+        for (const StmtPtr& stmt : block) {
+            emitStatement(*stmt);
+        }
+    }
+
+    void emitStatement(const Stmt& stmt) {
+        switch (stmt.kind) {
+        case StmtKind::Let:
+            store(stmt.local, stmt.slot, expression(*stmt.value));
+            break;
+        case StmtKind::Print: {
+            line("{");
+            ++indent;
+            std::string text = temp();
+            line("std::string " + text + ";");
+            std::string literal;
+            for (size_t i = 0; i < stmt.args.size(); ++i) {
+                if (i != 0) {
+                    literal += ' ';
                 }
-                resultStream << match.suffix();
+                appendItem(*stmt.args[i], text, literal);
             }
-            else {
-                resultStream << token;
+            flushLiteral(text, literal);
+            line("rt.print(" + text + ");");
+            --indent;
+            line("}");
+            break;
+        }
+        case StmtKind::If: {
+            Operand condition = expression(*stmt.value);
+            line("if (" + asCondition(condition) + ") {");
+            ++indent;
+            emitBlock(stmt.body);
+            --indent;
+            if (!stmt.elseBody.empty()) {
+                line("}");
+                line("else {");
+                ++indent;
+                emitBlock(stmt.elseBody);
+                --indent;
             }
-
-            // Adicionar espao em branco entre os tokens, exceto o ltimo
-            if (i < tokens.size() - 1) {
-                resultStream << " ";
+            line("}");
+            break;
+        }
+        case StmtKind::ForEach:
+            emitForEach(stmt);
+            break;
+        case StmtKind::Def:
+            line("rt.define();");
+            line(boundName(stmt.slot) + " = " + std::to_string(defIndex[&stmt]) + ";");
+            break;
+        case StmtKind::Return:
+            if (stmt.value && Interpreter::isTailCall(*stmt.value)) {
+                tailCall(*stmt.value);
+                break;
             }
+            if (stmt.value) {
+                store(stmt.local, -1, expression(*stmt.value));
+            }
+            line("goto done;");
+            usesDone = true;
+            break;
+        case StmtKind::Call:
+            call(stmt.slot, stmt.args, false);
+            break;
+        case StmtKind::BuiltinCommand:
+            line("rt.printResult(" + asValue(builtinCall(stmt.builtin, stmt.args)) + ");");
+            break;
+        case StmtKind::ToLower:
+        case StmtKind::ToUpper: {
+            Storage source = variable(stmt.sourceLocal, stmt.sourceSlot);
+            std::string read = source.number ? "Value::fromNumber(NativeRuntime::number(" + source.name + ", " + quote(source.text) + "))"
+                                             : "NativeRuntime::value(" + source.name + ", " + quote(source.text) + ")";
+            store(stmt.local, stmt.slot, declare(Type::Value, "rt.convertCase(" + read + (stmt.kind == StmtKind::ToLower ? ", true)" : ", false)")));
+            break;
         }
-
-        std::string output = resultStream.str();
-        // Remover as aspas da mensagem final
-        if (output.front() == '"' && output.back() == '"') {
-            output = output.substr(1, output.length() - 2);
+        case StmtKind::Yield:
+            line("rt.yield(" + asValue(expression(*stmt.value)) + ");");
+            break;
         }
-
-        std::cout << output << std::endl;
     }
 
-    std::string evaluateExpressionAsString(const std::string& expression) {
-        std::vector<std::string> tokens = split(expression, ' ');
-
-        // Check for function calls
-        if (tokens.size() > 1 && functions.count(tokens[0])) {
-            double result = evaluateFunctionCall(tokens);
-            return std::to_string(result);
+    // The elements of a range are computed in place; anything else goes through a
+    // Value made iterable as the VM does
+    void emitForEach(const Stmt& stmt) {
+        line("{");
+        ++indent;
+        std::string sequence = temp();
+        std::string index = temp();
+        std::string loop;
+        Operand element;
+        if (isRange(*stmt.value)) {
+            std::vector<Operand> bounds = evaluateAll(stmt.value->operands);
+            std::vector<std::string> numbers;
+            for (const Operand& bound : bounds) {
+                numbers.push_back(declare(Type::Number, asNumber(bound)).code);
+            }
+            line("RangeData " + sequence + " = NativeRuntime::range(" + numbers[0] + ", " + numbers[1] + ", " + (numbers.size() == 3 ? numbers[2] : "1.0") + ");");
+            loop = "for (size_t " + index + " = 0; " + index + " < " + sequence + ".count; ++" + index + ") {";
+            element = Operand{ sequence + ".at(" + index + ")", Type::Number };
         }
-
-        // Check for string literals
-        if (tokens.size() == 1 && tokens[0].front() == '"' && tokens[0].back() == '"') {
-            return tokens[0].substr(1, tokens[0].size() - 2);
+        else {
+            line("Value " + sequence + " = rt.iterable(" + asValue(expression(*stmt.value)) + ");");
+            std::string count = temp();
+            loop = "for (size_t " + index + " = 0, " + count + " = " + sequence + ".length(); " + index + " < " + count + "; ++" + index + ") {";
+            element = Operand{ "elementAt(" + sequence + ", " + index + ")", Type::Value };
         }
 
-        // Check for variables
-        if (tokens.size() == 1 && variables.count(tokens[0])) {
-            return variables[tokens[0]];
+        std::string enclosing;
+        if (stmt.parallel) {
+            enclosing = temp();
+            line("bool " + enclosing + " = rt.enterParallel();");
         }
-
-        // Check for arithmetic expressions
-        std::vector<std::string> postfix = infixToPostfix(tokens);
-        double result = evaluatePostfix(postfix);
-        return std::to_string(result);
-    }
-
-    void interpretForEach(const std::vector<std::string>& tokens) {
-        if (tokens.size() < 5 || tokens[2] != "in" || tokens[4] != "do") {
-            throw std::runtime_error("Sintaxe incorreta para o comando 'foreach'.");
+        if (!stmt.collect.empty()) {
+            line("rt.beginCollect();");
         }
-
-        const std::string& variable = tokens[1];
-        const std::string& iterable = tokens[3];
-        const std::vector<std::string>& block = getBlock(tokens, 5);
-
-        if (!variables.count(iterable)) {
-            throw std::runtime_error("Varivel no encontrada: " + iterable);
+        line(loop);
+        ++indent;
+        if (stmt.parallel) {
+            emitIteration(stmt, element);
         }
-
-        const std::vector<std::string>& values = split(variables[iterable], ',');
-
-        for (const std::string& value : values) {
-            variables[variable] = value;
-            interpret(block);
+        else {
+            store(stmt.local, stmt.slot, element);
+            emitBlock(stmt.body);
         }
+        --indent;
+        line("}");
+        if (stmt.parallel) {
+            line("rt.leaveParallel(" + enclosing + ");");
+        }
+        if (!stmt.collect.empty()) {
+            store(stmt.collectLocal, stmt.collectSlot, declare(Type::Value, "rt.endCollect()"));
+        }
+        --indent;
+        line("}");
     }
 
-    void interpretFunction(const std::vector<std::string>& tokens) {
-        if (tokens.size() < 4 || tokens[2] != "=>") {
-            throw std::runtime_error("Sintaxe incorreta para o comando 'def'.");
+    // An iteration of a parallel foreach gets a frame of its own, laid out like the
+    // VM's: the element, the captured locals copied in, and the rest unset
+    void emitIteration(const Stmt& loop, const Operand& element) {
+        Scope outer = scope;
+        Scope inner{ &loop, "p" + std::to_string(parallelBodies++) + "_" };
+        const std::vector<bool>& numbers = localNumbers[&loop];
+        for (size_t i = 0; i < loop.locals.size(); ++i) {
+            line(std::string(numbers[i] ? "NativeRuntime::Number " : "Variable ") + localName(inner, static_cast<int32_t>(i)) + ";");
         }
-
-        const std::string& functionName = tokens[1];
-        const std::vector<std::string>& parameters = split(tokens[3], ',');
-
-        std::vector<std::string> block = getBlock(tokens, 4 + parameters.size());
-        functions[functionName] = block;
-
-        for (const std::string& parameter : parameters) {
-            if (parameter.back() == ':') {
-                booleanVariables[parameter.substr(0, parameter.size() - 1)] = false;
+        line("NativeRuntime::set(" + localName(inner, 0) + ", " + (numbers[0] ? asNumber(element) : asValue(element)) + ");");
+        for (const auto& capture : loop.captures) {
+            std::string from = localName(outer, capture.first);
+            std::string to = localName(inner, capture.second);
+            if (numbers[capture.second] || !localNumbers[outer.owner][capture.first]) {
+                line(to + " = " + from + ";");
             }
             else {
-                variables[parameter] = "0";
+                line(to + " = { Value::fromNumber(" + from + ".value), " + from + ".defined };");
             }
         }
+        scope = inner;
+        emitBlock(loop.body);
+        scope = outer;
     }
+};
 
-    void interpretFunctionCall(const std::vector<std::string>& tokens) {
-        std::string function = tokens[0];
-        if (functions.count(function)) {
-            std::vector<std::string> args(tokens.begin() + 1, tokens.end());
-
-            std::vector<std::string> params = functions[function];
-            if (params.size() != args.size()) {
-                throw std::runtime_error("Nmero incorreto de argumentos para a funo: " + function);
-            }
-
-            for (size_t i = 0; i < params.size(); i++) {
-                variables[params[i]] = args[i];
-            }
-
-            interpret(params);
+#ifndef HY_RUNTIME_ONLY
+// Times a cold start, compiling the source, against a warm one, mapping the cached
+// bytecode. Both open and read the source, since a warm start still hashes it.
+// Without --cache-dir the cache goes to the temporary directory and is removed at
+// the end, so nothing is left beside the script.
+static int runStartupBenchmark(const std::string& scriptPath, const std::string& cacheDirectory, bool optimize, NumberFormat numbers) {
+    const size_t rounds = 51;
+    std::vector<double> cold;
+    std::vector<double> warm;
+    std::string directory = cacheDirectory;
+    bool temporary = directory.empty();
+    if (temporary) {
+        std::error_code error;
+        directory = std::filesystem::temp_directory_path(error).string();
+        if (error) {
+            std::cout << "Diretrio temporrio no encontrado: " << error.message() << std::endl;
+            return 1;
         }
     }
-
-
-    double evaluateFunctionCall(const std::vector<std::string>& tokens) {
-        const std::string& functionName = tokens[0];
-        const std::vector<std::string>& arguments = split(tokens[1], ',');
-
-        if (!functions.count(functionName)) {
-            throw std::runtime_error("Funo no encontrada: " + functionName);
-        }
-
-        const std::vector<std::string>& functionBlock = functions[functionName];
-
-        if (arguments.size() != functionBlock.size()) {
-            throw std::runtime_error("Nmero incorreto de argumentos para a funo " + functionName);
+    std::string cachePath;
+    for (size_t round = 0; round < rounds; ++round) {
+        auto start = std::chrono::steady_clock::now();
+        SourceFile source;
+        if (!source.open(scriptPath)) {
+            std::cout << "Arquivo no encontrado: " << scriptPath << std::endl;
+            return 1;
         }
-
-        for (size_t i = 0; i < arguments.size(); ++i) {
-            const std::string& parameter = functionBlock[i];
-            const std::string& argument = arguments[i];
-
-            if (parameter.back() == ':') {
-                booleanVariables[parameter.substr(0, parameter.size() - 1)] = evaluateCondition(argument);
-            }
-            else {
-                variables[parameter] = std::to_string(evaluateExpression(argument));
-            }
+        uint64_t key = ScriptCache::key(source.text(), optimize, numbers);
+        std::shared_ptr<const Script> script;
+        try {
+            script = Script::compile(source.text(), optimize, numbers);
         }
-
-        interpret(functionBlock);
-
-        if (variables.count(functionName)) {
-            return std::stod(variables[functionName]);
+        catch (const SyntaxError& e) {
+            std::cout << describeSyntaxError(e, source.text()) << std::endl;
+            return 1;
         }
-        else {
-            throw std::runtime_error("Funo no retornou um valor: " + functionName);
+        cold.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        if (round == 0) {
+            cachePath = ScriptCache::pathFor(scriptPath, directory, key);
+            if (!ScriptCache::store(*script, cachePath, key)) {
+                std::cout << "No foi possvel gravar o cache: " << cachePath << std::endl;
+                return 1;
+            }
         }
     }
-
-    void interpretSqrt(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 2) {
-            throw std::runtime_error("Sintaxe incorreta para a funo 'sqrt'.");
+    for (size_t round = 0; round < rounds; ++round) {
+        auto start = std::chrono::steady_clock::now();
+        SourceFile source;
+        source.open(scriptPath);
+        std::shared_ptr<const Script> script = ScriptCache::load(cachePath, ScriptCache::key(source.text(), optimize, numbers));
+        if (!script) {
+            std::cout << "Cache invlido: " << cachePath << std::endl;
+            return 1;
         }
-
-        double arg = evaluateExpression(tokens[1]);
-        double result = std::sqrt(arg);
-        std::cout << result << std::endl;
+        warm.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    if (temporary) {
+        std::error_code ignored;
+        std::filesystem::remove(cachePath, ignored);
     }
 
-    void interpretAbs(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 2) {
-            throw std::runtime_error("Sintaxe incorreta para a funo 'abs'.");
-        }
+    std::sort(cold.begin(), cold.end());
+    std::sort(warm.begin(), warm.end());
+    double coldMedian = cold[rounds / 2];
+    double warmMedian = warm[rounds / 2];
+    std::cout << "Partida a frio (compilando o fonte): " << coldMedian << " s" << std::endl;
+    std::cout << "Partida a quente (bytecode do cache): " << warmMedian << " s" << std::endl;
+    std::cout << "Acelerao: " << coldMedian / warmMedian << "x (medianas de " << rounds << " rodadas)" << std::endl;
+    return 0;
+}
 
-        double arg = evaluateExpression(tokens[1]);
-        double result = std::abs(arg);
-        std::cout << result << std::endl;
+// Times the numeric text layer against what it replaced: std::stod, which throws on
+// every token that is not a number, and std::to_string. Medians of ns per item.
+static int runNumberBenchmark() {
+    static const char* const samples[] = {
+        "let", "total", "=", "42", "+", "preco", "*", "3.25", "(", "x", ")", "-", "1e5",
+        "nome", ",", "0.5", "foreach", "i", "in", "range", "7", "do", "print", "f", "end"
+    };
+    static const double values[] = { 23.0, -4.0, 0.1, 1234.5678, 3.0 / 7.0, 100.0, 1e21, -0.001 };
+    const size_t rounds = 21;
+    const size_t passes = 4000;
+    std::vector<std::string> tokens(std::begin(samples), std::end(samples));
+    size_t numeric = 0;
+    for (const std::string& token : tokens) {
+        double value = 0.0;
+        numeric += parseNumber(token, value) ? 1 : 0;
     }
 
-    void interpretRound(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 2) {
-            throw std::runtime_error("Sintaxe incorreta para a funo 'round'.");
+    volatile size_t sink = 0;   // keeps the loops from being optimized away
+    auto median = [&](size_t items, const std::function<void()>& pass) {
+        std::vector<double> times;
+        for (size_t round = 0; round < rounds; ++round) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < passes; ++i) {
+                pass();
+            }
+            times.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / static_cast<double>(passes * items));
         }
+        std::sort(times.begin(), times.end());
+        return times[rounds / 2];
+    };
 
-        double arg = evaluateExpression(tokens[1]);
-        double result = std::round(arg);
-        std::cout << result << std::endl;
-    }
+    double fromChars = median(tokens.size(), [&] {
+        for (const std::string& token : tokens) {
+            double value = 0.0;
+            sink = sink + (parseNumber(token, value) ? 1 : 0);
+        }
+    });
+    double stod = median(tokens.size(), [&] {
+        for (const std::string& token : tokens) {
+            try {
+                size_t pos = 0;
+                std::stod(token, &pos);
+                sink = sink + (pos == token.size() ? 1 : 0);
+            }
+            catch (const std::exception&) {
+            }
+        }
+    });
 
-    void interpretFloor(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 2) {
-            throw std::runtime_error("Sintaxe incorreta para a funo 'floor'.");
+    std::string text;
+    auto writeAll = [&](NumberFormat format) {
+        return [&text, &sink, format] {
+            for (double value : values) {
+                text.clear();
+                appendNumber(text, value, format);
+                sink = sink + text.size();
+            }
+        };
+    };
+    double fixed = median(std::size(values), writeAll(NumberFormat::Fixed));
+    double shortest = median(std::size(values), writeAll(NumberFormat::Shortest));
+    double toString = median(std::size(values), [&] {
+        for (double value : values) {
+            sink = sink + std::to_string(value).size();
         }
+    });
 
-        double arg = evaluateExpression(tokens[1]);
-        double result = std::floor(arg);
-        std::cout << result << std::endl;
-    }
+    std::cout << "Classificao de " << tokens.size() << " tokens, " << tokens.size() - numeric << " deles no numricos:" << std::endl;
+    std::cout << "  from_chars, sem excees: " << fromChars << " ns por token" << std::endl;
+    std::cout << "  std::stod com excees:   " << stod << " ns por token (" << stod / fromChars << "x)" << std::endl;
+    std::cout << "Escrita de " << std::size(values) << " nmeros:" << std::endl;
+    std::cout << "  to_chars, seis decimais:  " << fixed << " ns por nmero" << std::endl;
+    std::cout << "  to_chars, mais curta:     " << shortest << " ns por nmero" << std::endl;
+    std::cout << "  std::to_string:           " << toString << " ns por nmero (" << toString / fixed << "x)" << std::endl;
+    std::cout << "(medianas de " << rounds << " rodadas)" << std::endl;
+    return 0;
+}
 
-    void interpretCeil(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 2) {
-            throw std::runtime_error("Sintaxe incorreta para a funo 'ceil'.");
-        }
+struct BenchmarkTrial {
+    double milliseconds = 0.0;
+    long peakKilobytes = -1;    // -1 where the platform cannot tell
+    bool failed = false;
+};
 
-        double arg = evaluateExpression(tokens[1]);
-        double result = std::ceil(arg);
-        std::cout << result << std::endl;
+// One whole run, from reading the source to the end of the script, writing to `sink`
+static bool runQuietly(const std::string& path, bool treeWalker, bool jit, bool optimize, NumberFormat numbers, int sink) {
+    try {
+        std::shared_ptr<const Script> script = Script::load(path, optimize, numbers);
+        Context context;
+        context.treeWalker = treeWalker;
+        context.jit = jit;
+        context.numberFormat = numbers;
+        context.output.redirectToDescriptor(sink);
+        context.run(script);
+        context.output.flush();
+        return true;
     }
+    catch (const std::exception&) {
+        return false;
+    }
+}
 
-    void interpretSin(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 2) {
-            throw std::runtime_error("Sintaxe incorreta para a funo 'sin'.");
-        }
-
-        double arg = evaluateExpression(tokens[1]);
-        double result = std::sin(arg);
-        std::cout << result << std::endl;
+// Each trial runs in a child process, like a command-line benchmark tool would run
+// the interpreter, so the peak resident size is the script's alone. Windows has no
+// fork; trials run in this process there and the peak size is not reported.
+static BenchmarkTrial runTrial(const std::string& path, bool treeWalker, bool jit, bool optimize, NumberFormat numbers) {
+    BenchmarkTrial trial;
+    auto start = std::chrono::steady_clock::now();
+#ifdef _WIN32
+    int sink = _open("NUL", _O_WRONLY);
+    trial.failed = !runQuietly(path, treeWalker, jit, optimize, numbers, sink);
+    _close(sink);
+#else
+    std::cout.flush();
+    pid_t child = fork();
+    if (child == 0) {
+        int sink = ::open("/dev/null", O_WRONLY);
+        _exit(runQuietly(path, treeWalker, jit, optimize, numbers, sink) ? 0 : 1);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (child < 0 || wait4(child, &status, 0, &usage) != child) {
+        trial.failed = true;
+        return trial;
     }
+    trial.failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+#ifdef __APPLE__
+    trial.peakKilobytes = static_cast<long>(usage.ru_maxrss / 1024);
+#else
+    trial.peakKilobytes = static_cast<long>(usage.ru_maxrss);
+#endif
+#endif
+    trial.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return trial;
+}
 
-    void interpretCos(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 2) {
-            throw std::runtime_error("Sintaxe incorreta para a funo 'cos'.");
+// Runs every .hy file of `directory`, in name order, `warmup` times untimed and then
+// `runs` times timed, and prints the results as JSON. An op is one run of the script.
+static int runBenchmarks(const std::string& directory, size_t runs, size_t warmup, bool treeWalker, bool jit, bool optimize, NumberFormat numbers) {
+    std::vector<std::string> files;
+    std::error_code error;
+    for (std::filesystem::directory_iterator it(directory, error), end; !error && it != end; it.increment(error)) {
+        if (it->path().extension() == ".hy") {
+            files.push_back(it->path().string());
         }
-
-        double arg = evaluateExpression(tokens[1]);
-        double result = std::cos(arg);
-        std::cout << result << std::endl;
     }
+    if (files.empty()) {
+        std::cout << "Nenhum benchmark encontrado em: " << directory << std::endl;
+        return 1;
+    }
+    std::sort(files.begin(), files.end());
 
-    void interpretTan(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 2) {
-            throw std::runtime_error("Sintaxe incorreta para a funo 'tan'.");
-        }
+    std::string json = "{\n  \"engine\": ";
+    appendJsonString(json, treeWalker ? "tree-walker" : "vm");
+    json += ",\n  \"jit\": ";
+    json += (jit && !treeWalker) ? "true" : "false";
+    json += ",\n  \"optimize\": ";
+    json += optimize ? "true" : "false";
+    json += ",\n  \"runs\": " + std::to_string(runs) + ",\n  \"warmup\": " + std::to_string(warmup) + ",\n  \"benchmarks\": [";
 
-        double arg = evaluateExpression(tokens[1]);
-        double result = std::tan(arg);
-        std::cout << result << std::endl;
-    }
+    bool failed = false;
+    for (size_t index = 0; index < files.size(); ++index) {
+        const std::string& file = files[index];
+        std::cerr << "Executando " << file << std::endl;
 
-    void interpretLog(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 2) {
-            throw std::runtime_error("Sintaxe incorreta para a funo 'log'.");
+        std::vector<double> times;
+        long peakKilobytes = -1;
+        bool trialFailed = false;
+        for (size_t trial = 0; trial < warmup + runs && !trialFailed; ++trial) {
+            BenchmarkTrial result = runTrial(file, treeWalker, jit, optimize, numbers);
+            trialFailed = result.failed;
+            if (trial >= warmup) {
+                times.push_back(result.milliseconds);
+                peakKilobytes = std::max(peakKilobytes, result.peakKilobytes);
+            }
         }
 
-        double arg = evaluateExpression(tokens[1]);
-        double result = std::log(arg);
-        std::cout << result << std::endl;
-    }
-
-    void interpretExp(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 2) {
-            throw std::runtime_error("Sintaxe incorreta para a funo 'exp'.");
+        json += (index == 0) ? "\n    {\"name\": " : ",\n    {\"name\": ";
+        appendJsonString(json, std::filesystem::path(file).stem().string());
+        json += ", \"file\": ";
+        appendJsonString(json, file);
+        if (trialFailed) {
+            json += ", \"error\": ";
+            appendJsonString(json, "o script terminou com erro");
+            json += "}";
+            failed = true;
+            continue;
         }
 
-        double arg = evaluateExpression(tokens[1]);
-        double result = std::exp(arg);
-        std::cout << result << std::endl;
+        // Nearest-rank percentiles; with few runs the p99 is the slowest run
+        std::sort(times.begin(), times.end());
+        size_t count = times.size();
+        double median = (count % 2 == 1) ? times[count / 2] : (times[count / 2 - 1] + times[count / 2]) / 2.0;
+        double p99 = times[static_cast<size_t>(std::ceil(0.99 * static_cast<double>(count))) - 1];
+        json += ", \"median_ms\": ";
+        appendGeneralNumber(json, median);
+        json += ", \"p99_ms\": ";
+        appendGeneralNumber(json, p99);
+        json += ", \"min_ms\": ";
+        appendGeneralNumber(json, times.front());
+        json += ", \"max_ms\": ";
+        appendGeneralNumber(json, times.back());
+        json += ", \"ops_per_sec\": ";
+        appendGeneralNumber(json, 1000.0 / median);
+        json += ", \"peak_rss_kb\": ";
+        json += (peakKilobytes >= 0) ? std::to_string(peakKilobytes) : std::string("null");
+        json += "}";
     }
+    json += "\n  ]\n}\n";
+    std::cout << json;
+    return failed ? 1 : 0;
+}
 
-    void interpretToLower(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 3) {
-            throw std::runtime_error("Uso incorreto da funo tolower");
-        }
-
-        std::string variable = tokens[1];
-        std::string value = tokens[2];
+int main(int argc, char* argv[]) {
+    setlocale(LC_ALL, "Portuguese");
 
-        if (variables.count(value)) {
-            std::string str = variables[value];
-            std::transform(str.begin(), str.end(), str.begin(), ::tolower);
-            variables[variable] = str;
+    bool useTreeWalker = false;
+    bool useJit = true;
+    bool showResolverStats = false;
+    bool optimize = true;
+    bool dumpOptimized = false;
+    bool emitCpp = false;
+    bool useCache = false;
+    bool startupBenchmark = false;
+    bool showAllocationStats = false;
+    bool profile = false;
+    std::string profilePath;
+    bool showStats = false;
+    size_t traceLength = 0;
+    bool benchmark = false;
+    size_t benchmarkRuns = 10;
+    size_t benchmarkWarmup = 2;
+    std::string cacheDirectory;
+    bool numberBenchmark = false;
+    size_t maxCallDepth = 1000;
+    size_t memoSize = 4096;
+    NumberFormat numberFormat = NumberFormat::Fixed;
+#ifdef _WIN32
+    bool interactiveOutput = _isatty(1) != 0;
+#else
+    bool interactiveOutput = isatty(1) != 0;
+#endif
+    FlushPolicy flushPolicy = interactiveOutput ? FlushPolicy::Line : FlushPolicy::Full;
+    std::string scriptPath;
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument == "--tree-walker") {
+            useTreeWalker = true;
         }
-        else {
-            throw std::runtime_error("Varivel no encontrada: " + value);
+        else if (argument == "--no-jit") {
+            useJit = false;
         }
-    }
-
-    void interpretToUpper(const std::vector<std::string>& tokens) {
-        if (tokens.size() != 3) {
-            throw std::runtime_error("Uso incorreto da funo toupper");
+        else if (argument == "--resolver-stats") {
+            showResolverStats = true;
         }
-
-        std::string variable = tokens[1];
-        std::string value = tokens[2];
-
-        if (variables.count(value)) {
-            std::string str = variables[value];
-            std::transform(str.begin(), str.end(), str.begin(), ::toupper);
-            variables[variable] = str;
+        else if (argument.rfind("--max-depth=", 0) == 0) {
+            size_t depth = 0;
+            const char* first = argument.data() + 12;
+            const char* last = argument.data() + argument.size();
+            auto result = std::from_chars(first, last, depth);
+            if (result.ec != std::errc() || result.ptr != last || depth == 0) {
+                std::cout << "Profundidade mxima invlida: " << argument.substr(12) << std::endl;
+                return 1;
+            }
+            maxCallDepth = depth;
         }
-        else {
-            throw std::runtime_error("Varivel no encontrada: " + value);
+        else if (argument.rfind("--memo-size=", 0) == 0) {
+            size_t size = 0;
+            const char* first = argument.data() + 12;
+            const char* last = argument.data() + argument.size();
+            auto result = std::from_chars(first, last, size);
+            if (result.ec != std::errc() || result.ptr != last) {
+                std::cout << "Tamanho de memoizao invlido: " << argument.substr(12) << std::endl;
+                return 1;
+            }
+            memoSize = size;
         }
-    }
-
-    bool isNumber(const std::string& token) {
-        std::size_t pos = 0;
-        std::stod(token, &pos);
-        return pos == token.size();
-    }
-
-    bool isFunction(const std::string& token) {
-        return functions.count(token);
-    }
-
-    int getPrecedence(const std::string& op) {
-        if (op == "+" || op == "-") {
-            return 1;
+        else if (argument.rfind("--threads=", 0) == 0) {
+            size_t threads = 0;
+            const char* first = argument.data() + 10;
+            const char* last = argument.data() + argument.size();
+            auto result = std::from_chars(first, last, threads);
+            if (result.ec != std::errc() || result.ptr != last || threads == 0) {
+                std::cout << "Nmero de threads invlido: " << argument.substr(10) << std::endl;
+                return 1;
+            }
+            parallelThreads = threads;
         }
-        else if (op == "*" || op == "/") {
-            return 2;
+        else if (argument == "--simd=scalar" || argument == "--simd=sse2" || argument == "--simd=avx2") {
+            SimdLevel requested = (argument == "--simd=scalar") ? SimdLevel::Scalar : (argument == "--simd=sse2") ? SimdLevel::Sse2 : SimdLevel::Avx2;
+            simdLevel = std::min(requested, simdSupported);
         }
-        else if (op == "^") {
-            return 3;
+        else if (argument == "--no-optimize") {
+            optimize = false;
         }
-        else {
-            return 0;
+        else if (argument == "--dump-optimized") {
+            dumpOptimized = true;
         }
-    }
-
-    double evaluateOperator(const std::string& op, double lhs, double rhs) {
-        if (op == "+") {
-            return lhs + rhs;
+        else if (argument == "--emit-cpp") {
+            emitCpp = true;
         }
-        else if (op == "-") {
-            return lhs - rhs;
+        else if (argument == "--cache") {
+            useCache = true;
         }
-        else if (op == "*") {
-            return lhs * rhs;
+        else if (argument.rfind("--cache-dir=", 0) == 0 && argument.size() > 12) {
+            useCache = true;
+            cacheDirectory = argument.substr(12);
         }
-        else if (op == "/") {
-            if (rhs == 0) {
-                throw std::runtime_error("Diviso por zero.");
+        else if (argument == "--startup-bench") {
+            startupBenchmark = true;
+        }
+        else if (argument == "--number-bench") {
+            numberBenchmark = true;
+        }
+        else if (argument == "--numbers=short" || argument == "--numbers=fixed") {
+            numberFormat = (argument == "--numbers=short") ? NumberFormat::Shortest : NumberFormat::Fixed;
+        }
+        else if (argument == "--alloc-stats") {
+            showAllocationStats = true;
+        }
+        else if (argument == "--profile") {
+            profile = true;
+        }
+        else if (argument.rfind("--profile-out=", 0) == 0 && argument.size() > 14) {
+            profile = true;
+            profilePath = argument.substr(14);
+        }
+        else if (argument == "--stats") {
+            showStats = true;
+        }
+        else if (argument == "--trace") {
+            traceLength = 20;
+        }
+        else if (argument.rfind("--trace=", 0) == 0) {
+            size_t length = 0;
+            const char* first = argument.data() + 8;
+            const char* last = argument.data() + argument.size();
+            auto result = std::from_chars(first, last, length);
+            if (result.ec != std::errc() || result.ptr != last || length == 0) {
+                std::cout << "Tamanho de rastro invlido: " << argument.substr(8) << std::endl;
+                return 1;
             }
-            return lhs / rhs;
+            traceLength = length;
         }
-        else if (op == "^") {
-            return std::pow(lhs, rhs);
+        else if (argument == "--bench") {
+            benchmark = true;
+        }
+        else if (argument.rfind("--bench-runs=", 0) == 0 || argument.rfind("--bench-warmup=", 0) == 0) {
+            bool isRuns = argument.rfind("--bench-runs=", 0) == 0;
+            size_t prefix = isRuns ? 13 : 15;
+            size_t value = 0;
+            const char* first = argument.data() + prefix;
+            const char* last = argument.data() + argument.size();
+            auto result = std::from_chars(first, last, value);
+            if (result.ec != std::errc() || result.ptr != last || (isRuns && value == 0)) {
+                std::cout << "Nmero de execues invlido: " << argument.substr(prefix) << std::endl;
+                return 1;
+            }
+            (isRuns ? benchmarkRuns : benchmarkWarmup) = value;
+        }
+        else if (argument == "--flush=line") {
+            flushPolicy = FlushPolicy::Line;
+        }
+        else if (argument == "--flush=full") {
+            flushPolicy = FlushPolicy::Full;
+        }
+        else if (argument.rfind("--", 0) != 0 && scriptPath.empty()) {
+            scriptPath = argument;
         }
         else {
-            throw std::runtime_error("Operador desconhecido: " + op);
+            std::cout << "Uso incorreto do interpretador. Utilize o comando \"interpreter help\" para obter ajuda." << std::endl;
+            return 1;
         }
     }
-};
-
-int main(int argc, char* argv[]) {
-    setlocale(LC_ALL, "Portuguese");
 
-    if (argc > 2) {
-        std::cout << "Uso incorreto do interpretador. Utilize o comando \"interpreter help\" para obter ajuda." << std::endl;
-        return 1;
-    }
-
-    if (argc == 2 && std::string(argv[1]) == "help") {
+    if (scriptPath == "help") {
         std::cout << "Este  um interpretador de linguagens de script." << std::endl;
-        std::cout << "Para executar um arquivo de script, utilize o comando \"interpreter <arquivo>\"." << std::endl;
+        std::cout << "Para executar um arquivo de script, utilize o comando \"interpreter [opes] <arquivo>\"." << std::endl;
         std::cout << "Se nenhum arquivo for fornecido, o programa ser executado em modo de teste." << std::endl;
+        std::cout << "Opes:" << std::endl;
+        std::cout << "  --tree-walker      executa a rvore sinttica diretamente em vez do bytecode" << std::endl;
+        std::cout << "  --no-jit           no compila para cdigo de mquina as funes numricas mais chamadas" << std::endl;
+        std::cout << "  --resolver-stats   mostra quantos smbolos foram resolvidos em slots e quantas buscas foram dinmicas" << std::endl;
+        std::cout << "  --max-depth=N      limita as chamadas de funo aninhadas (padro 1000)" << std::endl;
+        std::cout << "  --memo-size=N      resultados guardados por funo 'def pure' (padro 4096, 0 desliga)" << std::endl;
+        std::cout << "  --threads=N        threads usadas por parallel foreach (padro: uma por ncleo)" << std::endl;
+        std::cout << "  --simd=NVEL       limita as instrues vetoriais da matemtica sobre listas: scalar, sse2 ou avx2" << std::endl;
+        std::cout << "  --no-optimize      desliga a dobra de constantes e a eliminao de ramos mortos" << std::endl;
+        std::cout << "  --numbers=short    escreve nmeros inteiros sem casas decimais e os demais com o mnimo de dgitos" << std::endl;
+        std::cout << "  --numbers=fixed    escreve nmeros com seis casas decimais, como 23.000000 (padro)" << std::endl;
+        std::cout << "  --dump-optimized   mostra o script depois da otimizao, sem execut-lo" << std::endl;
+        std::cout << "  --emit-cpp         escreve o script como um programa C++, para compilar com -O2, sem execut-lo" << std::endl;
+        std::cout << "  --cache            guarda o bytecode em <arquivo>.hyc e o reaproveita enquanto o fonte no mudar" << std::endl;
+        std::cout << "  --cache-dir=DIR    como --cache, mas guarda o bytecode em DIR, com o nome dado pelo hash do fonte" << std::endl;
+        std::cout << "  --startup-bench    compara a partida compilando o fonte com a partida pelo cache, sem executar" << std::endl;
+        std::cout << "  --number-bench     compara a leitura e a escrita de nmeros com std::stod e std::to_string" << std::endl;
+        std::cout << "  --alloc-stats      mostra quantas alocaes no heap a compilao e a execuo fizeram" << std::endl;
+        std::cout << "  --profile          mostra, ao final, execues e tempo por linha, por funo e por builtin" << std::endl;
+        std::cout << "  --profile-out=ARQ  como --profile, e grava as pilhas amostradas em ARQ no formato de flame graph" << std::endl;
+        std::cout << "  --stats            mostra, ao final, os contadores da execuo em JSON" << std::endl;
+        std::cout << "  --trace[=N]        em caso de erro, mostra as ltimas N linhas executadas (padro 20)" << std::endl;
+        std::cout << "  --bench [DIR]      mede os scripts .hy de DIR (padro bench) e mostra os resultados em JSON" << std::endl;
+        std::cout << "  --bench-runs=N     execues medidas de cada script (padro 10)" << std::endl;
+        std::cout << "  --bench-warmup=N   execues de aquecimento, no medidas (padro 2)" << std::endl;
+        std::cout << "  --flush=line       envia a sada a cada linha (padro em terminais)" << std::endl;
+        std::cout << "  --flush=full       envia a sada s quando o buffer enche ou no fim (padro em arquivos e pipes)" << std::endl;
         return 0;
     }
 
-    Interpreter interpreter;
+    if (benchmark) {
+        return runBenchmarks(scriptPath.empty() ? "bench" : scriptPath, benchmarkRuns, benchmarkWarmup, useTreeWalker, useJit, optimize, numberFormat);
+    }
+    if (numberBenchmark) {
+        return runNumberBenchmark();
+    }
+    if (startupBenchmark) {
+        if (scriptPath.empty()) {
+            std::cout << "A opo --startup-bench precisa de um arquivo de script." << std::endl;
+            return 1;
+        }
+        return runStartupBenchmark(scriptPath, cacheDirectory, optimize, numberFormat);
+    }
+    if (scriptPath.empty() && (emitCpp || dumpOptimized)) {
+        std::cout << "A opo " << (emitCpp ? "--emit-cpp" : "--dump-optimized") << " precisa de um arquivo de script." << std::endl;
+        return 1;
+    }
+
+    Context context;
+    context.treeWalker = useTreeWalker;
+    context.jit = useJit;
+    context.maxCallDepth = maxCallDepth;
+    context.memoSize = memoSize;
+    context.numberFormat = numberFormat;
+    context.output.setPolicy(flushPolicy);
 
-    if (argc == 1) {
+    if (scriptPath.empty()) {
         std::cout << "Modo de teste ativado. Digite os comandos linha a linha." << std::endl;
         std::cout << "Pressione Ctrl + C para sair." << std::endl;
 
+        // Every line becomes a part of one script, so functions defined earlier remain callable
+        auto session = std::make_shared<Script>();
+        session->numberFormat = numberFormat;
         while (true) {
             std::string line;
             std::cout << "> ";
-            std::getline(std::cin, line);
-
-            std::vector<std::string> tokens = interpreter.split(line, ' ');
+            if (!std::getline(std::cin, line)) {
+                break;
+            }
 
             try {
-                interpreter.interpret(tokens);
+                context.run(session, session->append(line, optimize, false));
             }
             catch (const std::exception& e) {
+                context.output.flush();
                 std::cout << "Erro: " << e.what() << std::endl;
             }
+            context.output.flush();
         }
     }
     else {
-        std::ifstream file(argv[1]);
-
-        if (!file) {
-            std::cout << "Arquivo no encontrado: " << argv[1] << std::endl;
+        SourceFile source;
+        if (!source.open(scriptPath)) {
+            std::cout << "Arquivo no encontrado: " << scriptPath << std::endl;
             return 1;
         }
+        countAllocations = showAllocationStats;
 
-        std::string line;
-        while (std::getline(file, line)) {
-            std::vector<std::string> tokens = interpreter.split(line, ' ');
+        // The cache only holds bytecode without line markers, so it is skipped when the
+        // tree is needed or the run is observed
+        bool lineMarkers = profile || showStats || traceLength > 0;
+        bool cached = useCache && !useTreeWalker && !dumpOptimized && !emitCpp && !lineMarkers;
+        uint64_t cacheKey = 0;
+        std::string cachePath;
+        std::shared_ptr<const Script> script;
+        if (cached) {
+            cacheKey = ScriptCache::key(source.text(), optimize, numberFormat);
+            cachePath = ScriptCache::pathFor(scriptPath, cacheDirectory, cacheKey);
+            script = ScriptCache::load(cachePath, cacheKey);
+        }
 
+        // The whole script is lexed and parsed in one pass; tokens point into the mapped file
+        if (!script) {
             try {
-                interpreter.interpret(tokens);
+                script = Script::compile(source.text(), optimize, numberFormat, lineMarkers);
             }
-            catch (const std::exception& e) {
-                std::cout << "Erro: " << e.what() << std::endl;
+            catch (const SyntaxError& e) {
+                std::cout << describeSyntaxError(e, source.text()) << std::endl;
                 return 1;
             }
+            if (cached) {
+                ScriptCache::store(*script, cachePath, cacheKey);
+            }
+        }
+
+        if (emitCpp) {
+            CppEmitter emitter(*script);
+            std::cout << emitter.emit(scriptPath);
+            return 0;
+        }
+
+        if (dumpOptimized) {
+            AstPrinter printer;
+            std::cout << printer.print(script->program);
+            std::cerr << "Expresses dobradas: " << script->folded << ", leituras propagadas: " << script->propagated
+                      << ", ramos eliminados: " << script->deadBranches << std::endl;
+            return 0;
+        }
+
+        Profiler profiler;
+        if (profile) {
+            context.profiler = &profiler;
+            profiler.start();
+        }
+        Metrics metrics;
+        if (showStats) {
+            context.metrics = &metrics;
+        }
+        ExecutionTrace trace(traceLength);
+        if (traceLength > 0) {
+            context.trace = &trace;
+        }
+
+        size_t compileAllocations = heapAllocations.load();
+        int status = 0;
+        try {
+            context.run(script);
+        }
+        catch (const std::exception& e) {
+            context.output.flush();
+            std::cout << "Erro: " << e.what() << std::endl;
+            status = 1;
+            if (traceLength > 0) {
+                std::cerr << "ltimas linhas executadas:" << std::endl;
+                for (uint32_t line : trace.lines()) {
+                    std::cerr << "  " << line << ": " << sourceLine(source.text(), line) << std::endl;
+                }
+            }
+        }
+        context.output.flush();
+
+        if (showStats) {
+            std::cerr << context.metricsJson();
+        }
+        if (profile) {
+            profiler.stop();
+            std::cerr << profiler.report(script->symbols);
+            if (!profilePath.empty() && !profiler.writeFolded(profilePath, script->symbols)) {
+                std::cerr << "No foi possvel gravar o perfil: " << profilePath << std::endl;
+            }
+        }
+        size_t runAllocations = heapAllocations.load() - compileAllocations;
+        countAllocations = false;
+
+        if (showAllocationStats) {
+            std::cerr << "Alocaes no heap: compilao " << compileAllocations << ", execuo " << runAllocations << std::endl;
+        }
+
+        if (showResolverStats) {
+            std::cerr << "Smbolos resolvidos: " << script->symbols.resolved << ", buscas dinmicas: " << script->symbols.dynamicLookups << std::endl;
         }
+        return status;
     }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file